@@ -0,0 +1,863 @@
+/* nioev_bench: MQTT load generator for measuring the throughput and end-to-end latency of a running broker.
+ *
+ * Publishers and subscribers run as threads in this process and connect to the broker via TCP, usually on loopback. Every payload
+ * starts with the CLOCK_MONOTONIC time at which the message should have been sent, so the subscribers can calculate the latency
+ * without synchronizing clocks. When publishing at a fixed rate, the scheduled instead of the actual send time is used, which
+ * avoids coordinated omission: a stalled broker delays every following message and that shows up in the percentiles.
+ *
+ * Run without arguments for a single scenario with the defaults, with --suite for a fixed set of scenarios or --help for the options.
+ */
+#include "LatencyHistogram.hpp"
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace nioev::bench {
+using mqtt::LatencyHistogram;
+
+constexpr uint8_t CONNECT = 1, CONNACK = 2, PUBLISH = 3, PUBACK = 4, PUBREC = 5, PUBREL = 6, PUBCOMP = 7, SUBSCRIBE = 8, SUBACK = 9;
+// the broker disconnects clients after twice the keep alive without traffic, which subscribers of QoS 0 messages never send
+constexpr uint16_t KEEP_ALIVE_SECONDS = 600;
+constexpr size_t TIMESTAMP_SIZE = sizeof(uint64_t);
+
+uint64_t monotonicNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+enum class TopicFilter {
+    EXACT,
+    SINGLE_LEVEL_WILDCARD,
+    MULTI_LEVEL_WILDCARD
+};
+
+struct Scenario {
+    std::string name{"custom"};
+    uint32_t publishers{1};
+    uint32_t subscribers{1};
+    uint8_t qos{0};
+    uint8_t mqttVersion{4};
+    uint32_t payloadSize{64};
+    // amount of distinct topics the publishers cycle through, every subscriber receives all of them
+    uint32_t topics{1};
+    // amount of topic levels below the prefix of the run
+    uint32_t topicDepth{1};
+    TopicFilter filter{TopicFilter::EXACT};
+    // all subscribers share one subscription, so every message is delivered once instead of once per subscriber
+    bool shared{false};
+    double seconds{5.0};
+    // messages per second and publisher, 0 means as fast as possible
+    uint32_t rate{0};
+    // QoS 1/2 messages a publisher sends before waiting for acknowledgements
+    uint32_t maxInflight{64};
+    // the shared subscription strategy the broker was configured with, only used to label the results
+    std::string strategy;
+};
+
+struct Result {
+    Scenario scenario;
+    uint64_t published{0};
+    uint64_t expected{0};
+    uint64_t received{0};
+    double publishSeconds{0};
+    double receiveSeconds{0};
+    // in the order of the subscriber connections
+    std::vector<uint64_t> receivedPerSubscriber;
+    LatencyHistogram latency;
+};
+
+struct PacketView {
+    uint8_t type{0};
+    uint8_t flags{0};
+    const uint8_t* body{nullptr};
+    size_t length{0};
+};
+
+void encodeVarInt(std::vector<uint8_t>& out, uint32_t value) {
+    do {
+        uint8_t byte = value % 128;
+        value /= 128;
+        if(value > 0)
+            byte |= 0x80;
+        out.push_back(byte);
+    } while(value > 0);
+}
+void encode2Bytes(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(value >> 8);
+    out.push_back(value & 0xFF);
+}
+void encodeString(std::vector<uint8_t>& out, std::string_view str) {
+    encode2Bytes(out, str.size());
+    out.insert(out.end(), str.begin(), str.end());
+}
+std::vector<uint8_t> makePacket(uint8_t type, uint8_t flags, const std::vector<uint8_t>& body) {
+    std::vector<uint8_t> packet;
+    packet.reserve(body.size() + 5);
+    packet.push_back(type << 4 | flags);
+    encodeVarInt(packet, body.size());
+    packet.insert(packet.end(), body.begin(), body.end());
+    return packet;
+}
+uint16_t decode2Bytes(const uint8_t* data) {
+    return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+// returns the amount of bytes of the variable byte integer
+size_t skipVarInt(const uint8_t* data, size_t length) {
+    size_t i = 0;
+    while(i < length && (data[i] & 0x80))
+        i += 1;
+    return i + 1;
+}
+
+// Blocking MQTT client connection with just enough of the protocol for benchmarking
+class Connection final {
+public:
+    Connection(const std::string& host, uint16_t port, uint8_t mqttVersion)
+    : mMqttVersion(mqttVersion) {
+        addrinfo hints = { 0 };
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        auto portStr = std::to_string(port);
+        if(int error = getaddrinfo(host.c_str(), portStr.c_str(), &hints, &addresses); error != 0) {
+            throw std::runtime_error{"getaddrinfo(" + host + "): " + gai_strerror(error)};
+        }
+        for(auto address = addresses; address; address = address->ai_next) {
+            mFd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            if(mFd < 0)
+                continue;
+            if(::connect(mFd, address->ai_addr, address->ai_addrlen) == 0)
+                break;
+            ::close(mFd);
+            mFd = -1;
+        }
+        freeaddrinfo(addresses);
+        if(mFd < 0) {
+            throw std::runtime_error{"Failed to connect to " + host + ":" + portStr + ": " + strerror(errno)};
+        }
+        int one = 1;
+        setsockopt(mFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        mBuffer.resize(64 * 1024);
+    }
+    ~Connection() {
+        if(mFd >= 0) {
+            ::close(mFd);
+        }
+    }
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    void login(const std::string& clientId) {
+        std::vector<uint8_t> body;
+        encodeString(body, "MQTT");
+        body.push_back(mMqttVersion);
+        body.push_back(0x02); // clean session
+        encode2Bytes(body, KEEP_ALIVE_SECONDS);
+        if(mMqttVersion == 5)
+            body.push_back(0); // no properties
+        encodeString(body, clientId);
+        send(makePacket(CONNECT, 0, body));
+        auto connack = waitForPacket(10'000);
+        if(connack.type != CONNACK || connack.length < 2 || connack.body[1] != 0) {
+            throw std::runtime_error{"Broker refused connection of " + clientId};
+        }
+    }
+    void subscribe(const std::vector<std::string>& filters, uint8_t qos) {
+        uint16_t id = 1;
+        for(auto& filter: filters) {
+            std::vector<uint8_t> body;
+            encode2Bytes(body, id++);
+            if(mMqttVersion == 5)
+                body.push_back(0);
+            encodeString(body, filter);
+            body.push_back(qos);
+            send(makePacket(SUBSCRIBE, 0x02, body));
+        }
+        for(size_t i = 0; i < filters.size(); ++i) {
+            auto suback = waitForPacket(10'000);
+            if(suback.type != SUBACK || suback.length < 3 || suback.body[suback.length - 1] >= 0x80) {
+                throw std::runtime_error{"Subscription was rejected"};
+            }
+        }
+    }
+
+    void send(const std::vector<uint8_t>& data) {
+        send(data.data(), data.size());
+    }
+    void send(const uint8_t* data, size_t length) {
+        size_t sent = 0;
+        while(sent < length) {
+            auto result = ::send(mFd, data + sent, length - sent, MSG_NOSIGNAL);
+            if(result < 0) {
+                if(errno == EINTR)
+                    continue;
+                throw std::runtime_error{std::string{"send(): "} + strerror(errno)};
+            }
+            sent += result;
+        }
+    }
+    void sendAck(uint8_t type, uint16_t id) {
+        uint8_t packet[4] = { static_cast<uint8_t>(type << 4 | (type == PUBREL ? 0x02 : 0)), 2, static_cast<uint8_t>(id >> 8), static_cast<uint8_t>(id & 0xFF) };
+        send(packet, sizeof(packet));
+    }
+
+    // Parses the next packet from the data received so far. The view is valid until the next read.
+    bool nextPacket(PacketView& packet) {
+        auto available = mEnd - mStart;
+        if(available < 2)
+            return false;
+        const uint8_t* data = mBuffer.data() + mStart;
+        uint32_t remainingLength = 0;
+        size_t headerLength = 1;
+        for(uint32_t multiplier = 1;; multiplier *= 128) {
+            if(headerLength >= available)
+                return false;
+            uint8_t byte = data[headerLength++];
+            remainingLength += (byte & 0x7F) * multiplier;
+            if(!(byte & 0x80))
+                break;
+            if(headerLength > 4)
+                throw std::runtime_error{"Malformed remaining length"};
+        }
+        if(available < headerLength + remainingLength) {
+            if(headerLength + remainingLength > mBuffer.size()) {
+                compact();
+                mBuffer.resize(headerLength + remainingLength);
+            }
+            return false;
+        }
+        packet.type = data[0] >> 4;
+        packet.flags = data[0] & 0x0F;
+        packet.body = data + headerLength;
+        packet.length = remainingLength;
+        mStart += headerLength + remainingLength;
+        return true;
+    }
+    // Reads whatever is available without blocking; returns false if nothing was
+    bool readAvailable() {
+        return read(MSG_DONTWAIT);
+    }
+    // Waits up to timeoutMs for more data; returns false on timeout
+    bool readSome(int timeoutMs) {
+        pollfd pfd = { mFd, POLLIN, 0 };
+        int result = poll(&pfd, 1, timeoutMs);
+        if(result < 0 && errno != EINTR)
+            throw std::runtime_error{std::string{"poll(): "} + strerror(errno)};
+        if(result <= 0)
+            return false;
+        return read(0);
+    }
+    PacketView waitForPacket(int timeoutMs) {
+        PacketView packet;
+        while(!nextPacket(packet)) {
+            if(!readSome(timeoutMs)) {
+                throw std::runtime_error{"Timeout while waiting for the broker"};
+            }
+        }
+        return packet;
+    }
+    int getFd() const {
+        return mFd;
+    }
+    uint8_t getMqttVersion() const {
+        return mMqttVersion;
+    }
+
+    // only called by the thread that handles the connection
+    void countReceived() {
+        mReceived += 1;
+    }
+    [[nodiscard]] uint64_t getReceived() const {
+        return mReceived;
+    }
+
+private:
+    bool read(int flags) {
+        if(mStart == mEnd) {
+            mStart = mEnd = 0;
+        } else if(mEnd == mBuffer.size()) {
+            compact();
+            if(mEnd == mBuffer.size())
+                mBuffer.resize(mBuffer.size() * 2);
+        }
+        auto result = recv(mFd, mBuffer.data() + mEnd, mBuffer.size() - mEnd, flags);
+        if(result < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return false;
+            throw std::runtime_error{std::string{"recv(): "} + strerror(errno)};
+        }
+        if(result == 0) {
+            throw std::runtime_error{"Broker closed the connection"};
+        }
+        mEnd += result;
+        return true;
+    }
+    void compact() {
+        memmove(mBuffer.data(), mBuffer.data() + mStart, mEnd - mStart);
+        mEnd -= mStart;
+        mStart = 0;
+    }
+
+    int mFd{-1};
+    uint8_t mMqttVersion;
+    std::vector<uint8_t> mBuffer;
+    size_t mStart{0};
+    size_t mEnd{0};
+    uint64_t mReceived{0};
+};
+
+struct Options {
+    std::string host{"localhost"};
+    uint16_t port{1883};
+    // threads that handle the subscriber connections, 0 means one per core
+    uint32_t receiverThreads{0};
+    bool json{false};
+    bool sharedSweep{false};
+};
+
+class Run final {
+public:
+    Run(const Options& options, Scenario scenario, uint32_t runNumber)
+    : mOptions(options), mScenario(std::move(scenario)), mPrefix("nioev-bench/" + std::to_string(getpid()) + "-" + std::to_string(runNumber)) {
+        for(uint32_t i = 0; i < mScenario.topics; ++i) {
+            std::string topic = mPrefix;
+            for(uint32_t level = 1; level < mScenario.topicDepth; ++level) {
+                topic += "/l" + std::to_string(level);
+            }
+            mTopics.emplace_back(topic + "/t" + std::to_string(i));
+        }
+    }
+
+    Result execute() {
+        connectSubscribers();
+        std::vector<std::unique_ptr<Connection>> publishers;
+        for(uint32_t i = 0; i < mScenario.publishers; ++i) {
+            publishers.emplace_back(std::make_unique<Connection>(mOptions.host, mOptions.port, mScenario.mqttVersion));
+            publishers.back()->login(mPrefix + "/pub" + std::to_string(i));
+        }
+
+        auto receiverCount = std::min<uint32_t>(mOptions.receiverThreads ? mOptions.receiverThreads : std::thread::hardware_concurrency(), mSubscribers.size());
+        std::vector<std::thread> receivers;
+        mReceiverHistograms.resize(receiverCount);
+        for(uint32_t i = 0; i < receiverCount; ++i) {
+            receivers.emplace_back([this, i, receiverCount] { receiverThreadFunc(i, receiverCount); });
+        }
+
+        auto start = monotonicNanos();
+        std::atomic<uint64_t> published{0};
+        std::mutex errorMutex;
+        std::exception_ptr error;
+        std::vector<std::thread> publisherThreads;
+        for(auto& publisher: publishers) {
+            publisherThreads.emplace_back([&, connection = publisher.get()] {
+                try {
+                    published += publishLoop(*connection, start);
+                } catch(...) {
+                    std::unique_lock<std::mutex> lock{errorMutex};
+                    error = std::current_exception();
+                }
+            });
+        }
+        for(auto& thread: publisherThreads) {
+            thread.join();
+        }
+        auto publishEnd = monotonicNanos();
+        if(error) {
+            mShouldRun = false;
+            for(auto& thread: receivers) {
+                thread.join();
+            }
+            std::rethrow_exception(error);
+        }
+
+        Result result;
+        result.published = published;
+        result.expected = mScenario.shared ? result.published : result.published * mScenario.subscribers;
+        // wait for the messages that are still on their way, but not forever, as QoS 0 messages may be dropped
+        uint64_t lastReceived = mReceived;
+        auto lastProgress = monotonicNanos();
+        while(mReceived < result.expected && monotonicNanos() - lastProgress < 2'000'000'000) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if(mReceived != lastReceived) {
+                lastReceived = mReceived;
+                lastProgress = monotonicNanos();
+            }
+        }
+        auto receiveEnd = mLastReceive.load();
+        mShouldRun = false;
+        for(auto& thread: receivers) {
+            thread.join();
+        }
+
+        result.scenario = mScenario;
+        result.received = mReceived;
+        result.publishSeconds = (publishEnd - start) / 1e9;
+        result.receiveSeconds = receiveEnd > start ? (receiveEnd - start) / 1e9 : 0.0;
+        for(auto& subscriber: mSubscribers) {
+            result.receivedPerSubscriber.emplace_back(subscriber->getReceived());
+        }
+        for(auto& histogram: mReceiverHistograms) {
+            result.latency.merge(histogram);
+        }
+        return result;
+    }
+
+private:
+    void connectSubscribers() {
+        std::vector<std::string> filters;
+        switch(mScenario.filter) {
+        case TopicFilter::EXACT:
+            filters = mTopics;
+            break;
+        case TopicFilter::SINGLE_LEVEL_WILDCARD: {
+            std::string filter = mPrefix;
+            for(uint32_t level = 0; level < mScenario.topicDepth; ++level) {
+                filter += "/+";
+            }
+            filters.emplace_back(std::move(filter));
+            break;
+        }
+        case TopicFilter::MULTI_LEVEL_WILDCARD:
+            filters.emplace_back(mPrefix + "/#");
+            break;
+        }
+        if(mScenario.shared) {
+            for(auto& filter: filters) {
+                filter = "$share/nioev-bench/" + filter;
+            }
+        }
+        for(uint32_t i = 0; i < mScenario.subscribers; ++i) {
+            auto connection = std::make_unique<Connection>(mOptions.host, mOptions.port, mScenario.mqttVersion);
+            connection->login(mPrefix + "/sub" + std::to_string(i));
+            connection->subscribe(filters, mScenario.qos);
+            mSubscribers.emplace_back(std::move(connection));
+        }
+    }
+
+    // returns the amount of published messages
+    uint64_t publishLoop(Connection& connection, uint64_t start) {
+        const uint64_t end = start + static_cast<uint64_t>(mScenario.seconds * 1e9);
+        const uint64_t interval = mScenario.rate ? 1'000'000'000 / mScenario.rate : 0;
+        uint64_t scheduled = start;
+        uint64_t count = 0;
+        uint32_t inflight = 0;
+        uint16_t nextId = 1;
+        std::vector<uint8_t> payload(std::max<size_t>(mScenario.payloadSize, TIMESTAMP_SIZE), 'x');
+        std::vector<uint8_t> packet;
+
+        auto handleAcks = [&](int timeoutMs) {
+            PacketView ack;
+            bool gotData = timeoutMs == 0 ? connection.readAvailable() : connection.readSome(timeoutMs);
+            if(!gotData)
+                return false;
+            while(connection.nextPacket(ack)) {
+                if(ack.length < 2)
+                    continue;
+                auto id = decode2Bytes(ack.body);
+                if(ack.type == PUBREC) {
+                    connection.sendAck(PUBREL, id);
+                } else if(ack.type == PUBACK || ack.type == PUBCOMP) {
+                    inflight -= 1;
+                }
+            }
+            return true;
+        };
+
+        while(true) {
+            auto now = monotonicNanos();
+            if(interval) {
+                if(scheduled >= end)
+                    break;
+                if(scheduled > now) {
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(scheduled - now));
+                }
+            } else {
+                if(now >= end)
+                    break;
+                scheduled = now;
+            }
+            if(mScenario.qos > 0) {
+                while(inflight >= mScenario.maxInflight) {
+                    if(!handleAcks(10'000)) {
+                        throw std::runtime_error{"Timeout while waiting for acknowledgements"};
+                    }
+                }
+            }
+            const auto& topic = mTopics[count % mTopics.size()];
+            memcpy(payload.data(), &scheduled, TIMESTAMP_SIZE);
+
+            packet.clear();
+            packet.push_back(PUBLISH << 4 | mScenario.qos << 1);
+            size_t remainingLength = 2 + topic.size() + (mScenario.qos > 0 ? 2 : 0) + (mScenario.mqttVersion == 5 ? 1 : 0) + payload.size();
+            encodeVarInt(packet, remainingLength);
+            encodeString(packet, topic);
+            if(mScenario.qos > 0) {
+                encode2Bytes(packet, nextId);
+                nextId = nextId == UINT16_MAX ? 1 : nextId + 1;
+                inflight += 1;
+            }
+            if(mScenario.mqttVersion == 5)
+                packet.push_back(0);
+            packet.insert(packet.end(), payload.begin(), payload.end());
+            connection.send(packet);
+            count += 1;
+            scheduled += interval;
+
+            if(mScenario.qos > 0) {
+                handleAcks(0);
+            }
+        }
+        auto drainEnd = monotonicNanos() + 10'000'000'000;
+        while(inflight > 0 && monotonicNanos() < drainEnd) {
+            handleAcks(100);
+        }
+        return count;
+    }
+
+    void receiverThreadFunc(uint32_t index, uint32_t receiverCount) {
+        pthread_setname_np(pthread_self(), "bench-receiver");
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        for(size_t i = index; i < mSubscribers.size(); i += receiverCount) {
+            epoll_event ev = { 0 };
+            ev.events = EPOLLIN;
+            ev.data.ptr = mSubscribers[i].get();
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, mSubscribers[i]->getFd(), &ev);
+        }
+        auto& histogram = mReceiverHistograms[index];
+        epoll_event events[64];
+        try {
+            while(mShouldRun) {
+                int count = epoll_wait(epollFd, events, 64, 50);
+                uint64_t received = 0;
+                for(int i = 0; i < count; ++i) {
+                    auto& connection = *static_cast<Connection*>(events[i].data.ptr);
+                    while(connection.readAvailable()) {
+                        PacketView packet;
+                        while(connection.nextPacket(packet)) {
+                            received += handlePacket(connection, packet, histogram);
+                        }
+                    }
+                }
+                if(received > 0) {
+                    mReceived += received;
+                    mLastReceive = monotonicNanos();
+                }
+            }
+        } catch(std::exception& e) {
+            spdlog::error("Subscriber failed: {}", e.what());
+        }
+        ::close(epollFd);
+    }
+    // returns the amount of received messages
+    int handlePacket(Connection& connection, const PacketView& packet, LatencyHistogram& histogram) {
+        if(packet.type == PUBREL && packet.length >= 2) {
+            connection.sendAck(PUBCOMP, decode2Bytes(packet.body));
+            return 0;
+        }
+        if(packet.type != PUBLISH || packet.length < 2)
+            return 0;
+        uint8_t qos = (packet.flags >> 1) & 0x03;
+        size_t offset = 2 + decode2Bytes(packet.body);
+        if(qos > 0 && offset + 2 <= packet.length) {
+            auto id = decode2Bytes(packet.body + offset);
+            offset += 2;
+            connection.sendAck(qos == 1 ? PUBACK : PUBREC, id);
+        }
+        if(connection.getMqttVersion() == 5 && offset < packet.length) {
+            // skip the properties
+            size_t propertiesLengthSize = skipVarInt(packet.body + offset, packet.length - offset);
+            uint32_t propertiesLength = 0;
+            for(size_t i = 0, multiplier = 1; i < propertiesLengthSize; ++i, multiplier *= 128) {
+                propertiesLength += (packet.body[offset + i] & 0x7F) * multiplier;
+            }
+            offset += propertiesLengthSize + propertiesLength;
+        }
+        if(offset + TIMESTAMP_SIZE <= packet.length) {
+            uint64_t sentAt;
+            memcpy(&sentAt, packet.body + offset, TIMESTAMP_SIZE);
+            auto now = monotonicNanos();
+            histogram.record(now > sentAt ? now - sentAt : 0);
+        }
+        connection.countReceived();
+        return 1;
+    }
+
+    const Options& mOptions;
+    const Scenario mScenario;
+    const std::string mPrefix;
+    std::vector<std::string> mTopics;
+    std::vector<std::unique_ptr<Connection>> mSubscribers;
+    std::vector<LatencyHistogram> mReceiverHistograms;
+    std::atomic<uint64_t> mReceived{0};
+    std::atomic<uint64_t> mLastReceive{0};
+    std::atomic<bool> mShouldRun{true};
+};
+
+std::vector<Scenario> makeSuite(const Scenario& base) {
+    std::vector<Scenario> suite;
+    auto add = [&](std::string name, auto&& modify) {
+        Scenario scenario = base;
+        scenario.name = std::move(name);
+        modify(scenario);
+        suite.emplace_back(std::move(scenario));
+    };
+    for(uint8_t version: {4, 5}) {
+        for(uint8_t qos: {0, 1, 2}) {
+            add(fmt::format("1:1 qos{} v{}", qos, version), [&](Scenario& s) { s.qos = qos; s.mqttVersion = version; });
+        }
+    }
+    add("fan-out 1:100 qos0", [](Scenario& s) { s.subscribers = 100; });
+    add("fan-out 1:100 qos1", [](Scenario& s) { s.subscribers = 100; s.qos = 1; });
+    add("fan-in 16:1 qos0", [](Scenario& s) { s.publishers = 16; });
+    add("64KiB payload qos1", [](Scenario& s) { s.payloadSize = 64 * 1024; s.qos = 1; });
+    add("1000 topics exact", [](Scenario& s) { s.publishers = 4; s.subscribers = 4; s.topics = 1000; s.topicDepth = 4; });
+    add("1000 topics +/+/+/+", [](Scenario& s) { s.publishers = 4; s.subscribers = 4; s.topics = 1000; s.topicDepth = 4; s.filter = TopicFilter::SINGLE_LEVEL_WILDCARD; });
+    add("1000 topics #", [](Scenario& s) { s.publishers = 4; s.subscribers = 4; s.topics = 1000; s.topicDepth = 4; s.filter = TopicFilter::MULTI_LEVEL_WILDCARD; });
+    add("shared 4:16 qos1", [](Scenario& s) { s.publishers = 4; s.subscribers = 16; s.shared = true; s.qos = 1; });
+    add("1000 connections @100/s", [](Scenario& s) { s.publishers = 500; s.subscribers = 500; s.topics = 500; s.rate = 100; });
+    return suite;
+}
+// One shared subscription group with a growing amount of consumers at a fixed publish rate, to see how the load balancing
+// strategy of the broker scales and how evenly it distributes the messages
+std::vector<Scenario> makeSharedSweep(const Scenario& base) {
+    std::vector<Scenario> sweep;
+    for(uint32_t consumers: {1, 2, 4, 8, 16}) {
+        Scenario scenario = base;
+        scenario.name = fmt::format("shared 4:{} qos1", consumers);
+        scenario.publishers = 4;
+        scenario.subscribers = consumers;
+        scenario.shared = true;
+        scenario.qos = 1;
+        // a fixed rate, so that the delivered messages per consumer are comparable across group sizes
+        scenario.rate = base.rate ? base.rate : 5000;
+        sweep.emplace_back(std::move(scenario));
+    }
+    return sweep;
+}
+
+void printTable(const std::vector<Result>& results) {
+    fmt::print("{:<26} {:>12} {:>12} {:>9} {:>10} {:>10} {:>10} {:>10}\n", "scenario", "sent/s", "recv/s", "recv %", "p50 us", "p99 us", "p999 us", "max us");
+    for(auto& r: results) {
+        double sentPerSecond = r.publishSeconds > 0 ? r.published / r.publishSeconds : 0;
+        double receivedPerSecond = r.receiveSeconds > 0 ? r.received / r.receiveSeconds : 0;
+        double receivedPercent = r.expected ? 100.0 * r.received / r.expected : 0;
+        fmt::print(
+            "{:<26} {:>12.0f} {:>12.0f} {:>9.2f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n", r.scenario.name, sentPerSecond, receivedPerSecond, receivedPercent,
+            r.latency.percentile(0.5) / 1e3, r.latency.percentile(0.99) / 1e3, r.latency.percentile(0.999) / 1e3, r.latency.getMax() / 1e3);
+    }
+}
+void printSharedSweepTable(const std::vector<Result>& results) {
+    fmt::print("{:<26} {:<16} {:>9} {:>12} {:>12} {:>12} {:>12} {:>12}\n", "scenario", "strategy", "consumers", "sent/s", "recv/s", "min/consumer",
+        "mean/consumer", "max/consumer");
+    for(auto& r: results) {
+        double sentPerSecond = r.publishSeconds > 0 ? r.published / r.publishSeconds : 0;
+        double receivedPerSecond = r.receiveSeconds > 0 ? r.received / r.receiveSeconds : 0;
+        auto perConsumer = [&](uint64_t received) {
+            return r.receiveSeconds > 0 ? received / r.receiveSeconds : 0;
+        };
+        uint64_t min = 0, max = 0;
+        if(!r.receivedPerSubscriber.empty()) {
+            auto [minIt, maxIt] = std::minmax_element(r.receivedPerSubscriber.begin(), r.receivedPerSubscriber.end());
+            min = *minIt;
+            max = *maxIt;
+        }
+        double mean = r.receivedPerSubscriber.empty() ? 0 : receivedPerSecond / r.receivedPerSubscriber.size();
+        fmt::print("{:<26} {:<16} {:>9} {:>12.0f} {:>12.0f} {:>12.0f} {:>12.0f} {:>12.0f}\n", r.scenario.name, r.scenario.strategy.empty() ? "-" : r.scenario.strategy,
+            r.receivedPerSubscriber.size(), sentPerSecond, receivedPerSecond, perConsumer(min), mean, perConsumer(max));
+    }
+}
+void printJson(const std::vector<Result>& results) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer{ buffer };
+    writer.StartArray();
+    for(auto& r: results) {
+        writer.StartObject();
+        writer.Key("scenario");
+        writer.String(r.scenario.name.c_str());
+        writer.Key("publishers");
+        writer.Uint(r.scenario.publishers);
+        writer.Key("subscribers");
+        writer.Uint(r.scenario.subscribers);
+        writer.Key("qos");
+        writer.Uint(r.scenario.qos);
+        writer.Key("mqttVersion");
+        writer.Uint(r.scenario.mqttVersion);
+        writer.Key("payloadSize");
+        writer.Uint(r.scenario.payloadSize);
+        writer.Key("topics");
+        writer.Uint(r.scenario.topics);
+        writer.Key("shared");
+        writer.Bool(r.scenario.shared);
+        if(!r.scenario.strategy.empty()) {
+            writer.Key("strategy");
+            writer.String(r.scenario.strategy.c_str());
+        }
+        writer.Key("published");
+        writer.Uint64(r.published);
+        writer.Key("expected");
+        writer.Uint64(r.expected);
+        writer.Key("received");
+        writer.Uint64(r.received);
+        writer.Key("publishSeconds");
+        writer.Double(r.publishSeconds);
+        writer.Key("receiveSeconds");
+        writer.Double(r.receiveSeconds);
+        writer.Key("receivedPerSubscriber");
+        writer.StartArray();
+        for(auto received: r.receivedPerSubscriber) {
+            writer.Uint64(received);
+        }
+        writer.EndArray();
+        writer.Key("latencyNs");
+        writer.StartObject();
+        for(auto [name, fraction]: { std::pair{"p50", 0.5}, std::pair{"p90", 0.9}, std::pair{"p99", 0.99}, std::pair{"p999", 0.999} }) {
+            writer.Key(name);
+            writer.Uint64(r.latency.percentile(fraction));
+        }
+        writer.Key("min");
+        writer.Uint64(r.latency.getMin());
+        writer.Key("max");
+        writer.Uint64(r.latency.getMax());
+        writer.Key("mean");
+        writer.Double(r.latency.getMean());
+        writer.EndObject();
+        writer.EndObject();
+    }
+    writer.EndArray();
+    fmt::print("{}\n", buffer.GetString());
+}
+
+void printUsage() {
+    fmt::print(
+        "Usage: nioev_bench [options]\n"
+        "  --host <host>              broker host (localhost)\n"
+        "  --port <port>              broker port (1883)\n"
+        "  --suite                    run the built-in set of scenarios, using the other options as base\n"
+        "  --shared-sweep             run one shared subscription with 1, 2, 4, 8 and 16 consumers at a fixed rate\n"
+        "  --strategy <name>          shared subscription strategy of the broker, only used to label the results\n"
+        "  --publishers <n>           publisher connections (1)\n"
+        "  --subscribers <n>          subscriber connections (1)\n"
+        "  --qos <0|1|2>              QoS of publishes and subscriptions (0)\n"
+        "  --mqtt-version <4|5>       protocol level, 4 is MQTT 3.1.1 (4)\n"
+        "  --payload-size <bytes>     payload size, at least 8 (64)\n"
+        "  --topics <n>               distinct topics the publishers cycle through (1)\n"
+        "  --topic-depth <n>          topic levels below the prefix of the run (1)\n"
+        "  --filter <exact|+|#>       how subscribers subscribe to the topics (exact)\n"
+        "  --shared                   use one shared subscription for all subscribers\n"
+        "  --seconds <s>              duration of the publishing phase (5)\n"
+        "  --rate <n>                 messages per second and publisher, 0 is unlimited (0)\n"
+        "  --max-inflight <n>         unacknowledged QoS 1/2 messages per publisher (64)\n"
+        "  --receiver-threads <n>     threads handling subscriber connections, 0 is one per core (0)\n"
+        "  --json                     print the results as JSON\n");
+}
+
+}
+
+int main(int argc, char** argv) {
+    using namespace nioev::bench;
+    // stdout is reserved for the results
+    spdlog::set_default_logger(spdlog::stderr_color_mt("nioev_bench"));
+    Options options;
+    Scenario scenario;
+    bool suite = false;
+
+    std::map<std::string, std::function<void(const std::string&)>> valueOptions{
+        { "--host", [&](auto& v) { options.host = v; } },
+        { "--port", [&](auto& v) { options.port = std::stoul(v); } },
+        { "--publishers", [&](auto& v) { scenario.publishers = std::stoul(v); } },
+        { "--subscribers", [&](auto& v) { scenario.subscribers = std::stoul(v); } },
+        { "--qos", [&](auto& v) { scenario.qos = std::min<unsigned long>(std::stoul(v), 2); } },
+        { "--mqtt-version", [&](auto& v) { scenario.mqttVersion = std::stoul(v) == 5 ? 5 : 4; } },
+        { "--payload-size", [&](auto& v) { scenario.payloadSize = std::stoul(v); } },
+        { "--topics", [&](auto& v) { scenario.topics = std::max<unsigned long>(std::stoul(v), 1); } },
+        { "--topic-depth", [&](auto& v) { scenario.topicDepth = std::max<unsigned long>(std::stoul(v), 1); } },
+        { "--filter", [&](auto& v) {
+             if(v == "exact") {
+                 scenario.filter = TopicFilter::EXACT;
+             } else if(v == "+") {
+                 scenario.filter = TopicFilter::SINGLE_LEVEL_WILDCARD;
+             } else if(v == "#") {
+                 scenario.filter = TopicFilter::MULTI_LEVEL_WILDCARD;
+             } else {
+                 throw std::invalid_argument{"Unknown filter " + v};
+             }
+         } },
+        { "--seconds", [&](auto& v) { scenario.seconds = std::stod(v); } },
+        { "--rate", [&](auto& v) { scenario.rate = std::stoul(v); } },
+        { "--max-inflight", [&](auto& v) { scenario.maxInflight = std::max<unsigned long>(std::stoul(v), 1); } },
+        { "--receiver-threads", [&](auto& v) { options.receiverThreads = std::stoul(v); } },
+        { "--strategy", [&](auto& v) { scenario.strategy = v; } },
+    };
+    try {
+        for(int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if(arg == "--help" || arg == "-h") {
+                printUsage();
+                return 0;
+            } else if(arg == "--suite") {
+                suite = true;
+            } else if(arg == "--shared-sweep") {
+                options.sharedSweep = true;
+            } else if(arg == "--shared") {
+                scenario.shared = true;
+            } else if(arg == "--json") {
+                options.json = true;
+            } else if(auto option = valueOptions.find(arg); option != valueOptions.end() && i + 1 < argc) {
+                option->second(argv[++i]);
+            } else {
+                throw std::invalid_argument{"Unknown or incomplete option " + arg};
+            }
+        }
+    } catch(std::exception& e) {
+        spdlog::error("{}", e.what());
+        printUsage();
+        return 1;
+    }
+
+    std::vector<Scenario> scenarios;
+    if(options.sharedSweep) {
+        scenarios = makeSharedSweep(scenario);
+    } else if(suite) {
+        scenarios = makeSuite(scenario);
+    } else {
+        scenarios.emplace_back(scenario);
+    }
+    std::vector<Result> results;
+    uint32_t runNumber = 0;
+    for(auto& s: scenarios) {
+        try {
+            spdlog::info("Running '{}'", s.name);
+            Run run{ options, s, runNumber++ };
+            results.emplace_back(run.execute());
+        } catch(std::exception& e) {
+            spdlog::error("Scenario '{}' failed: {}", s.name, e.what());
+        }
+    }
+    if(options.json) {
+        printJson(results);
+    } else if(options.sharedSweep) {
+        printSharedSweepTable(results);
+    } else {
+        printTable(results);
+    }
+    return results.size() == scenarios.size() ? 0 : 1;
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace nioev::bench {
+
+/* Minimal benchmark harness in the style of Google Benchmark, so that the microbenchmarks don't need another dependency.
+ *
+ * A benchmark is a function taking a State. Everything before the loop is setup and isn't measured:
+ *
+ *     registerBenchmark("Foo/bar", [](State& state) {
+ *         auto data = makeData();
+ *         for(auto _: state) {
+ *             doNotOptimize(bar(data));
+ *         }
+ *     });
+ *
+ * The harness calls the function with an increasing amount of iterations until the loop takes long enough, then repeats the
+ * measurement and reports the median. The JSON output uses the format of Google Benchmark, so its tools (e.g. compare.py) can be
+ * used to compare two runs.
+ */
+class State final {
+public:
+    explicit State(uint64_t iterations)
+    : mIterations(iterations) {
+
+    }
+
+    // the loop variable isn't used, the attribute avoids the warning about it
+    struct [[maybe_unused]] Value {};
+    struct Iterator {
+        State* state;
+        uint64_t remaining;
+        bool operator!=(const Iterator&) const {
+            if(remaining > 0)
+                return true;
+            state->stopTimer();
+            return false;
+        }
+        void operator++() {
+            remaining -= 1;
+        }
+        Value operator*() const {
+            return {};
+        }
+    };
+    Iterator begin() {
+        startTimer();
+        return Iterator{ this, mIterations };
+    }
+    Iterator end() {
+        return Iterator{ this, 0 };
+    }
+
+    // Excludes work inside the loop from the measurement, e.g. refilling a queue
+    void pauseTiming() {
+        stopTimer();
+    }
+    void resumeTiming() {
+        startTimer();
+    }
+    // Amount of items (e.g. packets) every iteration processes, reported as items per second
+    void setItemsPerIteration(uint64_t items) {
+        mItemsPerIteration = items;
+    }
+    void setBytesPerIteration(uint64_t bytes) {
+        mBytesPerIteration = bytes;
+    }
+
+    uint64_t getIterations() const {
+        return mIterations;
+    }
+    std::chrono::nanoseconds getRealTime() const {
+        return mRealTime;
+    }
+    std::chrono::nanoseconds getCpuTime() const {
+        return mCpuTime;
+    }
+    uint64_t getItemsPerIteration() const {
+        return mItemsPerIteration;
+    }
+    uint64_t getBytesPerIteration() const {
+        return mBytesPerIteration;
+    }
+
+private:
+    static std::chrono::nanoseconds threadCpuTime() {
+        timespec ts = { 0 };
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+    }
+    void startTimer() {
+        mRealStart = std::chrono::steady_clock::now();
+        mCpuStart = threadCpuTime();
+        mRunning = true;
+    }
+    void stopTimer() {
+        if(!mRunning)
+            return;
+        mRealTime += std::chrono::steady_clock::now() - mRealStart;
+        mCpuTime += threadCpuTime() - mCpuStart;
+        mRunning = false;
+    }
+
+    uint64_t mIterations;
+    uint64_t mItemsPerIteration{0};
+    uint64_t mBytesPerIteration{0};
+    bool mRunning{false};
+    std::chrono::steady_clock::time_point mRealStart;
+    std::chrono::nanoseconds mCpuStart{0};
+    std::chrono::nanoseconds mRealTime{0};
+    std::chrono::nanoseconds mCpuTime{0};
+};
+
+// Keeps the compiler from removing the computation of value
+template<typename T>
+inline void doNotOptimize(const T& value) {
+    asm volatile("" : : "m"(value) : "memory");
+}
+
+using BenchmarkFunction = std::function<void(State&)>;
+
+struct Benchmark {
+    std::string name;
+    BenchmarkFunction function;
+};
+
+inline std::vector<Benchmark>& getBenchmarks() {
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+inline void registerBenchmark(std::string name, BenchmarkFunction function) {
+    getBenchmarks().emplace_back(Benchmark{ std::move(name), std::move(function) });
+}
+
+struct BenchmarkResult {
+    std::string name;
+    uint64_t iterations{0};
+    // per iteration
+    double realTimeNs{0};
+    double cpuTimeNs{0};
+    double itemsPerSecond{0};
+    double bytesPerSecond{0};
+};
+
+// Runs the benchmark until a single run takes at least minTime, then reports the median of the given amount of repetitions
+inline BenchmarkResult runBenchmark(const Benchmark& benchmark, std::chrono::nanoseconds minTime, uint32_t repetitions) {
+    uint64_t iterations = 1;
+    while(true) {
+        State state{ iterations };
+        benchmark.function(state);
+        if(state.getRealTime() >= minTime || iterations >= 1'000'000'000)
+            break;
+        // aim a bit higher than needed, like Google Benchmark does
+        double factor = state.getRealTime().count() > 0 ? 1.4 * minTime.count() / state.getRealTime().count() : 10.0;
+        iterations = std::max<uint64_t>(iterations + 1, std::min<double>(iterations * std::clamp(factor, 1.0, 10.0), 1'000'000'000));
+    }
+    std::vector<BenchmarkResult> runs;
+    for(uint32_t i = 0; i < std::max<uint32_t>(repetitions, 1); ++i) {
+        State state{ iterations };
+        benchmark.function(state);
+        BenchmarkResult run;
+        run.name = benchmark.name;
+        run.iterations = iterations;
+        run.realTimeNs = static_cast<double>(state.getRealTime().count()) / iterations;
+        run.cpuTimeNs = static_cast<double>(state.getCpuTime().count()) / iterations;
+        if(run.realTimeNs > 0) {
+            run.itemsPerSecond = state.getItemsPerIteration() * 1e9 / run.realTimeNs;
+            run.bytesPerSecond = state.getBytesPerIteration() * 1e9 / run.realTimeNs;
+        }
+        runs.emplace_back(std::move(run));
+    }
+    std::sort(runs.begin(), runs.end(), [](auto& a, auto& b) {
+        return a.realTimeNs < b.realTimeNs;
+    });
+    return runs[runs.size() / 2];
+}
+
+}
@@ -0,0 +1,437 @@
+/* nioev_microbench: microbenchmarks of the primitives on the publish hot path, to catch performance regressions early.
+ *
+ * All datasets are generated with fixed seeds, so two runs of the same build work on identical data. Use --json to get
+ * machine readable results (Google Benchmark format) that can be diffed across commits, and --filter to select benchmarks.
+ */
+#include "Microbenchmark.hpp"
+#include "MQTTPublishPacketBuilder.hpp"
+#include "SendQueue.hpp"
+#include "Subscriber.hpp"
+#include "TcpClientConnection.hpp"
+#include "nioev/lib/SubscriptionTree.hpp"
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <map>
+#include <memory>
+#include <random>
+#include <regex>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace nioev::bench {
+using namespace nioev::mqtt;
+
+namespace {
+
+class NullSubscriber final : public Subscriber {
+public:
+    void publish(const std::string&, PayloadType, QoS, Retained, const PropertyList&, MQTTPublishPacketBuilder&) override {
+
+    }
+    const char* getType() const override {
+        return "null";
+    }
+};
+
+// Generates topics like "sensor/7/kitchen/temperature" from a small vocabulary, which is roughly what real deployments look like
+class TopicGenerator final {
+public:
+    explicit TopicGenerator(uint64_t seed)
+    : mRandom(seed) {
+
+    }
+    std::vector<std::string> nextLevels() {
+        static const char* words[] = { "sensor", "device", "home", "office", "kitchen", "garage", "temperature", "humidity",
+                                       "status", "power", "light", "door", "window", "cmd", "telemetry", "event" };
+        std::vector<std::string> levels(std::uniform_int_distribution<size_t>{3, 6}(mRandom));
+        for(size_t i = 0; i < levels.size(); ++i) {
+            // every second level is an id, so there are many distinct topics
+            if(i % 2 == 1) {
+                levels[i] = std::to_string(std::uniform_int_distribution<uint32_t>{0, 999}(mRandom));
+            } else {
+                levels[i] = words[std::uniform_int_distribution<size_t>{0, std::size(words) - 1}(mRandom)];
+            }
+        }
+        return levels;
+    }
+    std::string nextTopic() {
+        return join(nextLevels(), ALL_LEVELS);
+    }
+    // 70% exact topics, 20% with a single level replaced by +, 10% ending in #
+    std::string nextFilter() {
+        auto levels = nextLevels();
+        auto kind = std::uniform_int_distribution<uint32_t>{0, 9}(mRandom);
+        if(kind < 7)
+            return join(levels, ALL_LEVELS);
+        if(kind < 9) {
+            levels[std::uniform_int_distribution<size_t>{0, levels.size() - 1}(mRandom)] = "+";
+            return join(levels, ALL_LEVELS);
+        }
+        return join(levels, std::uniform_int_distribution<size_t>{1, levels.size() - 1}(mRandom)) + "/#";
+    }
+
+private:
+    static constexpr size_t ALL_LEVELS = SIZE_MAX;
+    static std::string join(const std::vector<std::string>& levels, size_t count) {
+        std::string ret;
+        for(size_t i = 0; i < std::min(count, levels.size()); ++i) {
+            if(i > 0)
+                ret += '/';
+            ret += levels[i];
+        }
+        return ret;
+    }
+    std::mt19937_64 mRandom;
+};
+
+struct SubscriptionTreeDataset {
+    std::vector<std::unique_ptr<NullSubscriber>> subscribers;
+    SubscriptionTree<Subscription> tree;
+    std::vector<std::string> topics;
+};
+// building a tree with a million subscriptions takes a while, so every dataset is only built once per process
+const SubscriptionTreeDataset& getSubscriptionTreeDataset(size_t subscriptionCount) {
+    static std::map<size_t, std::unique_ptr<SubscriptionTreeDataset>> datasets;
+    auto& dataset = datasets[subscriptionCount];
+    if(!dataset) {
+        dataset = std::make_unique<SubscriptionTreeDataset>();
+        for(size_t i = 0; i < 1024; ++i) {
+            dataset->subscribers.emplace_back(std::make_unique<NullSubscriber>());
+        }
+        TopicGenerator generator{ 42 };
+        for(size_t i = 0; i < subscriptionCount; ++i) {
+            dataset->tree.addSubscription(generator.nextFilter(), Subscription{ dataset->subscribers[i % dataset->subscribers.size()].get(), QoS::QoS0 });
+        }
+        TopicGenerator topicGenerator{ 1337 };
+        for(size_t i = 0; i < 4096; ++i) {
+            dataset->topics.emplace_back(topicGenerator.nextTopic());
+        }
+    }
+    return *dataset;
+}
+
+std::vector<uint8_t> makePayload(size_t size) {
+    std::vector<uint8_t> payload(size);
+    std::mt19937 random{ 7 };
+    for(auto& byte: payload) {
+        byte = random();
+    }
+    return payload;
+}
+PropertyList makeTypicalProperties() {
+    PropertyList properties;
+    properties.emplace(MQTTProperty::PAYLOAD_FORMAT_INDICATOR, uint8_t(1));
+    properties.emplace(MQTTProperty::MESSAGE_EXPIRY_INTERVAL, uint32_t(3600));
+    properties.emplace(MQTTProperty::CONTENT_TYPE, std::string{"application/json"});
+    properties.emplace(MQTTProperty::RESPONSE_TOPIC, std::string{"reply/client-42"});
+    properties.emplace(MQTTProperty::CORRELATION_DATA, makePayload(16));
+    properties.emplace(MQTTProperty::SUBSCRIPTION_IDENTIFIER, uint32_t(7));
+    return properties;
+}
+std::vector<uint8_t> toVector(const SharedBuffer& buffer) {
+    return { buffer.data(), buffer.data() + buffer.size() };
+}
+
+void registerSubscriptionTreeBenchmarks() {
+    for(size_t count: { 1'000, 100'000, 1'000'000 }) {
+        registerBenchmark(fmt::format("SubscriptionTree/forEveryMatch/{}", count), [count](State& state) {
+            auto& dataset = getSubscriptionTreeDataset(count);
+            // forEveryMatch isn't const, but doesn't modify the tree
+            auto& tree = const_cast<SubscriptionTree<Subscription>&>(dataset.tree);
+            size_t i = 0;
+            for(auto _: state) {
+                size_t matches = 0;
+                tree.forEveryMatch(dataset.topics[i++ % dataset.topics.size()], [&](Subscription&) {
+                    matches += 1;
+                });
+                doNotOptimize(matches);
+            }
+        });
+    }
+}
+
+void registerPacketBuilderBenchmarks() {
+    constexpr size_t RECEIVERS = 16;
+    for(auto version: { MQTTVersion::V4, MQTTVersion::V5 }) {
+        for(auto qos: { QoS::QoS0, QoS::QoS1, QoS::QoS2 }) {
+            for(size_t payloadSize: { 16, 1024 }) {
+                auto name = fmt::format("MQTTPublishPacketBuilder/getPacket/v{}/qos{}/{}", static_cast<int>(version), static_cast<int>(qos), payloadSize);
+                registerBenchmark(name, [version, qos, payloadSize](State& state) {
+                    const std::string topic = "sensor/17/kitchen/temperature";
+                    auto payload = makePayload(payloadSize);
+                    auto properties = version == MQTTVersion::V5 ? makeTypicalProperties() : PropertyList{};
+                    // a new builder per message and one packet per receiver, like the fan-out in ApplicationState::publish
+                    for(auto _: state) {
+                        MQTTPublishPacketBuilder builder{ topic, vecToPayload(payload), Retained::No, properties };
+                        for(size_t i = 0; i < RECEIVERS; ++i) {
+                            auto packet = builder.getPacket(qos, static_cast<uint16_t>(i + 1), version);
+                            doNotOptimize(packet);
+                        }
+                    }
+                    state.setItemsPerIteration(RECEIVERS);
+                });
+            }
+        }
+    }
+}
+
+std::vector<EncodedPacket> makePackets(size_t count, size_t payloadSize) {
+    const std::string topic = "sensor/17/kitchen/temperature";
+    auto payload = makePayload(payloadSize);
+    PropertyList properties;
+    MQTTPublishPacketBuilder builder{ topic, vecToPayload(payload), Retained::No, properties };
+    std::vector<EncodedPacket> packets;
+    for(size_t i = 0; i < count; ++i) {
+        packets.emplace_back(builder.getPacket(QoS::QoS1, static_cast<uint16_t>(i + 1), MQTTVersion::V4));
+    }
+    return packets;
+}
+
+void registerSendPathBenchmarks() {
+    constexpr size_t PACKETS = 256;
+    for(size_t payloadSize: { 16, 1024 }) {
+        registerBenchmark(fmt::format("EncodedPacket/constructIOVecs/{}", payloadSize), [payloadSize](State& state) {
+            auto packets = makePackets(PACKETS, payloadSize);
+            IOVecBuilder builder;
+            for(auto _: state) {
+                builder.clear();
+                for(auto& packet: packets) {
+                    if(!packet.constructIOVecs(0, builder))
+                        break;
+                }
+                doNotOptimize(builder.totalLength());
+            }
+            state.setItemsPerIteration(PACKETS);
+        });
+        // Queues packets and flushes them with TcpClientConnection::sendScatter into one end of a socketpair, the other end is
+        // drained whenever the socket doesn't accept more data. This includes the syscalls of both ends.
+        registerBenchmark(fmt::format("SendQueue/pushAndFlush/{}", payloadSize), [payloadSize](State& state) {
+            int fds[2];
+            if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+                throwErrno("socketpair()");
+            }
+            std::vector<uint8_t> received(256 * 1024);
+            auto drain = [&] {
+                while(::recv(fds[1], received.data(), received.size(), MSG_DONTWAIT) > 0) {
+
+                }
+            };
+            {
+                TcpClientConnection connection{ fds[0], "socketpair", 0 };
+                auto packets = makePackets(PACKETS, payloadSize);
+                SendQueue queue;
+                uint64_t bytes = 0;
+                for(auto& packet: packets) {
+                    bytes += packet.fullSize();
+                }
+                for(auto _: state) {
+                    for(auto& packet: packets) {
+                        queue.push(InTransitEncodedPacket{ packet });
+                    }
+                    while(!queue.empty()) {
+                        if(connection.sendScatter(queue) == 0) {
+                            drain();
+                        }
+                        queue.popDone();
+                    }
+                    drain();
+                }
+                state.setItemsPerIteration(PACKETS);
+                state.setBytesPerIteration(bytes);
+            }
+            ::close(fds[1]);
+        });
+    }
+}
+
+void registerDecoderBenchmarks() {
+    constexpr size_t VALUES = 4096;
+    registerBenchmark("VarByteInt/encode", [](State& state) {
+        std::mt19937 random{ 3 };
+        std::vector<uint32_t> values(VALUES);
+        for(auto& value: values) {
+            // the same amount of 1, 2, 3 and 4 byte encodings
+            value = random() % (uint32_t{1} << (7 * (random() % 4 + 1)));
+        }
+        for(auto _: state) {
+            for(auto value: values) {
+                auto encoded = encodeVarByteInt(value);
+                doNotOptimize(encoded);
+            }
+        }
+        state.setItemsPerIteration(VALUES);
+    });
+    registerBenchmark("BinaryDecoder/decodeVarByteInt", [](State& state) {
+        std::mt19937 random{ 3 };
+        std::vector<uint8_t> data;
+        for(size_t i = 0; i < VALUES; ++i) {
+            auto encoded = encodeVarByteInt(random() % (uint32_t{1} << (7 * (random() % 4 + 1))));
+            data.insert(data.end(), encoded.value, encoded.value + encoded.valueLength);
+        }
+        for(auto _: state) {
+            BinaryDecoder decoder{ data, static_cast<uint32_t>(data.size()) };
+            uint32_t sum = 0;
+            for(size_t i = 0; i < VALUES; ++i) {
+                sum += decoder.decodeVarByteInt();
+            }
+            doNotOptimize(sum);
+        }
+        state.setItemsPerIteration(VALUES);
+        state.setBytesPerIteration(data.size());
+    });
+    registerBenchmark("BinaryEncoder/encodePropertyList", [](State& state) {
+        auto properties = makeTypicalProperties();
+        for(auto _: state) {
+            BinaryEncoder encoder;
+            encoder.encodePropertyList(properties);
+            doNotOptimize(encoder.moveData());
+        }
+    });
+    registerBenchmark("BinaryDecoder/decodeProperties", [](State& state) {
+        BinaryEncoder encoder;
+        encoder.encodePropertyList(makeTypicalProperties());
+        auto data = toVector(encoder.moveData());
+        for(auto _: state) {
+            BinaryDecoder decoder{ data, static_cast<uint32_t>(data.size()) };
+            auto properties = decoder.decodeProperties();
+            doNotOptimize(properties);
+        }
+        state.setBytesPerIteration(data.size());
+    });
+}
+
+void printTable(const std::vector<BenchmarkResult>& results) {
+    fmt::print("{:<52} {:>14} {:>14} {:>14} {:>16}\n", "benchmark", "time ns", "cpu ns", "iterations", "items/s");
+    for(auto& r: results) {
+        fmt::print("{:<52} {:>14.1f} {:>14.1f} {:>14} {:>16.0f}\n", r.name, r.realTimeNs, r.cpuTimeNs, r.iterations, r.itemsPerSecond);
+    }
+}
+void printJson(const std::vector<BenchmarkResult>& results) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer{ buffer };
+    writer.StartObject();
+    writer.Key("context");
+    writer.StartObject();
+    char hostname[256] = { 0 };
+    gethostname(hostname, sizeof(hostname) - 1);
+    writer.Key("host_name");
+    writer.String(hostname);
+    writer.Key("num_cpus");
+    writer.Uint(std::thread::hardware_concurrency());
+#ifdef NDEBUG
+    writer.Key("library_build_type");
+    writer.String("release");
+#else
+    writer.Key("library_build_type");
+    writer.String("debug");
+#endif
+    writer.EndObject();
+    writer.Key("benchmarks");
+    writer.StartArray();
+    for(auto& r: results) {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(r.name.c_str());
+        writer.Key("run_type");
+        writer.String("iteration");
+        writer.Key("iterations");
+        writer.Uint64(r.iterations);
+        writer.Key("real_time");
+        writer.Double(r.realTimeNs);
+        writer.Key("cpu_time");
+        writer.Double(r.cpuTimeNs);
+        writer.Key("time_unit");
+        writer.String("ns");
+        if(r.itemsPerSecond > 0) {
+            writer.Key("items_per_second");
+            writer.Double(r.itemsPerSecond);
+        }
+        if(r.bytesPerSecond > 0) {
+            writer.Key("bytes_per_second");
+            writer.Double(r.bytesPerSecond);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    fmt::print("{}\n", buffer.GetString());
+}
+
+void printUsage() {
+    fmt::print(
+        "Usage: nioev_microbench [options]\n"
+        "  --filter <regex>       only run benchmarks whose name matches\n"
+        "  --min-time <ms>        minimum duration of a single measurement (500)\n"
+        "  --repetitions <n>      measurements per benchmark, the median is reported (3)\n"
+        "  --list                 print the names of all benchmarks\n"
+        "  --json                 print the results in the JSON format of Google Benchmark\n");
+}
+
+}
+
+}
+
+int main(int argc, char** argv) {
+    using namespace nioev::bench;
+    // stdout is reserved for the results
+    spdlog::set_default_logger(spdlog::stderr_color_mt("nioev_microbench"));
+    std::regex filter{ ".*" };
+    std::chrono::milliseconds minTime{ 500 };
+    uint32_t repetitions = 3;
+    bool list = false;
+    bool json = false;
+    try {
+        for(int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if(arg == "--help" || arg == "-h") {
+                printUsage();
+                return 0;
+            } else if(arg == "--filter" && hasValue) {
+                filter = std::regex{ argv[++i] };
+            } else if(arg == "--min-time" && hasValue) {
+                minTime = std::chrono::milliseconds{ std::stoul(argv[++i]) };
+            } else if(arg == "--repetitions" && hasValue) {
+                repetitions = std::stoul(argv[++i]);
+            } else if(arg == "--list") {
+                list = true;
+            } else if(arg == "--json") {
+                json = true;
+            } else {
+                throw std::invalid_argument{ "Unknown or incomplete option " + arg };
+            }
+        }
+    } catch(std::exception& e) {
+        spdlog::error("{}", e.what());
+        printUsage();
+        return 1;
+    }
+
+    registerSubscriptionTreeBenchmarks();
+    registerPacketBuilderBenchmarks();
+    registerSendPathBenchmarks();
+    registerDecoderBenchmarks();
+
+    std::vector<BenchmarkResult> results;
+    for(auto& benchmark: getBenchmarks()) {
+        if(!std::regex_search(benchmark.name, filter))
+            continue;
+        if(list) {
+            fmt::print("{}\n", benchmark.name);
+            continue;
+        }
+        spdlog::info("Running {}", benchmark.name);
+        results.emplace_back(runBenchmark(benchmark, minTime, repetitions));
+    }
+    if(list)
+        return 0;
+    if(json) {
+        printJson(results);
+    } else {
+        printTable(results);
+    }
+    return 0;
+}
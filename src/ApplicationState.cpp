@@ -5,6 +5,11 @@
 #include "SQLiteCpp/Transaction.h"
 #include "MQTTPublishPacketBuilder.hpp"
 #include "Statistics.hpp"
+#include "WriteBatch.hpp"
+#include "GlobalConfig.hpp"
+#include "Metrics.hpp"
+#include "PropertyUtil.hpp"
+#include "StageTimings.hpp"
 #include "spdlog/sinks/base_sink.h"
 #include "spdlog/pattern_formatter.h"
 
@@ -34,14 +39,43 @@ protected:
 ApplicationState::ApplicationState() : mAsyncPublisher(*this), mStatistics(std::make_shared<Statistics>(*this)), mClientManager(*this), mWorkerThread([this] { workerThreadFunc(); }) {
     spdlog::default_logger()->sinks().push_back(std::make_shared<LogSink>(*this));
     mStatistics->init();
+    if(!getGlobalConfig().sessionJournal.empty()) {
+        mSessionJournal = std::make_unique<SessionJournal>(getGlobalConfig().sessionJournal, getGlobalConfig().sessionJournalCompactionThreshold);
+        mTimers.addPeriodicTask(std::chrono::seconds(1), [this]() mutable { mSessionJournal->flush(); });
+        mTimers.addPeriodicTask(std::chrono::seconds(10), [this]() mutable { compactSessionJournal(); });
+    }
+    if(!getGlobalConfig().writeAheadLog.empty()) {
+        mWriteAheadLog = std::make_unique<WriteAheadLog>(getGlobalConfig().writeAheadLog, std::chrono::microseconds(getGlobalConfig().writeAheadLogGroupCommitUs));
+        mTimers.addPeriodicTask(std::chrono::seconds(1), [this]() mutable { checkpointWriteAheadLog(); });
+    }
     mTimers.addPeriodicTask(std::chrono::seconds(2), [this]() mutable { cleanup(); });
     mTimers.addPeriodicTask(std::chrono::minutes(10), [this]() mutable { syncRetainedMessagesToDb(); });
+    mTimers.addPeriodicTask(std::chrono::seconds(1), [this]() mutable { evictExpiredMessages(); });
     // initialize db
     mDb.exec("CREATE TABLE IF NOT EXISTS script (name TEXT UNIQUE PRIMARY KEY NOT NULL, code TEXT NOT NULL, persistent_state TEXT, active BOOL NOT NULL DEFAULT TRUE);");
     mDb.exec("CREATE TABLE IF NOT EXISTS retained_msg (topic TEXT UNIQUE PRIMARY KEY NOT NULL, payload BLOB NOT NULL, timestamp TIMESTAMP NOT NULL, qos INTEGER NOT NULL);");
     mDb.exec("PRAGMA journal_mode=WAL;");
     mQueryInsertScript.emplace(mDb, "INSERT OR REPLACE INTO script (name, code) VALUES (?, ?)");
-    mQueryInsertRetainedMsg.emplace(mDb, "INSERT INTO retained_msg (topic, payload, timestamp, qos) VALUES (?, ?, ?, ?)");
+    {
+        // databases created before message expiry was supported lack the expires_at column
+        bool hasExpiresAt = false;
+        SQLite::Statement columnQuery(mDb, "PRAGMA table_info(retained_msg)");
+        while(columnQuery.executeStep()) {
+            if(columnQuery.getColumn(1).getString() == "expires_at")
+                hasExpiresAt = true;
+        }
+        if(!hasExpiresAt) {
+            mDb.exec("ALTER TABLE retained_msg ADD COLUMN expires_at INTEGER NOT NULL DEFAULT 0;");
+        }
+    }
+    mQueryInsertRetainedMsg.emplace(mDb, "INSERT OR REPLACE INTO retained_msg (topic, payload, timestamp, qos, expires_at) VALUES (?, ?, ?, ?, ?)");
+    if(mWriteAheadLog) {
+        // checkpoints write from the timer thread without holding mMutex, so they need their own connection
+        mDb.setBusyTimeout(5000);
+        mCheckpointDb.emplace("nioev.db3", SQLite::OPEN_READWRITE);
+        mCheckpointDb->setBusyTimeout(5000);
+        mCheckpointInsertRetainedMsg.emplace(*mCheckpointDb, "INSERT OR REPLACE INTO retained_msg (topic, payload, timestamp, qos, expires_at) VALUES (?, ?, ?, ?, ?)");
+    }
     // fetch scripts
     SQLite::Statement scriptQuery(mDb, "SELECT name,code,active FROM script");
     std::vector<std::tuple<std::string, std::string, bool>> scripts;
@@ -65,17 +99,94 @@ ApplicationState::ApplicationState() : mAsyncPublisher(*this), mStatistics(std::
         }
     }
     // fetch retained messages
-    SQLite::Statement retainedMsgQuery(mDb, "SELECT topic,payload,timestamp,qos FROM retained_msg");
+    SQLite::Statement retainedMsgQuery(mDb, "SELECT topic,payload,timestamp,qos,expires_at FROM retained_msg");
+    auto now = time(nullptr);
     while(retainedMsgQuery.executeStep()) {
+        std::time_t expiresAt = retainedMsgQuery.getColumn(4).getInt64();
+        if(expiresAt != 0 && expiresAt <= now)
+            continue;
         auto payloadColumn = retainedMsgQuery.getColumn(1);
         std::vector<uint8_t> payload{ (uint8_t*)payloadColumn.getBlob(), (uint8_t*)payloadColumn.getBlob() + payloadColumn.getBytes() };
 
         std::stringstream timestampStr{ retainedMsgQuery.getColumn(2).getString() };
         struct tm timestamp = { 0 };
         timestampStr >> std::get_time(&timestamp, "%Y-%m-%d %H-%M-%S");
-        mRetainedMessages.emplace(retainedMsgQuery.getColumn(0), RetainedMessage{ std::move(payload), mktime(&timestamp), static_cast<QoS>(retainedMsgQuery.getColumn(3).getInt()) /* FIXME: PROPERTIES */ });
+        std::string topic = retainedMsgQuery.getColumn(0);
+        if(expiresAt != 0) {
+            mRetainedMessageExpiry.push(expiresAt, topic);
+        }
+        auto inserted = mRetainedMessages.emplace(std::move(topic), makeRetainedMessage(std::move(payload), mktime(&timestamp), static_cast<QoS>(retainedMsgQuery.getColumn(3).getInt()), {} /* FIXME: PROPERTIES */, expiresAt));
+        if(inserted.second) {
+            retainedMessageAdded(inserted.first->first, inserted.first->second);
+        }
+    }
+    if(mSessionJournal) {
+        restoreSessions();
+    }
+    if(mWriteAheadLog) {
+        recoverWriteAheadLog();
+    }
+}
+void ApplicationState::restoreSessions() {
+    auto sessions = mSessionJournal->restore();
+    for(auto& [clientId, restored] : sessions) {
+        auto& state = mPersistentClientStates.emplace(clientId, std::make_unique<PersistentClientState>(clientId, CleanSession::No, nullptr, mSessionMessageExpiry, mSessionJournal.get())).first->second;
+        state->restore(restored);
+        for(auto& [topic, sub] : restored.subscriptions) {
+            subscribeClientInternal(ChangeRequestSubscribe{state.get(), topic, sub.qos, SubscriptionType::NORMAL, sub.options}, ShouldPersistSubscription::No);
+        }
     }
 }
+void ApplicationState::compactSessionJournal() {
+    if(!mSessionJournal->needsCompaction())
+        return;
+    // Sessions and subscriptions only change while mMutex is held exclusively, so a read lock is enough to get a consistent view of
+    // them without blocking publishes. Packets that change in the meantime are appended to the journal after the snapshot.
+    std::shared_lock<std::shared_mutex> lock{ mMutex };
+    try {
+        mSessionJournal->compact([this](SessionJournal::Snapshot& snapshot) {
+            const std::unordered_map<std::string, Subscription> noSubscriptions;
+            for(auto& [clientId, state] : mPersistentClientStates) {
+                auto subscriptions = mSubscribedTopics.find(state.get());
+                state->writeSnapshot(snapshot, subscriptions != mSubscribedTopics.end() ? subscriptions->second : noSubscriptions);
+            }
+        });
+    } catch(std::exception& e) {
+        spdlog::error("Failed to compact the session journal: {}", e.what());
+    }
+}
+void ApplicationState::recoverWriteAheadLog() {
+    // The log may contain messages that were already delivered before the crash, so they are delivered at least once. Sessions were
+    // restored already, so persistent subscribers receive them as well.
+    for(auto& publish : mWriteAheadLog->recover()) {
+        auto retain = publishNoLockNoRetain(publish.topic, vecToPayload(publish.payload), publish.qos, publish.retain, publish.properties);
+        if(retain == Retain::Yes) {
+            executeChangeRequest(ChangeRequestRetain{ MQTTPacket{std::move(publish.topic), std::move(publish.payload), publish.qos, Retain::Yes, std::move(publish.properties)} });
+        }
+    }
+}
+void ApplicationState::checkpointWriteAheadLog() {
+    auto segments = mWriteAheadLog->rotate();
+    if(segments.empty())
+        return;
+    // Everything the removed segments contained was fanned out and retained already, so it's enough to make retained messages and
+    // stored session packets durable before deleting them.
+    try {
+        syncDirtyRetainedMessagesToDb();
+    } catch(std::exception& e) {
+        spdlog::error("Failed to sync retained messages, keeping {} write-ahead log segments: {}", segments.size(), e.what());
+        return;
+    }
+    if(mSessionJournal) {
+        try {
+            mSessionJournal->sync();
+        } catch(std::exception& e) {
+            spdlog::error("Failed to sync the session journal, keeping {} write-ahead log segments: {}", segments.size(), e.what());
+            return;
+        }
+    }
+    mWriteAheadLog->remove(segments);
+}
 ApplicationState::~ApplicationState() {
     mShouldRun = false;
     mWorkerThread.join();
@@ -87,28 +198,38 @@ void ApplicationState::workerThreadFunc() {
 
     uint tasksPerformed = 0;
     auto processInternalQueue = [this, &tasksPerformed] {
-        for(auto& client : mClients) {
-            if(client.hasSendError()) {
-                logoutClient(client);
-            }
-        }
         while(!mQueueInternal.empty()) {
             executeChangeRequest(std::move(mQueueInternal.front()));
             mQueueInternal.pop_front();
             tasksPerformed += 1;
         }
     };
+    std::vector<std::optional<ChangeRequest>> batch;
+    batch.reserve(CHANGE_REQUEST_BATCH_SIZE);
     uint yieldHelpCount = 0;
     while(mShouldRun) {
         UniqueLockWithAtomicTidUpdate<std::shared_mutex> lock{ mMutex, mCurrentRWHolderOfMMutex };
         tasksPerformed = 0;
         while(!mQueue.was_empty()) {
-            executeChangeRequest(mQueue.pop());
-            tasksPerformed += 1;
-            processInternalQueue();
+            ChangeRequest req;
+            while(batch.size() < CHANGE_REQUEST_BATCH_SIZE && mQueue.try_pop(req)) {
+                batch.emplace_back(std::move(req));
+            }
+            coalesceChangeRequests(batch);
+            for(auto& batchedReq: batch) {
+                if(!batchedReq)
+                    continue;
+                executeChangeRequest(std::move(*batchedReq));
+                tasksPerformed += 1;
+                // requests that were enqueued while executing this one need to run before the next one to preserve ordering
+                processInternalQueue();
+            }
+            batch.clear();
+            logoutClientsWithSendError();
         }
         if(tasksPerformed == 0) {
             processInternalQueue();
+            logoutClientsWithSendError();
         }
         lock.unlock();
         mCurrentRWHolderOfMMutex = std::thread::id();
@@ -201,6 +322,10 @@ void ApplicationState::requestChange(ChangeRequest&& changeRequest, ApplicationS
 
 void ApplicationState::executeChangeRequest(ChangeRequest&& changeRequest) {
     std::visit(*this, std::move(changeRequest));
+    releaseChangeRequest(changeRequest);
+}
+
+void ApplicationState::releaseChangeRequest(const ChangeRequest& changeRequest) {
     std::visit(overloaded{
                    [&](const ChangeRequestLoginClient& req) {
                        if(req.client->decTaskQueueRefCount() && req.client->isLoggedOut())
@@ -225,18 +350,192 @@ void ApplicationState::executeChangeRequest(ChangeRequest&& changeRequest) {
                    [&](auto&) {} }, changeRequest);
 }
 
+void ApplicationState::coalesceChangeRequests(std::vector<std::optional<ChangeRequest>>& batch) {
+    /* During heavy churn many retains in a batch overwrite each other, so only the last retain for a topic in a row needs to be
+     * executed (last write wins). Subscribes and every other type of request except unsubscribes act as a barrier, because
+     * subscribing replays the retained messages that exist at that point in time.
+     * Subscribes and unsubscribes are never coalesced: whether a subscribe followed by an unsubscribe is a no-op depends on
+     * whether the subscription existed before, and the subscribe still needs to replay the retained messages and be journaled.
+     */
+    std::unordered_map<std::string_view, size_t> pendingRetains;
+    size_t droppedCount = 0;
+    auto drop = [&](size_t index) {
+        releaseChangeRequest(*batch[index]);
+        batch[index].reset();
+        droppedCount += 1;
+    };
+    for(size_t i = 0; i < batch.size(); ++i) {
+        std::visit(overloaded{
+                       [&](const ChangeRequestUnsubscribe&) {
+                           // doesn't read retained messages
+                       },
+                       [&](const ChangeRequestRetain& req) {
+                           auto it = pendingRetains.find(std::string_view{req.packet.topic});
+                           if(it != pendingRetains.end()) {
+                               // the key points into the request we're about to drop, so erase it first
+                               auto previous = it->second;
+                               pendingRetains.erase(it);
+                               drop(previous);
+                           }
+                           pendingRetains.emplace(std::string_view{req.packet.topic}, i);
+                       },
+                       [&](const auto&) {
+                           pendingRetains.clear();
+                       } }, *batch[i]);
+    }
+    if(droppedCount > 0) {
+        spdlog::debug("Coalesced {} of {} change requests", droppedCount, batch.size());
+    }
+}
+
+void ApplicationState::notifySendError(MQTTClientConnection& client) {
+    // This is a lock-free intrusive stack (multiple producers, the worker thread is the only consumer). As the consumer always takes the
+    // whole list at once and every client is pushed at most once, there is no ABA problem.
+    client.incTaskQueueRefCount();
+    auto head = mClientsWithSendError.load(std::memory_order_relaxed);
+    do {
+        client.setNextClientWithSendError(head);
+    } while(!mClientsWithSendError.compare_exchange_weak(head, &client, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void ApplicationState::logoutClientsWithSendError() {
+    if(mClientsWithSendError.load(std::memory_order_relaxed) == nullptr)
+        return;
+    auto client = mClientsWithSendError.exchange(nullptr, std::memory_order_acquire);
+    while(client) {
+        auto next = client->getNextClientWithSendError();
+        logoutClient(*client);
+        if(client->decTaskQueueRefCount() && client->isLoggedOut())
+            mShouldCleanup = true;
+        client = next;
+    }
+}
+
 static inline void sendPublish(Subscriber& sub, const std::string& topic, PayloadType payload, QoS qos, Retained retained, const PropertyList& properties) {
     MQTTPublishPacketBuilder builder{ topic, payload, retained, properties };
     sub.publish(topic, payload, qos, retained, properties, builder);
 }
 
+namespace {
+// Shares the encoded packets of a single publish between all subscribers that receive exactly the same bytes. Subscribers only differ in the
+// retain flag (Retain As Published) and in their subscription identifier, so there is one builder per combination of these.
+class PublishPacketBuilderCache {
+public:
+    PublishPacketBuilderCache(const std::string& topic, PayloadType payload, const PropertyList& properties)
+    : mTopic(topic), mPayload(payload), mProperties(properties) {
+
+    }
+    // subscriptionIdentifiers are the identifiers of all subscriptions of this subscriber that matched
+    void publish(Subscriber& sub, QoS qos, Retained retained, const std::vector<uint32_t>& subscriptionIdentifiers) {
+        if(subscriptionIdentifiers.empty()) {
+            auto& builder = mDefaultBuilders[retained == Retained::Yes ? 1 : 0];
+            if(!builder) {
+                builder.emplace(mTopic, mPayload, retained, mProperties);
+            }
+            sub.publish(mTopic, mPayload, qos, retained, mProperties, *builder);
+            return;
+        }
+        for(auto& entry : mIdentifierBuilders) {
+            if(entry.subscriptionIdentifiers == subscriptionIdentifiers && entry.retained == retained) {
+                sub.publish(mTopic, mPayload, qos, retained, entry.properties, entry.builder);
+                return;
+            }
+        }
+        auto& entry = mIdentifierBuilders.emplace_back(mTopic, mPayload, mProperties, retained, subscriptionIdentifiers);
+        sub.publish(mTopic, mPayload, qos, retained, entry.properties, entry.builder);
+    }
+
+private:
+    struct IdentifierEntry {
+        IdentifierEntry(const std::string& topic, PayloadType payload, const PropertyList& baseProperties, Retained retained, const std::vector<uint32_t>& subscriptionIdentifiers)
+        : subscriptionIdentifiers(subscriptionIdentifiers), retained(retained), properties(withIdentifier(baseProperties, subscriptionIdentifiers.front())),
+          builder(topic, payload, retained, properties) {
+            builder.setAdditionalSubscriptionIdentifiers({ subscriptionIdentifiers.begin() + 1, subscriptionIdentifiers.end() });
+        }
+        static PropertyList withIdentifier(const PropertyList& props, uint32_t subscriptionIdentifier) {
+            PropertyList ret = props;
+            ret.insert_or_assign(MQTTProperty::SUBSCRIPTION_IDENTIFIER, subscriptionIdentifier);
+            return ret;
+        }
+        std::vector<uint32_t> subscriptionIdentifiers;
+        Retained retained;
+        // needs to be declared before the builder, as the builder is constructed from it
+        PropertyList properties;
+        MQTTPublishPacketBuilder builder;
+    };
+    const std::string& mTopic;
+    PayloadType mPayload;
+    const PropertyList& mProperties;
+    std::optional<MQTTPublishPacketBuilder> mDefaultBuilders[2];
+    // a list because the builders must not move while packets reference them
+    std::list<IdentifierEntry> mIdentifierBuilders;
+};
+}
+
 void ApplicationState::subscribeClientInternal(ChangeRequestSubscribe&& req, ShouldPersistSubscription persist) {
-    Subscription sub{req.subscriber, req.qos};
+    Subscription sub{req.subscriber, req.qos, req.options};
+    std::optional<SharedSubscriptions::ParsedTopic> shared;
+    try {
+        shared = SharedSubscriptions::parse(req.topic);
+    } catch(std::exception& e) {
+        spdlog::warn("Ignoring invalid shared subscription '{}': {}", req.topic, e.what());
+        return;
+    }
+    auto& subscribedTopics = mSubscribedTopics[req.subscriber];
+    bool isNewSubscription = subscribedTopics.insert_or_assign(req.topic, sub).second;
+    req.subscriber->setSubscriptionCount(subscribedTopics.size());
+    if(persist == ShouldPersistSubscription::Yes) {
+        req.subscriber->onSubscribe(req.topic, sub);
+    }
+    if(shared) {
+        // retained messages aren't sent for shared subscriptions
+        mSharedSubscriptions.subscribe(*shared, sub);
+        return;
+    }
+    if(!isNewSubscription) {
+        // a repeated SUBSCRIBE replaces the existing subscription including its options
+        mSubscriptions.removeSubscription(req.topic, sub);
+    }
     mSubscriptions.addSubscription(req.topic, sub);
+    if(persist == ShouldPersistSubscription::No) {
+        // restored on startup, the client already got the retained messages when it originally subscribed
+        return;
+    }
+    if(req.options.retainHandling == 2 || (req.options.retainHandling == 1 && !isNewSubscription)) {
+        // reconnect fast path: persistent sessions resubscribing to the same filters don't get all retained messages again
+        spdlog::debug("Skipping retained messages for subscription to '{}'", req.topic);
+        return;
+    }
+    auto now = time(nullptr);
     for(auto& retainedMessage : mRetainedMessages) {
+        auto& msg = retainedMessage.second;
+        if(msg.expiresAt != 0 && msg.expiresAt <= now) {
+            // will be evicted soon
+            continue;
+        }
         mSubscriptions.forEveryMatch(retainedMessage.first, [&](Subscription& matchedSub) {
             if(sub == matchedSub) {
-                sendPublish(*req.subscriber, retainedMessage.first, vecToPayload(retainedMessage.second.payload), minQoS(retainedMessage.second.qos, req.qos), Retained::Yes, retainedMessage.second.properties);
+                auto qos = minQoS(msg.qos, req.qos);
+                const PropertyList* properties = &msg.properties;
+                PropertyList adjustedProperties;
+                if(msg.expiresAt != 0 || req.options.subscriptionIdentifier != 0) {
+                    adjustedProperties = msg.properties;
+                    if(msg.expiresAt != 0) {
+                        // the receiver gets the remaining lifetime of the message
+                        adjustedProperties.insert_or_assign(MQTTProperty::MESSAGE_EXPIRY_INTERVAL, static_cast<uint32_t>(msg.expiresAt - now));
+                    }
+                    if(req.options.subscriptionIdentifier != 0) {
+                        adjustedProperties.insert_or_assign(MQTTProperty::SUBSCRIPTION_IDENTIFIER, req.options.subscriptionIdentifier);
+                    }
+                    properties = &adjustedProperties;
+                }
+                if(msg.mappedPayload) {
+                    // reference the mapping directly instead of copying the payload into the packet
+                    MQTTPublishPacketBuilder builder{ retainedMessage.first, msg.getPayload(), msg.mappedPayload, Retained::Yes, *properties };
+                    req.subscriber->publish(retainedMessage.first, msg.getPayload(), qos, Retained::Yes, *properties, builder);
+                } else {
+                    sendPublish(*req.subscriber, retainedMessage.first, msg.getPayload(), qos, Retained::Yes, *properties);
+                }
             }
         });
     }
@@ -249,6 +548,24 @@ void ApplicationState::operator()(ChangeRequestSubscribe&& req) {
 void ApplicationState::operator()(ChangeRequestUnsubscribe&& req) {
     if(req.subscriber->isDeleted())
         return;
+    std::optional<SharedSubscriptions::ParsedTopic> shared;
+    try {
+        shared = SharedSubscriptions::parse(req.topic);
+    } catch(std::exception&) {
+        return;
+    }
+    auto topics = mSubscribedTopics.find(req.subscriber);
+    if(topics != mSubscribedTopics.end()) {
+        topics->second.erase(req.topic);
+        req.subscriber->setSubscriptionCount(topics->second.size());
+        if(topics->second.empty())
+            mSubscribedTopics.erase(topics);
+    }
+    req.subscriber->onUnsubscribe(req.topic);
+    if(shared) {
+        mSharedSubscriptions.unsubscribe(*shared, req.subscriber);
+        return;
+    }
     mSubscriptions.removeSubscription(req.topic, Subscription{req.subscriber, QoS::QoS0 /* QoS doesn't matter here */});
 }
 void ApplicationState::operator()(ChangeRequestUnsubscribeFromAll&& req) {
@@ -256,13 +573,48 @@ void ApplicationState::operator()(ChangeRequestUnsubscribeFromAll&& req) {
         return;
     deleteAllSubscriptions(*req.subscriber);
 }
+ApplicationState::RetainedMessage ApplicationState::makeRetainedMessage(std::vector<uint8_t>&& payload, std::time_t timestamp, QoS qos, PropertyList properties, std::time_t expiresAt) {
+    auto threshold = getGlobalConfig().retainedMmapThreshold;
+    if(threshold > 0 && payload.size() >= threshold) {
+        try {
+            auto mapped = MappedPayload::create(vecToPayload(payload));
+            return RetainedMessage{ {}, timestamp, qos, std::move(properties), std::move(mapped), expiresAt };
+        } catch(std::exception& e) {
+            spdlog::warn("Failed to map retained payload of {} bytes, keeping it on the heap: {}", payload.size(), e.what());
+        }
+    }
+    return RetainedMessage{ std::move(payload), timestamp, qos, std::move(properties), nullptr, expiresAt };
+}
 void ApplicationState::operator()(ChangeRequestRetain&& req) {
+    if(mWriteAheadLog) {
+        mDirtyRetainedTopics.emplace(req.packet.topic);
+    }
+    auto existing = mRetainedMessages.find(req.packet.topic);
+    if(existing != mRetainedMessages.end()) {
+        retainedMessageRemoved(existing->first, existing->second);
+    }
     if(req.packet.payload.empty()) {
-        mRetainedMessages.erase(req.packet.topic);
+        if(existing != mRetainedMessages.end()) {
+            mRetainedMessages.erase(existing);
+        }
     } else {
-        mRetainedMessages.insert_or_assign(std::move(req.packet.topic), RetainedMessage{ std::move(req.packet.payload), time(nullptr), req.packet.qos, req.packet.properties });
+        auto now = time(nullptr);
+        auto expiresAt = getMessageExpiry(req.packet.properties, now);
+        if(expiresAt != 0) {
+            mRetainedMessageExpiry.push(expiresAt, req.packet.topic);
+        }
+        auto inserted = mRetainedMessages.insert_or_assign(std::move(req.packet.topic), makeRetainedMessage(std::move(req.packet.payload), now, req.packet.qos, std::move(req.packet.properties), expiresAt));
+        retainedMessageAdded(inserted.first->first, inserted.first->second);
     }
 }
+void ApplicationState::retainedMessageAdded(const std::string& topic, const RetainedMessage& msg) {
+    Metrics::add(Gauge::RETAINED_MSGS, 1);
+    Metrics::add(Gauge::RETAINED_BYTES, msg.getPayload().size() + topic.size() + 1);
+}
+void ApplicationState::retainedMessageRemoved(const std::string& topic, const RetainedMessage& msg) {
+    Metrics::add(Gauge::RETAINED_MSGS, -1);
+    Metrics::add(Gauge::RETAINED_BYTES, -static_cast<int64_t>(msg.getPayload().size() + topic.size() + 1));
+}
 void ApplicationState::cleanup() {
     UniqueLockWithAtomicTidUpdate<std::shared_mutex> lock{ mMutex, mCurrentRWHolderOfMMutex };
     for(auto it = mClients.begin(); it != mClients.end(); ++it) {
@@ -283,10 +635,17 @@ void ApplicationState::cleanup() {
         mClientManager.suspendAllThreads();
         lock.lock();
         mCurrentRWHolderOfMMutex = std::this_thread::get_id();
+        bool clientsRemaining = false;
         for(auto it = mClients.begin(); it != mClients.end();) {
             if(it->isLoggedOut() && it->getTaskQueueRefCount() == 0) {
+                if(ClientTraffic::isEnabled()) {
+                    std::unique_lock<std::mutex> trafficLock{mClientTrafficMutex};
+                    mClientTrafficRegistry.erase(&*it);
+                }
                 it = mClients.erase(it);
             } else {
+                // the reference might be held by a thread that can't notify us (e.g. a sender thread), so try again next time
+                clientsRemaining |= it->isLoggedOut();
                 it++;
             }
         }
@@ -297,13 +656,15 @@ void ApplicationState::cleanup() {
                 it++;
             }
         }
-        mShouldCleanup = false;
+        mShouldCleanup = clientsRemaining;
         mClientManager.resumeAllThreads();
     }
 }
 void ApplicationState::operator()(ChangeRequestLoginClient&& req) {
-    if(req.client->isLoggedOut())
+    if(req.client->isLoggedOut()) {
+        mClientManager.notifyLoginProcessed(*req.client);
         return;
+    }
     constexpr char AVAILABLE_RANDOM_CHARS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890";
 
     decltype(mPersistentClientStates.begin()) existingSession;
@@ -340,9 +701,9 @@ void ApplicationState::operator()(ChangeRequestLoginClient&& req) {
         response.encodeByte(0); // everything okay
         if(req.client->getMQTTVersion() == MQTTVersion::V5) {
             PropertyList properties;
-            properties.emplace(MQTTProperty::TOPIC_ALIAS_MAXIMUM, uint16_t(0));
-            properties.emplace(MQTTProperty::SUBSCRIPTION_IDENTIFIER_AVAILABLE, uint8_t(0)); // FIXME support sub identifiers
-            properties.emplace(MQTTProperty::SHARED_SUBSCRIPTION_AVAILABLE, uint8_t(0));
+            properties.emplace(MQTTProperty::TOPIC_ALIAS_MAXIMUM, uint16_t(getGlobalConfig().topicAliasMaximum));
+            properties.emplace(MQTTProperty::SUBSCRIPTION_IDENTIFIER_AVAILABLE, uint8_t(1));
+            properties.emplace(MQTTProperty::SHARED_SUBSCRIPTION_AVAILABLE, uint8_t(1));
             response.encodePropertyList(properties);
         }
         req.client->sendData(EncodedPacket::fromData(static_cast<uint8_t>(MQTTMessageType::CONNACK) << 4, response.moveData()));
@@ -352,6 +713,8 @@ void ApplicationState::operator()(ChangeRequestLoginClient&& req) {
         // disconnect existing client
         auto [existingClient, existingClientLock] = existingSession->second->getCurrentClient();
         if(req.cleanSession == CleanSession::Yes || existingSession->second->isCleanSession() == CleanSession::Yes) {
+            // the session starts from scratch, so the subscriptions of the old one mustn't count as already existing
+            deleteAllSubscriptions(*existingSession->second);
             existingSession->second->replaceCurrentClient(existingClientLock, req.client, req.cleanSession, PersistentClientState::ReplaceStyle::CleanSession);
             if(existingClient) {
                 spdlog::warn("[{}] Already logged in, closing old connection", req.clientId);
@@ -365,24 +728,9 @@ void ApplicationState::operator()(ChangeRequestLoginClient&& req) {
                 logoutClient(*existingClient);
             }
             sendConnack();
-            std::vector<HighQoSRetainStorage> orderedPackets;
-            orderedPackets.reserve(existingSession->second->getHighQoSSendingPackets().size());
-            for(auto& packet: existingSession->second->getHighQoSSendingPackets()) {
-                // FIXME check mqtt version & reencode maybe
-                orderedPackets.emplace_back(packet.second);
-            }
-            std::sort(orderedPackets.begin(), orderedPackets.end(), [](auto& a, auto& b) {
-                return a.getGlobalOrder() < b.getGlobalOrder();
-            });
-
-            for(auto& highQoSPacket : orderedPackets) {
-                auto cpy = highQoSPacket.getPacketSharedCopy();
-                cpy.setDupFlag();
-                // On a sidenote: The dup flag is so useless. Like no MQTT implementation really makes use of it, most just hand it to the client who
-                // ignores it. Even we ignore the dup flags for packets we receive. Luckily, we can avoid the expensive buffer copies due to only having
-                // to modify the first byte
-                req.client->sendData(std::move(cpy));
-            }
+            existingSession->second->dropExpiredMessages(time(nullptr));
+            // also releases the messages that were held back due to the receive maximum, as far as the new receive maximum allows
+            existingSession->second->resendStoredPackets();
             for(size_t i = 0; i < existingSession->second->getQoS2PubRecReceived().count(); ++i) {
                 if(existingSession->second->getQoS2PubRecReceived()[i]) {
                     BinaryEncoder encoder;
@@ -393,7 +741,7 @@ void ApplicationState::operator()(ChangeRequestLoginClient&& req) {
         }
     } else {
         // no session exists
-        auto newState = mPersistentClientStates.emplace_hint(existingSession, std::piecewise_construct, std::make_tuple(req.clientId), std::make_tuple(std::make_unique<PersistentClientState>(req.clientId, req.cleanSession, req.client)));
+        auto newState = mPersistentClientStates.emplace_hint(existingSession, std::piecewise_construct, std::make_tuple(req.clientId), std::make_tuple(std::make_unique<PersistentClientState>(req.clientId, req.cleanSession, req.client, mSessionMessageExpiry, mSessionJournal.get())));
         sessionPresent = SessionPresent::No;
         auto lock = newState->second->getLock();
         newState->second->replaceCurrentClient(lock, req.client, req.cleanSession, PersistentClientState::ReplaceStyle::CleanSession);
@@ -405,6 +753,7 @@ void ApplicationState::operator()(ChangeRequestLoginClient&& req) {
     spdlog::info("[{}] Logged in from [{}:{}]", req.client->getClientId(), req.client->getTcpClient().getRemoteIp(), req.client->getTcpClient().getRemotePort());
     sendConnack();
     req.client->setStateAtomic(MQTTClientConnection::ConnectionState::CONNECTED);
+    mClientManager.notifyLoginProcessed(*req.client);
 }
 void ApplicationState::operator()(ChangeRequestLogoutClient&& req) {
     if(req.client->isLoggedOut())
@@ -466,8 +815,10 @@ void ApplicationState::logoutClient(MQTTClientConnection& client) {
     if(client.isLoggedOut())
         return;
     mShouldCleanup = true;
-    mClientManager.removeClientConnection(client);
+    // has to happen before removing the connection, see ClientThreadManager::setReceivingEnabled
     client.notifyLoggedOut();
+    mClientManager.removeClientConnection(client);
+    Metrics::add(Gauge::CONNECTIONS, -1);
 
 
     spdlog::info("[{}] Logged out", client.getClientId());
@@ -490,29 +841,29 @@ void ApplicationState::logoutClient(MQTTClientConnection& client) {
             if(actualState == mPersistentClientStates.end()) {
                 return;
             }
-            mSubscriptions.removeAllSubscriptions(Subscription{state, QoS::QoS0}); // QoS doesn't matter here
+            deleteAllSubscriptions(*state);
             mDeletedPersistentClientStates.emplace_back(std::move(actualState->second));
             mPersistentClientStates.erase(actualState);
             mShouldCleanup = true;
         }
     }
 }
-void ApplicationState::publish(std::string&& topic, PayloadType msg, QoS qos, Retain retain, const PropertyList& properties) {
+void ApplicationState::publish(std::string&& topic, PayloadType msg, QoS qos, Retain retain, const PropertyList& properties, const Subscriber* origin, WriteAheadLog::SegmentRef walSegment) {
     std::shared_lock<std::shared_mutex> lock{ mMutex };
-    retain = publishNoLockNoRetain(topic, msg, qos, retain, properties);
+    retain = publishNoLockNoRetain(topic, msg, qos, retain, properties, origin);
     lock.unlock();
     if(retain == Retain::Yes) {
         // we aren't allowed to call requestChange from another thread while holding a lock, so we need to do it here
-        requestChange(ChangeRequestRetain{ MQTTPacket{std::move(topic), payloadToVec(msg), qos, Retain::Yes, properties} }, RequestChangeMode::TRY_SYNC_THEN_ASYNC);
+        requestChange(ChangeRequestRetain{ MQTTPacket{std::move(topic), payloadToVec(msg), qos, Retain::Yes, properties}, std::move(walSegment) }, RequestChangeMode::TRY_SYNC_THEN_ASYNC);
     }
 }
-void ApplicationState::publishInternal(std::string&& topic, PayloadType msg, QoS qos, Retain retain, const PropertyList& properties) {
-    retain = publishNoLockNoRetain(topic, msg, qos, retain, properties);
+void ApplicationState::publishInternal(std::string&& topic, PayloadType msg, QoS qos, Retain retain, const PropertyList& properties, const Subscriber* origin) {
+    retain = publishNoLockNoRetain(topic, msg, qos, retain, properties, origin);
     if(retain == Retain::Yes) {
         requestChange(ChangeRequestRetain{ MQTTPacket{std::move(topic), payloadToVec(msg), qos, Retain::Yes, properties} }, RequestChangeMode::TRY_SYNC_THEN_ASYNC);
     }
 }
-Retain ApplicationState::publishNoLockNoRetain(const std::string& topic, PayloadType msg, QoS publishQoS, Retain retain, const PropertyList& properties) {
+Retain ApplicationState::publishNoLockNoRetain(const std::string& topic, PayloadType msg, QoS publishQoS, Retain retain, const PropertyList& properties, const Subscriber* origin) {
 // NOTE: It's possible that we only have a read-only lock here, so we aren't allowed to call requestChange
 #ifndef NDEBUG
     if(topic != LOG_TOPIC) {
@@ -520,21 +871,76 @@ Retain ApplicationState::publishNoLockNoRetain(const std::string& topic, Payload
         spdlog::trace("Publishing on '{}' data '{}'", topic, dataAsStr);
     }
 #endif
+    mStatistics->record(topic, msg.size(), publishQoS);
     // first check for publish to $NIOEV
     if(startsWith(topic, "$NIOEV")) {
         performSystemAction(topic, msg);
         //retain = Retain::No;
     }
-    std::unordered_set<Subscriber*> subs;
+    // flush every subscriber once after the whole fan-out instead of once per packet (if enabled)
+    WriteBatchScope writeBatch;
+    PublishPacketBuilderCache builders{topic, msg, properties};
+    // matching is interleaved with delivering, so the time spent delivering is measured separately and excluded
+    auto matchStart = StageTimings::now();
+    uint64_t deliveryTicks = 0;
+    auto deliver = [&](Subscriber& subscriber, QoS qos, Retained retained, const std::vector<uint32_t>& subscriptionIdentifiers) {
+        auto deliveryStart = StageTimings::now();
+        builders.publish(subscriber, qos, retained, subscriptionIdentifiers);
+        if(deliveryStart)
+            deliveryTicks += StageTimings::now() - deliveryStart;
+    };
+    auto getRetained = [&](const Subscription& sub) {
+        return sub.options.retainAsPublished && retain == Retain::Yes ? Retained::Yes : Retained::No;
+    };
+    // The scratch vectors are reused to avoid allocations for every publish. They are taken out of the thread local storage, as
+    // delivering could end up publishing again on this thread.
+    thread_local std::vector<Subscription*> reusedMergedMatches;
+    thread_local std::vector<uint32_t> reusedSubscriptionIdentifiers;
+    auto mergedMatches = std::exchange(reusedMergedMatches, {});
+    auto subscriptionIdentifiers = std::exchange(reusedSubscriptionIdentifiers, {});
+    mergedMatches.clear();
+    subscriptionIdentifiers.clear();
 
-    mSubscriptions.forEveryMatch(topic, [&topic, &msg, publishQoS, &subs, &properties](Subscription& sub) {
-        if(subs.contains(sub.subscriber))
+    // A subscriber with several overlapping subscriptions gets the message once, with the maximum QoS and all subscription identifiers.
+    // Most subscribers have a single subscription without identifier though, so they get the message right away and only the others
+    // are merged afterwards.
+    mSubscriptions.forEveryMatch(topic, [&](Subscription& sub) {
+        if(sub.options.noLocal && sub.subscriber == origin)
+            return;
+        if(sub.subscriber->getSubscriptionCount() > 1 || sub.options.subscriptionIdentifier != 0) {
+            mergedMatches.emplace_back(&sub);
             return;
-        subs.emplace(sub.subscriber);
+        }
         // according to the spec, we have to downgrade the publishQoS level here to match that of the publish; TODO allow overriding this behaviour in a config file
-        auto usedQos = minQoS(sub.qos, publishQoS);
-        sendPublish(*sub.subscriber, topic, msg, usedQos, Retained::No, properties);
+        deliver(*sub.subscriber, minQoS(sub.qos, publishQoS), getRetained(sub), subscriptionIdentifiers);
+    });
+    std::sort(mergedMatches.begin(), mergedMatches.end(), [](const Subscription* a, const Subscription* b) {
+        return a->subscriber < b->subscriber;
     });
+    for(auto it = mergedMatches.begin(); it != mergedMatches.end();) {
+        auto& first = **it;
+        auto qos = QoS::QoS0;
+        subscriptionIdentifiers.clear();
+        for(; it != mergedMatches.end() && (*it)->subscriber == first.subscriber; ++it) {
+            qos = std::max(qos, minQoS((*it)->qos, publishQoS));
+            if((*it)->options.subscriptionIdentifier != 0) {
+                subscriptionIdentifiers.emplace_back((*it)->options.subscriptionIdentifier);
+            }
+        }
+        deliver(*first.subscriber, qos, getRetained(first), subscriptionIdentifiers);
+    }
+    // every matching shared subscription group delivers the message to exactly one of its members
+    mSharedSubscriptions.forEveryMatch(topic, [&](Subscription& sub) {
+        subscriptionIdentifiers.clear();
+        if(sub.options.subscriptionIdentifier != 0) {
+            subscriptionIdentifiers.emplace_back(sub.options.subscriptionIdentifier);
+        }
+        deliver(*sub.subscriber, minQoS(sub.qos, publishQoS), getRetained(sub), subscriptionIdentifiers);
+    });
+    reusedMergedMatches = std::move(mergedMatches);
+    reusedSubscriptionIdentifiers = std::move(subscriptionIdentifiers);
+    if(matchStart)
+        StageTimings::recordSince(PublishStage::MATCH, matchStart + deliveryTicks);
     return retain;
     // TODO reimplement sync scripts
 }
@@ -542,10 +948,31 @@ void ApplicationState::handleNewClientConnection(TcpClientConnection&& conn) {
     UniqueLockWithAtomicTidUpdate<std::shared_mutex> lock{ mMutex, mCurrentRWHolderOfMMutex };
     spdlog::info("New connection from [{}:{}]", conn.getRemoteIp(), conn.getRemotePort());
     auto& newClient = mClients.emplace_back(*this, std::move(conn));
+    Metrics::add(Counter::CONNECTIONS_TOTAL);
+    Metrics::add(Gauge::CONNECTIONS, 1);
+    if(ClientTraffic::isEnabled()) {
+        std::unique_lock<std::mutex> trafficLock{mClientTrafficMutex};
+        mClientTrafficRegistry.emplace(&newClient);
+    }
     mClientManager.addClientConnection(newClient);
 }
+std::vector<ClientTrafficEntry> ApplicationState::getClientTraffic() const {
+    std::vector<ClientTrafficEntry> ret;
+    std::unique_lock<std::mutex> lock{mClientTrafficMutex};
+    ret.reserve(mClientTrafficRegistry.size());
+    for(auto client: mClientTrafficRegistry) {
+        if(client->isLoggedOut() || client->getStateAtomic() != MQTTClientConnection::ConnectionState::CONNECTED)
+            continue;
+        auto& tcpClient = client->getTcpClient();
+        ret.emplace_back(ClientTrafficEntry{ client->getClientId(), tcpClient.getRemoteIp(), tcpClient.getRemotePort(), client->getTraffic().snapshot() });
+    }
+    return ret;
+}
 void ApplicationState::deleteAllSubscriptions(Subscriber& sub) {
     mSubscriptions.removeAllSubscriptions(Subscription{&sub, QoS::QoS0}); // QoS doesn't matter here
+    mSharedSubscriptions.unsubscribeFromAll(&sub);
+    mSubscribedTopics.erase(&sub);
+    sub.setSubscriptionCount(0);
 }
 ApplicationState::ScriptsInfo ApplicationState::getScriptsInfo() {
     UniqueLockWithAtomicTidUpdate lock{ mMutex, mCurrentRWHolderOfMMutex };
@@ -564,27 +991,106 @@ ApplicationState::ScriptsInfo ApplicationState::getScriptsInfo() {
     return ret;
 }
 void ApplicationState::syncRetainedMessagesToDb() {
+    std::unique_lock<std::mutex> dbLock{ mRetainedDbMutex };
     UniqueLockWithAtomicTidUpdate lock{ mMutex, mCurrentRWHolderOfMMutex };
     SQLite::Transaction transaction{ mDb };
     mDb.exec("DELETE FROM retained_msg");
     for(auto& msg : mRetainedMessages) {
-        mQueryInsertRetainedMsg->bindNoCopy(1, msg.first);
-        mQueryInsertRetainedMsg->bindNoCopy(2, msg.second.payload.data(), msg.second.payload.size());
-        struct tm res;
-        gmtime_r(&msg.second.timestamp, &res);
-        std::stringstream timestampAsStr;
-        timestampAsStr << std::put_time(&res, "%Y-%m-%d %H-%M-%S.000");
-        mQueryInsertRetainedMsg->bind(3, timestampAsStr.str());
-        mQueryInsertRetainedMsg->bind(4, static_cast<int>(msg.second.qos));
-
-        mQueryInsertRetainedMsg->exec();
-        mQueryInsertRetainedMsg->clearBindings();
-        mQueryInsertRetainedMsg->reset();
+        insertRetainedMessageIntoDb(*mQueryInsertRetainedMsg, msg.first, msg.second);
     }
     transaction.commit();
+    mDirtyRetainedTopics.clear();
     mDb.exec("VACUUM");
     spdlog::info("Synced retained messages to db");
 }
+void ApplicationState::syncDirtyRetainedMessagesToDb() {
+    std::unique_lock<std::mutex> dbLock{ mRetainedDbMutex };
+    // Only copying the dirty messages needs the exclusive lock, they are written to the db without blocking publishes. An empty
+    // optional means the retained message was removed.
+    std::vector<std::pair<std::string, std::optional<RetainedMessage>>> dirty;
+    {
+        UniqueLockWithAtomicTidUpdate lock{ mMutex, mCurrentRWHolderOfMMutex };
+        dirty.reserve(mDirtyRetainedTopics.size());
+        for(auto& topic : mDirtyRetainedTopics) {
+            auto msg = mRetainedMessages.find(topic);
+            if(msg != mRetainedMessages.end()) {
+                dirty.emplace_back(topic, msg->second);
+            } else {
+                dirty.emplace_back(topic, std::nullopt);
+            }
+        }
+        mDirtyRetainedTopics.clear();
+    }
+    if(dirty.empty())
+        return;
+    try {
+        SQLite::Transaction transaction{ *mCheckpointDb };
+        SQLite::Statement deleteQuery{ *mCheckpointDb, "DELETE FROM retained_msg WHERE topic=?" };
+        for(auto& [topic, msg] : dirty) {
+            if(msg) {
+                insertRetainedMessageIntoDb(*mCheckpointInsertRetainedMsg, topic, *msg);
+            } else {
+                deleteQuery.bindNoCopy(1, topic);
+                deleteQuery.exec();
+                deleteQuery.clearBindings();
+                deleteQuery.reset();
+            }
+        }
+        transaction.commit();
+    } catch(...) {
+        // the next checkpoint tries again
+        UniqueLockWithAtomicTidUpdate lock{ mMutex, mCurrentRWHolderOfMMutex };
+        for(auto& entry : dirty) {
+            mDirtyRetainedTopics.emplace(std::move(entry.first));
+        }
+        throw;
+    }
+}
+void ApplicationState::insertRetainedMessageIntoDb(SQLite::Statement& query, const std::string& topic, const RetainedMessage& msg) {
+    query.bindNoCopy(1, topic);
+    auto payload = msg.getPayload();
+    query.bindNoCopy(2, payload.data(), payload.size());
+    struct tm res;
+    gmtime_r(&msg.timestamp, &res);
+    std::stringstream timestampAsStr;
+    timestampAsStr << std::put_time(&res, "%Y-%m-%d %H-%M-%S.000");
+    query.bind(3, timestampAsStr.str());
+    query.bind(4, static_cast<int>(msg.qos));
+    query.bind(5, static_cast<int64_t>(msg.expiresAt));
+
+    query.exec();
+    query.clearBindings();
+    query.reset();
+}
+void ApplicationState::evictExpiredMessages() {
+    auto now = time(nullptr);
+    if(!mRetainedMessageExpiry.hasExpired(now) && !mSessionMessageExpiry.hasExpired(now))
+        return;
+    UniqueLockWithAtomicTidUpdate lock{ mMutex, mCurrentRWHolderOfMMutex };
+    size_t evictedRetainedMessages = 0;
+    mRetainedMessageExpiry.popExpired(now, [&](const std::string& topic, std::time_t expiresAt) {
+        auto it = mRetainedMessages.find(topic);
+        // the message could have been replaced in the meantime
+        if(it != mRetainedMessages.end() && it->second.expiresAt == expiresAt) {
+            retainedMessageRemoved(it->first, it->second);
+            mRetainedMessages.erase(it);
+            evictedRetainedMessages += 1;
+        }
+    });
+    std::unordered_set<std::string> expiredSessions;
+    mSessionMessageExpiry.popExpired(now, [&](const std::string& clientId, std::time_t) {
+        expiredSessions.emplace(clientId);
+    });
+    for(auto& clientId: expiredSessions) {
+        auto state = mPersistentClientStates.find(clientId);
+        if(state != mPersistentClientStates.end()) {
+            state->second->dropExpiredMessages(now);
+        }
+    }
+    if(evictedRetainedMessages > 0) {
+        spdlog::debug("Evicted {} expired retained messages", evictedRetainedMessages);
+    }
+}
 void ApplicationState::addScript(
     std::string name, std::function<void(const std::string&, const std::string&)>&& onSuccess, std::function<void(const std::string&, const std::string&)>&& onError, std::string code) {
     if(!hasValidScriptExtension(name))
@@ -662,29 +1168,309 @@ void ApplicationState::performSystemAction(const std::string& topic, std::string
 
 void PersistentClientState::publish(const std::string& topic, PayloadType payload, QoS qos, Retained retained, const PropertyList& properties, MQTTPublishPacketBuilder& packetBuilder) {
     std::unique_lock<std::recursive_mutex> lock{mMutex};
-    if(qos == QoS::QoS0) {
-        mCurrentClient->publish(topic, payload, QoS::QoS0, retained, properties, packetBuilder, 0);
-        return;
-    }
     MQTTVersion encoderVersion = MQTTVersion::V4;
     if(mCurrentClient) {
         encoderVersion = mCurrentClient->getMQTTVersion();
     }
-    // TODO smarter packet id choosing
-    uint16_t packetId;
-    do {
-        mPacketIdCounter += 1;
-    } while(mPacketIdCounter == 0);
-    packetId = mPacketIdCounter;
+    auto exceedsMaximumPacketSize = [&] {
+        if(mMaximumPacketSize == 0)
+            return false;
+        // the packet that is sent now may use a topic alias, but stored packets are resent without one
+        if(mCurrentClient && mCurrentClient->getPublishPacketSize(topic, qos, packetBuilder) > mMaximumPacketSize)
+            return true;
+        return qos != QoS::QoS0 && packetBuilder.getPacket(qos, 0, encoderVersion).fullSize() > mMaximumPacketSize;
+    };
+    if(exceedsMaximumPacketSize()) {
+        // the client would reject the packet, so the spec tells us to act as if it was delivered
+        spdlog::debug("[{}] Dropping message on {} as it exceeds the maximum packet size of {}", mClientID, topic, mMaximumPacketSize);
+        Metrics::add(Counter::DROPPED_MSGS);
+        if(mCurrentClient) {
+            mCurrentClient->getTraffic().dropped();
+        }
+        return;
+    }
+    if(qos == QoS::QoS0) {
+        if(mCurrentClient) {
+            mCurrentClient->publish(topic, payload, QoS::QoS0, retained, properties, packetBuilder, 0);
+        }
+        return;
+    }
+    auto expiresAt = getMessageExpiry(properties, time(nullptr));
+    if(expiresAt != 0 && !mCurrentClient) {
+        // the message is stored until the client reconnects, so make sure it's dropped if that takes too long
+        mMessageExpiry.push(expiresAt, mClientID);
+    }
+    if(isReceiveWindowFull() || !mQueuedHighQoSPackets.empty()) {
+        auto maximumQueued = getGlobalConfig().maximumQueuedMessagesPerSession;
+        if(maximumQueued > 0 && mQueuedHighQoSPackets.size() >= maximumQueued) {
+            spdlog::debug("[{}] Dropping message on {} as {} messages are queued already", mClientID, topic, mQueuedHighQoSPackets.size());
+            Metrics::add(Counter::DROPPED_MSGS);
+            if(mCurrentClient) {
+                mCurrentClient->getTraffic().dropped();
+            }
+            return;
+        }
+        // the packet id is set once the packet is released
+        auto& queued = mQueuedHighQoSPackets.emplace_back(QueuedHighQoSPacket{packetBuilder.getPacket(qos, 0, encoderVersion), qos, encoderVersion, expiresAt, mQueueNumberCounter++});
+        if(mJournal && mCleanSession == CleanSession::No) {
+            mJournal->packetQueued(mClientID, queued.queueNumber, qos, encoderVersion, expiresAt, queued.packet);
+        }
+        return;
+    }
+    uint16_t packetId = nextPacketId();
 
-    if(qos == QoS::QoS1) {
-        mHighQoSSendingPackets.emplace(packetId, HighQoSRetainStorage{packetBuilder.getPacket(qos, packetId, encoderVersion), qos, encoderVersion});
-    } else if(qos == QoS::QoS2) {
-        mHighQoSSendingPackets.emplace(packetId, HighQoSRetainStorage{packetBuilder.getPacket(qos, packetId, encoderVersion), qos, encoderVersion});
+    auto& stored = mHighQoSSendingPackets.emplace(packetId, HighQoSRetainStorage{packetBuilder.getPacket(qos, packetId, encoderVersion), qos, encoderVersion, expiresAt}).first->second;
+    if(mJournal && mCleanSession == CleanSession::No) {
+        mJournal->packetStored(mClientID, packetId, qos, encoderVersion, expiresAt, stored.getPacket());
     }
     if(mCurrentClient) {
+        stored.markSent();
         // FIXME release lock somehow here???
         mCurrentClient->publish(topic, payload, qos, retained, properties, packetBuilder, packetId);
     }
 }
+uint16_t PersistentClientState::nextPacketId() {
+    // skip ids that are still in use; there are at most receive maximum of them, so this terminates quickly
+    do {
+        mPacketIdCounter += 1;
+    } while(mPacketIdCounter == 0 || mHighQoSSendingPackets.contains(mPacketIdCounter) || mQos2pubrecReceived[mPacketIdCounter]);
+    return mPacketIdCounter;
+}
+void PersistentClientState::applyFlowControlLimits(const PropertyList& connectProperties) {
+    // the default receive maximum is 65535, a value of 0 is a protocol error which we treat as the default
+    mReceiveMaximum = getIntegerProperty(connectProperties, MQTTProperty::RECEIVE_MAXIMUM).value_or(UINT16_MAX);
+    if(mReceiveMaximum == 0)
+        mReceiveMaximum = UINT16_MAX;
+    mMaximumPacketSize = getIntegerProperty(connectProperties, MQTTProperty::MAXIMUM_PACKET_SIZE).value_or(0);
+}
+bool PersistentClientState::acknowledgeSentPacket(uint16_t packetId) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(mHighQoSSendingPackets.erase(packetId) != 1)
+        return false;
+    if(!mStoredPacketsToResend.empty()) {
+        // the client may acknowledge a packet it got before reconnecting
+        std::erase(mStoredPacketsToResend, packetId);
+    }
+    if(mJournal && mCleanSession == CleanSession::No) {
+        mJournal->packetAcknowledged(mClientID, packetId);
+    }
+    return true;
+}
+void PersistentClientState::markPubRecReceived(uint16_t packetId) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(!mQos2pubrecReceived[packetId]) {
+        mQos2pubrecReceived[packetId] = true;
+        mQoS2AwaitingPubCompCount += 1;
+        if(mJournal && mCleanSession == CleanSession::No) {
+            mJournal->pubRecReceived(mClientID, packetId, true);
+        }
+    }
+}
+void PersistentClientState::markPubCompReceived(uint16_t packetId) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(mQos2pubrecReceived[packetId]) {
+        mQos2pubrecReceived[packetId] = false;
+        mQoS2AwaitingPubCompCount -= 1;
+        if(mJournal && mCleanSession == CleanSession::No) {
+            mJournal->pubRecReceived(mClientID, packetId, false);
+        }
+    }
+}
+bool PersistentClientState::markQoS2Receiving(uint16_t packetId) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(mQoS2receivingPacketIds[packetId])
+        return true;
+    mQoS2receivingPacketIds[packetId] = true;
+    if(mJournal && mCleanSession == CleanSession::No) {
+        mJournal->qos2Receiving(mClientID, packetId, true);
+    }
+    return false;
+}
+bool PersistentClientState::unmarkQoS2Receiving(uint16_t packetId) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(!mQoS2receivingPacketIds[packetId])
+        return false;
+    mQoS2receivingPacketIds[packetId] = false;
+    if(mJournal && mCleanSession == CleanSession::No) {
+        mJournal->qos2Receiving(mClientID, packetId, false);
+    }
+    return true;
+}
+void PersistentClientState::onSubscribe(const std::string& topic, const Subscription& sub) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(mJournal && mCleanSession == CleanSession::No) {
+        mJournal->subscribed(mClientID, topic, sub.qos, sub.options);
+    }
+}
+void PersistentClientState::onUnsubscribe(const std::string& topic) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(mJournal && mCleanSession == CleanSession::No) {
+        mJournal->unsubscribed(mClientID, topic);
+    }
+}
+void PersistentClientState::resendStoredPackets() {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(!mCurrentClient)
+        return;
+    std::vector<std::pair<uint64_t, uint16_t>> orderedPackets;
+    orderedPackets.reserve(mHighQoSSendingPackets.size());
+    for(auto& [packetId, packet] : mHighQoSSendingPackets) {
+        orderedPackets.emplace_back(packet.getGlobalOrder(), packetId);
+    }
+    std::sort(orderedPackets.begin(), orderedPackets.end());
+    mStoredPacketsToResend.clear();
+    for(auto& [order, packetId] : orderedPackets) {
+        mStoredPacketsToResend.emplace_back(packetId);
+    }
+    releaseQueuedPackets();
+}
+// A stored packet has to carry the remaining lifetime of the message instead of the interval it was published with
+static EncodedPacket withRemainingMessageExpiry(EncodedPacket packet, MQTTVersion version, std::time_t expiresAt, std::time_t now) {
+    if(expiresAt == 0 || version != MQTTVersion::V5)
+        return packet;
+    // packets that were sent before are resent even if their lifetime is over
+    return packet.withMessageExpiryInterval(static_cast<uint32_t>(std::max<std::time_t>(expiresAt - now, 0)));
+}
+void PersistentClientState::releaseQueuedPackets() {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(!mCurrentClient)
+        return;
+    auto now = time(nullptr);
+    // stored packets are older than the queued ones, so they go first; they already have a packet id
+    while(!mStoredPacketsToResend.empty() && getSentInFlightCount() < mReceiveMaximum) {
+        auto& stored = mHighQoSSendingPackets.at(mStoredPacketsToResend.front());
+        mStoredPacketsToResend.pop_front();
+        // FIXME check mqtt version & reencode maybe
+        stored.markSent();
+        auto cpy = withRemainingMessageExpiry(stored.getPacketSharedCopy(), stored.getMQTTVersion(), stored.getExpiresAt(), now);
+        cpy.setDupFlag();
+        // On a sidenote: The dup flag is so useless. Like no MQTT implementation really makes use of it, most just hand it to the client who
+        // ignores it. Even we ignore the dup flags for packets we receive. Luckily, we can avoid the expensive buffer copies due to only having
+        // to modify the first byte
+        mCurrentClient->publishEncoded(std::move(cpy));
+    }
+    if(!mStoredPacketsToResend.empty())
+        return;
+    while(!mQueuedHighQoSPackets.empty() && !isReceiveWindowFull()) {
+        auto queued = std::move(mQueuedHighQoSPackets.front());
+        mQueuedHighQoSPackets.pop_front();
+        if(queued.expiresAt != 0 && queued.expiresAt <= now) {
+            Metrics::add(Counter::DROPPED_MSGS);
+            mCurrentClient->getTraffic().dropped();
+            if(mJournal && mCleanSession == CleanSession::No) {
+                mJournal->queuedPacketDropped(mClientID, queued.queueNumber);
+            }
+            continue;
+        }
+        auto packetId = nextPacketId();
+        queued.packet.setPacketId(packetId);
+        mHighQoSSendingPackets.emplace(packetId, HighQoSRetainStorage{queued.packet, queued.qos, queued.version, queued.expiresAt}).first->second.markSent();
+        if(mJournal && mCleanSession == CleanSession::No) {
+            mJournal->queuedPacketReleased(mClientID, queued.queueNumber, packetId);
+        }
+        mCurrentClient->publishEncoded(withRemainingMessageExpiry(std::move(queued.packet), queued.version, queued.expiresAt, now));
+    }
+}
+void PersistentClientState::dropExpiredMessages(std::time_t now) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    auto isExpired = [now](std::time_t expiresAt) {
+        return expiresAt != 0 && expiresAt <= now;
+    };
+    // packets that were sent keep their id until the handshake completes
+    size_t dropped = 0;
+    for(auto it = mHighQoSSendingPackets.begin(); it != mHighQoSSendingPackets.end();) {
+        if(it->second.wasSent() || !isExpired(it->second.getExpiresAt())) {
+            it++;
+            continue;
+        }
+        if(mJournal && mCleanSession == CleanSession::No) {
+            // restored packets are treated as sent, so the journal needs to forget this one
+            mJournal->packetAcknowledged(mClientID, it->first);
+        }
+        std::erase(mStoredPacketsToResend, it->first);
+        it = mHighQoSSendingPackets.erase(it);
+        dropped += 1;
+    }
+    dropped += std::erase_if(mQueuedHighQoSPackets, [&](const QueuedHighQoSPacket& packet) {
+        if(!isExpired(packet.expiresAt))
+            return false;
+        if(mJournal && mCleanSession == CleanSession::No) {
+            mJournal->queuedPacketDropped(mClientID, packet.queueNumber);
+        }
+        return true;
+    });
+    if(dropped > 0) {
+        Metrics::add(Counter::DROPPED_MSGS, dropped);
+        if(mCurrentClient) {
+            mCurrentClient->getTraffic().dropped(dropped);
+        }
+    }
+}
+void PersistentClientState::writeSnapshot(SessionJournal::Snapshot& snapshot, const std::unordered_map<std::string, Subscription>& subscriptions) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    if(mCleanSession == CleanSession::Yes)
+        return;
+    snapshot.sessionCreated(mClientID);
+    for(auto& [topic, sub] : subscriptions) {
+        snapshot.subscribed(mClientID, topic, sub.qos, sub.options);
+    }
+    // keep the order in which the packets were stored, so that they are resent in the same order after a restart
+    std::vector<std::pair<uint16_t, const HighQoSRetainStorage*>> orderedPackets;
+    orderedPackets.reserve(mHighQoSSendingPackets.size());
+    for(auto& [packetId, packet] : mHighQoSSendingPackets) {
+        orderedPackets.emplace_back(packetId, &packet);
+    }
+    std::sort(orderedPackets.begin(), orderedPackets.end(), [](auto& a, auto& b) {
+        return a.second->getGlobalOrder() < b.second->getGlobalOrder();
+    });
+    for(auto& [packetId, packet] : orderedPackets) {
+        snapshot.packetStored(mClientID, packetId, packet->getQoS(), packet->getMQTTVersion(), packet->getExpiresAt(), packet->getPacket());
+    }
+    for(auto& queued : mQueuedHighQoSPackets) {
+        snapshot.packetQueued(mClientID, queued.queueNumber, queued.qos, queued.version, queued.expiresAt, queued.packet);
+    }
+    if(mQoS2AwaitingPubCompCount > 0) {
+        for(size_t i = 0; i < mQos2pubrecReceived.size(); ++i) {
+            if(mQos2pubrecReceived[i])
+                snapshot.pubRecReceived(mClientID, i, true);
+        }
+    }
+    if(mQoS2receivingPacketIds.any()) {
+        for(size_t i = 0; i < mQoS2receivingPacketIds.size(); ++i) {
+            if(mQoS2receivingPacketIds[i])
+                snapshot.qos2Receiving(mClientID, i, true);
+        }
+    }
+}
+void PersistentClientState::restore(SessionJournal::RestoredSession& restored) {
+    std::unique_lock<std::recursive_mutex> lock{mMutex};
+    // HighQoSRetainStorage takes its order from a global counter, so insert the packets in the order they were originally stored
+    std::vector<std::pair<uint16_t, SessionJournal::RestoredPacket*>> orderedPackets;
+    orderedPackets.reserve(restored.inFlightPackets.size());
+    for(auto& [packetId, packet] : restored.inFlightPackets) {
+        orderedPackets.emplace_back(packetId, &packet);
+    }
+    std::sort(orderedPackets.begin(), orderedPackets.end(), [](auto& a, auto& b) {
+        return a.second->sequence < b.second->sequence;
+    });
+    for(auto& [packetId, packet] : orderedPackets) {
+        // the journal doesn't know whether a packet was sent before the restart, so they are treated as sent and don't expire
+        mHighQoSSendingPackets.emplace(packetId, HighQoSRetainStorage{std::move(packet->packet), packet->qos, packet->version, packet->expiresAt}).first->second.markSent();
+    }
+    // held back packets were never sent, so they can still expire
+    for(auto& [queueNumber, packet] : restored.queuedPackets) {
+        mQueuedHighQoSPackets.emplace_back(QueuedHighQoSPacket{std::move(packet.packet), packet.qos, packet.version, packet.expiresAt, queueNumber});
+        mQueueNumberCounter = queueNumber + 1;
+        if(packet.expiresAt != 0) {
+            mMessageExpiry.push(packet.expiresAt, mClientID);
+        }
+    }
+    for(auto packetId : restored.pubRecReceived) {
+        mQos2pubrecReceived[packetId] = true;
+        mQoS2AwaitingPubCompCount += 1;
+    }
+    for(auto packetId : restored.qos2ReceivingPacketIds) {
+        mQoS2receivingPacketIds[packetId] = true;
+    }
+}
 }
\ No newline at end of file
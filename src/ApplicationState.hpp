@@ -4,6 +4,13 @@
 #include "ClientThreadManager.hpp"
 #include "MQTTClientConnection.hpp"
 #include "MQTTPublishPacketBuilder.hpp"
+#include "ExpiryHeap.hpp"
+#include "MappedPayload.hpp"
+#include "Metrics.hpp"
+#include "GlobalConfig.hpp"
+#include "SharedSubscriptions.hpp"
+#include "SessionJournal.hpp"
+#include "WriteAheadLog.hpp"
 #include "scripting/NativeLibraryCompiler.hpp"
 #include "scripting/ScriptContainer.hpp"
 #include "SQLiteCpp/Database.h"
@@ -14,39 +21,15 @@
 #include <atomic_queue/atomic_queue.h>
 #include <bitset>
 #include <condition_variable>
+#include <deque>
 #include <list>
 #include <memory>
 #include <shared_mutex>
+#include <unordered_map>
 #include <unordered_set>
 #include <variant>
 #include <vector>
 
-namespace nioev::mqtt {
-struct Subscription {
-    Subscriber* subscriber = nullptr;
-    QoS qos = QoS::QoS0;
-    Subscription() {
-
-    }
-    Subscription(Subscriber* conn, QoS qos)
-    : subscriber(std::move(conn)), qos(qos) {
-
-    }
-    bool operator==(const Subscription& b) const {
-        return subscriber == b.subscriber;
-    }
-};
-}
-
-namespace std {
-template<>
-struct hash<nioev::mqtt::Subscription> {
-    size_t operator()(const nioev::mqtt::Subscription& sub) const {
-        return std::hash<void*>()(sub.subscriber);
-    }
-};
-}
-
 namespace nioev::mqtt {
 
 static inline bool operator==(const std::reference_wrapper<MQTTClientConnection>& a, const std::reference_wrapper<MQTTClientConnection>& b) {
@@ -66,34 +49,64 @@ enum class SubscriptionType {
 struct HighQoSRetainStorage {
 public:
     // FIXME reencode data when connecting with different MQTT version (this is really weird though)
-    HighQoSRetainStorage(EncodedPacket packet, QoS qos, MQTTVersion version)
-    : mPacket(std::move(packet)), mQoS(qos), mMQTTVersion(version) {
+    HighQoSRetainStorage(EncodedPacket packet, QoS qos, MQTTVersion version, std::time_t expiresAt = 0)
+    : mPacket(std::move(packet)), mQoS(qos), mMQTTVersion(version), mExpiresAt(expiresAt) {
         static std::atomic<uint64_t> globalOrderCounter{0};
         mGlobalOrderCount = globalOrderCounter++;
     }
     EncodedPacket getPacketSharedCopy() {
         return mPacket;
     }
+    const EncodedPacket& getPacket() const {
+        return mPacket;
+    }
+    QoS getQoS() const {
+        return mQoS;
+    }
+    MQTTVersion getMQTTVersion() const {
+        return mMQTTVersion;
+    }
     uint64_t getGlobalOrder() const {
         return mGlobalOrderCount;
     }
+    // 0 if the message doesn't expire
+    std::time_t getExpiresAt() const {
+        return mExpiresAt;
+    }
+    // Once a packet was sent, it doesn't expire anymore: the expiry only applies before the onward delivery, and the client may
+    // still hold the packet id in its QoS 2 receive set.
+    void markSent() {
+        mSent = true;
+    }
+    bool wasSent() const {
+        return mSent;
+    }
 private:
     EncodedPacket mPacket;
     uint64_t mGlobalOrderCount{0};
     QoS mQoS;
     MQTTVersion mMQTTVersion;
+    std::time_t mExpiresAt{0};
+    bool mSent{false};
 };
 
 class PersistentClientState : public Subscriber {
 public:
-    PersistentClientState(std::string clientId, CleanSession cleanSession, MQTTClientConnection* client)
-    : mClientID(std::move(clientId)), mCleanSession(cleanSession), mCurrentClient(std::move(client)) {
+    // journal may be null if sessions aren't persisted
+    PersistentClientState(std::string clientId, CleanSession cleanSession, MQTTClientConnection* client, ExpiryHeap<std::string>& messageExpiry, SessionJournal* journal)
+    : mClientID(std::move(clientId)), mCleanSession(cleanSession), mCurrentClient(std::move(client)), mMessageExpiry(messageExpiry), mJournal(journal) {
 
     }
     void publish(const std::string& topic, PayloadType payload, QoS qos, Retained retained, const PropertyList& properties, MQTTPublishPacketBuilder& packetBuilder) override;
+    void onSubscribe(const std::string& topic, const Subscription& sub) override;
+    void onUnsubscribe(const std::string& topic) override;
     virtual const char* getType() const override {
         return "mqtt client";
     }
+    size_t getInFlightCount() const override {
+        std::unique_lock<std::recursive_mutex> lock{mMutex};
+        return mHighQoSSendingPackets.size() + mQoS2AwaitingPubCompCount + mQueuedHighQoSPackets.size();
+    }
     std::pair<MQTTClientConnection*, std::unique_lock<std::recursive_mutex>> getCurrentClient() {
         std::unique_lock<std::recursive_mutex> lock{mMutex};
         return std::make_pair(mCurrentClient, std::move(lock));
@@ -118,14 +131,26 @@ public:
             mCurrentClient->setPersistentClientState(nullptr);
         }
         mCurrentClient = newConnection;
+        if(mJournal && replaceStyle == ReplaceStyle::CleanSession) {
+            // the journal only contains sessions that survive a disconnect
+            if(cleanSession == CleanSession::No) {
+                mJournal->sessionCreated(mClientID);
+            } else if(mCleanSession == CleanSession::No) {
+                mJournal->sessionDeleted(mClientID);
+            }
+        }
         mCleanSession = cleanSession;
         mCurrentClient->setPersistentClientState(this);
         mCurrentClient->setClientId(mClientID);
+        applyFlowControlLimits(mCurrentClient->getConnectPropertyList());
 
         if(replaceStyle == ReplaceStyle::CleanSession) {
             mQos2pubrecReceived.reset();
             mQoS2receivingPacketIds.reset();
             mHighQoSSendingPackets.clear();
+            mQueuedHighQoSPackets.clear();
+            mStoredPacketsToResend.clear();
+            mQoS2AwaitingPubCompCount = 0;
             mPacketIdCounter = 1;
         }
     }
@@ -133,6 +158,8 @@ public:
         std::unique_lock<std::recursive_mutex> lock{mMutex};
         mCurrentClient->setPersistentClientState(nullptr);
         mCurrentClient = nullptr;
+        // everything is resent after the next reconnect anyway
+        mStoredPacketsToResend.clear();
     }
     std::unordered_map<uint16_t, HighQoSRetainStorage>& getHighQoSSendingPackets() {
         return mHighQoSSendingPackets;
@@ -146,8 +173,38 @@ public:
     std::unique_lock<std::recursive_mutex> getLock() {
         return std::unique_lock<std::recursive_mutex>{mMutex};
     }
+    // Removes a packet we sent after it was acknowledged by a PUBACK or PUBREC. Returns false if there is no such packet.
+    bool acknowledgeSentPacket(uint16_t packetId);
+    // QoS 2 bookkeeping, keeps track of the amount of messages that still count against the receive maximum
+    void markPubRecReceived(uint16_t packetId);
+    void markPubCompReceived(uint16_t packetId);
+    // QoS 2 bookkeeping for packets we receive. Both return whether the packet id was marked before.
+    bool markQoS2Receiving(uint16_t packetId);
+    bool unmarkQoS2Receiving(uint16_t packetId);
+    // Resends all stored packets to a new connection of the session, in the order they were stored. They count towards the receive
+    // maximum of the new connection, so the packets beyond it are sent by releaseQueuedPackets once acknowledgements arrive.
+    void resendStoredPackets();
+    // Sends stored packets that wait to be resent and then queued QoS 1/2 messages until the receive maximum of the client is
+    // reached again. Call after a PUBACK/PUBCOMP.
+    void releaseQueuedPackets();
+    // Drops queued messages and stored messages that were never sent whose Message Expiry Interval has passed
+    void dropExpiredMessages(std::time_t now);
+    // Writes the whole session into a snapshot of the session journal, used for compacting it
+    void writeSnapshot(SessionJournal::Snapshot& snapshot, const std::unordered_map<std::string, Subscription>& subscriptions);
+    // Restores the in-flight packets and packet id state of a session that was read from the session journal
+    void restore(SessionJournal::RestoredSession& restored);
 
 private:
+    void applyFlowControlLimits(const PropertyList& connectProperties);
+    bool isReceiveWindowFull() const {
+        return mHighQoSSendingPackets.size() + mQoS2AwaitingPubCompCount >= mReceiveMaximum;
+    }
+    // the packets that the current client has to acknowledge
+    size_t getSentInFlightCount() const {
+        return mHighQoSSendingPackets.size() - mStoredPacketsToResend.size() + mQoS2AwaitingPubCompCount;
+    }
+    uint16_t nextPacketId();
+
     static_assert(std::is_same_v<decltype(std::chrono::steady_clock::time_point{}.time_since_epoch().count()), int64_t>);
 
     mutable std::recursive_mutex mMutex;
@@ -155,11 +212,32 @@ private:
     std::unordered_map<uint16_t, HighQoSRetainStorage> mHighQoSSendingPackets;
     std::bitset<256 * 256> mQos2pubrecReceived;
     std::bitset<256 * 256> mQoS2receivingPacketIds;
+    size_t mQoS2AwaitingPubCompCount{0};
+
+    // QoS 1/2 messages that are held back because the client's receive maximum is reached; they get a packet id when released
+    struct QueuedHighQoSPacket {
+        EncodedPacket packet;
+        QoS qos;
+        MQTTVersion version;
+        std::time_t expiresAt{0};
+        // identifies the packet in the session journal until it has a packet id
+        uint64_t queueNumber{0};
+    };
+    std::deque<QueuedHighQoSPacket> mQueuedHighQoSPackets;
+    uint64_t mQueueNumberCounter{0};
+    // ids of stored packets that weren't resent to the current client yet because of its receive maximum, oldest first
+    std::deque<uint16_t> mStoredPacketsToResend;
+    // limits from the CONNECT properties of the current client; a maximum packet size of 0 means unlimited
+    uint32_t mReceiveMaximum{UINT16_MAX};
+    uint32_t mMaximumPacketSize{0};
 
     std::string mClientID;
     CleanSession mCleanSession = CleanSession::Yes;
     uint16_t mPacketIdCounter = 1;
     MQTTClientConnection* mCurrentClient = nullptr;
+    // used to drop expired messages of offline sessions, keyed by client id
+    ExpiryHeap<std::string>& mMessageExpiry;
+    SessionJournal* mJournal{nullptr};
 };
 
 struct ChangeRequestSubscribe {
@@ -167,6 +245,7 @@ struct ChangeRequestSubscribe {
     std::string topic;
     QoS qos = QoS::QoS0;
     SubscriptionType type = SubscriptionType::NORMAL;
+    SubscriptionOptions options;
 };
 
 struct ChangeRequestUnsubscribe {
@@ -179,6 +258,8 @@ struct ChangeRequestUnsubscribeFromAll {
 
 struct ChangeRequestRetain {
     MQTTPacket packet;
+    // keeps the write-ahead log segment of a durable publish until the message is retained
+    WriteAheadLog::SegmentRef walSegment;
 };
 struct ChangeRequestLoginClient {
     MQTTClientConnection* client;
@@ -249,7 +330,7 @@ public:
     void operator()(ChangeRequestActivateScript&& req);
     void operator()(ChangeRequestDeactivateScript&& req);
 
-    void publish(std::string&& topic, PayloadType msg, QoS qos, Retain retain, const PropertyList& properties);
+    void publish(std::string&& topic, PayloadType msg, QoS qos, Retain retain, const PropertyList& properties, const Subscriber* origin = nullptr, WriteAheadLog::SegmentRef walSegment = {});
     // The one-stop solution for all your async publishing needs! Need to publish something but you are actually called by publish itself, which
     // would cause deadlocks or stack overflows? Don't worry! Just call publishAsync and be certain that another thread will handle this problem for you!
     // This will probably even increase performance in case there are many subscribers and you are really busy yourself, because this will free up processing
@@ -266,6 +347,18 @@ public:
 
     void handleNewClientConnection(TcpClientConnection&&) override;
 
+    // Called by clients when sending fails. Can be called from any thread while holding any lock, the client will be logged out
+    // by the worker thread later on.
+    void notifySendError(MQTTClientConnection& client);
+    void scheduleFlushOnSenderThread(MQTTClientConnection& client) {
+        mClientManager.scheduleFlushOnSenderThread(client);
+    }
+
+    // Goes through the admission control of the client manager, which might defer the login during connection storms.
+    void requestLogin(MQTTClientConnection& client, std::string clientId, CleanSession cleanSession) {
+        mClientManager.requestLogin(client, std::move(clientId), cleanSession);
+    }
+
     struct ScriptsInfo {
         struct ScriptInfo {
             std::string name;
@@ -279,6 +372,7 @@ public:
     void addScript(std::string name, std::function<void(const std::string& scriptName, const std::string& value)>&& onSuccess, std::function<void(const std::string& scriptName, const std::string&)>&& onError, std::string code);
 
     void syncRetainedMessagesToDb();
+    void evictExpiredMessages();
 
     void runScript(const std::string& name, const ScriptInputArgs& input, ScriptStatusOutput&& output);
 
@@ -292,22 +386,26 @@ public:
     unsigned getCurrentWorkerThreadQueueDepth() const {
         return mQueue.was_size();
     }
+    LoginAdmissionStats getLoginAdmissionStats() const {
+        return mClientManager.getLoginAdmissionStats();
+    }
+    // null if durable publishes are disabled
+    WriteAheadLog* getWriteAheadLog() {
+        return mWriteAheadLog.get();
+    }
     AnalysisResults getAnalysisResults() {
         return mStatistics->getResults();
     }
     uint64_t getRetainedMsgCount() {
-        std::shared_lock<std::shared_mutex> lock{mMutex};
-        return mRetainedMessages.size();
+        return Metrics::get(Gauge::RETAINED_MSGS);
     }
     uint64_t getRetainedMsgCummulativeSize() {
-        std::shared_lock<std::shared_mutex> lock{mMutex};
-        uint64_t sum = 0;
-        for(auto& msg: mRetainedMessages) {
-            sum += msg.second.payload.size() + msg.first.size() + 1;
-        }
-        return sum;
+        return Metrics::get(Gauge::RETAINED_BYTES);
     }
     std::unordered_map<std::string, uint64_t> getSubscriptionsCount();
+    // Traffic of all connected clients; doesn't take mMutex, so it can be called often without slowing down the worker thread.
+    // Empty if per-client-packet-counters is disabled.
+    std::vector<ClientTrafficEntry> getClientTraffic() const;
     template<typename T> void forEachClient(T&& callback) const {
         std::shared_lock<std::shared_mutex> lock{mMutex};
         for(auto& c: mPersistentClientStates) {
@@ -322,10 +420,15 @@ public:
 private:
 
     // basically the same as publish but without acquiring a read-only lock
-    void publishInternal(std::string&& topic, PayloadType msg, QoS qos, Retain retain, const PropertyList& properties);
+    void publishInternal(std::string&& topic, PayloadType msg, QoS qos, Retain retain, const PropertyList& properties, const Subscriber* origin = nullptr);
 
-    Retain publishNoLockNoRetain(const std::string& topic, PayloadType msg, QoS publishQoS, Retain retain, const PropertyList& properties);
+    Retain publishNoLockNoRetain(const std::string& topic, PayloadType msg, QoS publishQoS, Retain retain, const PropertyList& properties, const Subscriber* origin = nullptr);
     void executeChangeRequest(ChangeRequest&&);
+    // releases the references that were acquired by requestChange
+    void releaseChangeRequest(const ChangeRequest&);
+    // drops requests from the batch that cancel each other out
+    void coalesceChangeRequests(std::vector<std::optional<ChangeRequest>>& batch);
+    void logoutClientsWithSendError();
     void workerThreadFunc();
 
     void cleanup();
@@ -335,6 +438,15 @@ private:
         No
     };
     void subscribeClientInternal(ChangeRequestSubscribe&& req, ShouldPersistSubscription);
+    // Recreates the persistent sessions from the session journal, only called on startup
+    void restoreSessions();
+    void compactSessionJournal();
+    // Publishes the messages that were left in the write-ahead log, only called on startup
+    void recoverWriteAheadLog();
+    // Makes the state that was derived from the write-ahead log durable, so that old segments of it can be removed
+    void checkpointWriteAheadLog();
+    // Writes the retained messages that changed since the last sync to the db; only holds mMutex while copying them
+    void syncDirtyRetainedMessagesToDb();
 
     void logoutClient(MQTTClientConnection& client);
 
@@ -352,24 +464,55 @@ private:
     NativeLibraryCompiler mNativeLibManager;
 
     SubscriptionTree<Subscription> mSubscriptions;
+    // the topic filters every subscriber is subscribed to, used for Retain Handling, for replacing the options of repeated subscriptions
+    // and for writing snapshots of the session journal
+    std::unordered_map<const Subscriber*, std::unordered_map<std::string, Subscription>> mSubscribedTopics;
+    SharedSubscriptions mSharedSubscriptions{makeLoadBalancingStrategy(getGlobalConfig().sharedSubscriptionStrategy)};
 
     std::list<ChangeRequest> mQueueInternal;
+    static constexpr size_t CHANGE_REQUEST_BATCH_SIZE = 256;
     atomic_queue::AtomicQueue2<ChangeRequest, 4096> mQueue;
     std::atomic<bool> mShouldCleanup = false;
 
     AsyncPublisher mAsyncPublisher;
 
     std::list<MQTTClientConnection> mClients;
+    // the clients that getClientTraffic reports, only maintained if per-client-packet-counters is enabled
+    mutable std::mutex mClientTrafficMutex;
+    std::unordered_set<const MQTTClientConnection*> mClientTrafficRegistry;
+    // head of an intrusive list, linked via MQTTClientConnection::getNextClientWithSendError
+    std::atomic<MQTTClientConnection*> mClientsWithSendError{nullptr};
+    // null if sessions aren't persisted
+    std::unique_ptr<SessionJournal> mSessionJournal;
+    // null if durable publishes are disabled
+    std::unique_ptr<WriteAheadLog> mWriteAheadLog;
+    // retained messages that changed since the last sync to the db, only tracked in durable mode
+    std::unordered_set<std::string> mDirtyRetainedTopics;
     std::unordered_map<std::string, std::unique_ptr<PersistentClientState>> mPersistentClientStates;
     std::vector<std::unique_ptr<PersistentClientState>> mDeletedPersistentClientStates;
 
     struct RetainedMessage {
-        std::vector<uint8_t> payload;
+        std::vector<uint8_t> payload; // empty if the payload is mapped
         std::time_t timestamp;
         QoS qos{QoS::QoS0};
         PropertyList properties;
+        std::shared_ptr<const MappedPayload> mappedPayload;
+        std::time_t expiresAt{0}; // 0 if it doesn't expire
+
+        PayloadType getPayload() const {
+            return mappedPayload ? mappedPayload->getPayload() : vecToPayload(payload);
+        }
     };
+    static RetainedMessage makeRetainedMessage(std::vector<uint8_t>&& payload, std::time_t timestamp, QoS qos, PropertyList properties, std::time_t expiresAt);
+    static void insertRetainedMessageIntoDb(SQLite::Statement& query, const std::string& topic, const RetainedMessage& msg);
+    // keep the retained gauges of Metrics up to date
+    void retainedMessageAdded(const std::string& topic, const RetainedMessage& msg);
+    void retainedMessageRemoved(const std::string& topic, const RetainedMessage& msg);
     std::unordered_map<std::string, RetainedMessage> mRetainedMessages;
+    // keyed by topic
+    ExpiryHeap<std::string> mRetainedMessageExpiry;
+    // keyed by client id
+    ExpiryHeap<std::string> mSessionMessageExpiry;
 
     std::atomic<bool> mShouldRun = true;
     std::atomic<WorkerThreadSleepLevel> mWorkerThreadSleepLevel;
@@ -384,6 +527,11 @@ private:
     SQLite::Database mDb{"nioev.db3", SQLite::OPEN_READWRITE|SQLite::OPEN_CREATE};
     std::optional<SQLite::Statement> mQueryInsertScript;
     std::optional<SQLite::Statement> mQueryInsertRetainedMsg;
+    // only used by the write-ahead log checkpoints, which write retained messages without holding mMutex
+    std::optional<SQLite::Database> mCheckpointDb;
+    std::optional<SQLite::Statement> mCheckpointInsertRetainedMsg;
+    // serializes writing retained messages to the db, so that an older copy can't overwrite a newer one; taken before mMutex
+    std::mutex mRetainedDbMutex;
 
     // needs to initialized last because it starts a thread which calls us
     ClientThreadManager mClientManager;
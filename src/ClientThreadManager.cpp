@@ -7,6 +7,11 @@
 
 #include "nioev/lib/Enums.hpp"
 #include "ApplicationState.hpp"
+#include "GlobalConfig.hpp"
+#include "WriteBatch.hpp"
+#include "Metrics.hpp"
+#include "PropertyUtil.hpp"
+#include "StageTimings.hpp"
 
 namespace nioev::mqtt {
 
@@ -17,7 +22,7 @@ void protocolViolation(const std::string& reason) {
 using namespace nioev::lib;
 
 ClientThreadManager::ClientThreadManager(ApplicationState& app)
-: mApp(app) {
+: mApp(app), mConnectRateLimiter(getGlobalConfig().connectRateLimitPerSecond, getGlobalConfig().connectBurst) {
     mEpollFd = epoll_create1(EPOLL_CLOEXEC);
     if(mEpollFd < 0) {
         spdlog::critical("Failed to create epoll fd: " + errnoToString());
@@ -35,6 +40,9 @@ ClientThreadManager::ClientThreadManager(ApplicationState& app)
             receiverThreadFunction(i);
         });
     }
+    for(size_t i = 0; i < getGlobalConfig().senderThreads; ++i) {
+        mSenderThreads.emplace_back(std::make_unique<SenderThread>(i));
+    }
 }
 void ClientThreadManager::receiverThreadFunction(size_t threadId) {
     sigset_t blockedSignalsDuringEpoll = { 0 };
@@ -46,7 +54,9 @@ void ClientThreadManager::receiverThreadFunction(size_t threadId) {
     std::shared_lock<std::shared_mutex> suspendLock{mSuspendMutex};
     while(!mShouldQuit) {
         epoll_event events[128] = { 0 };
-        int eventCount = epoll_pwait(mEpollFd, events, 128, -1, &blockedSignalsDuringEpoll);
+        // thread 0 is responsible for admitting deferred logins, so it needs to wake up regularly while there are some
+        int timeout = (threadId == 0 && !mDeferredLoginsEmpty) ? 10 : -1;
+        int eventCount = epoll_pwait(mEpollFd, events, 128, timeout, &blockedSignalsDuringEpoll);
         if(eventCount < 0) {
             if(errno == EINTR) {
                 if(mShouldQuit)
@@ -64,24 +74,46 @@ void ClientThreadManager::receiverThreadFunction(size_t threadId) {
             }
             // if an interrupt happens and we don't need to suspend, then we just continue onwards
         }
+        // everything we send while handling these events (e.g. PUBACKs) is flushed at the end of this iteration if write batching is enabled
+        WriteBatchScope writeBatch;
         if(threadId == 0) {
             if(!mRecentlyLoggedInClientsEmpty) {
-                std::unique_lock<std::mutex> lock{mRecentlyLoggedInClientsMutex};
-                while(!mRecentlyLoggedInClients.empty()) {
-                    for(auto client: mRecentlyLoggedInClients) {
-                        auto lock = client->getRecvMutexLock();
+                // Swap the list out so that we don't hold the mutex while handling packets. Handling packets can enqueue change requests,
+                // which can block until the app state thread has made some progress, which in turn might be waiting for this mutex to add
+                // another recently logged in client.
+                std::vector<MQTTClientConnection*> recentlyLoggedInClients;
+                {
+                    std::unique_lock<std::mutex> lock{mRecentlyLoggedInClientsMutex};
+                    recentlyLoggedInClients.swap(mRecentlyLoggedInClients);
+                    mRecentlyLoggedInClientsEmpty = true;
+                }
+                for(auto client: recentlyLoggedInClients) {
+                    auto lock = client->getRecvMutexLock();
+                    try {
                         handlePacketsReceivedWhileConnecting(lock, *client);
+                    } catch(CleanDisconnectException&) {
+                        mApp.requestChange(ChangeRequestLogoutClient{client});
+                    } catch(std::exception& e) {
+                        spdlog::error("Caught: {}", e.what());
+                        mApp.requestChange(ChangeRequestLogoutClient{client});
                     }
-                    mRecentlyLoggedInClients.clear();
+                    // reading was paused while the client was logging in
+                    setReceivingEnabled(*client, true);
                 }
             }
+            if(!mDeferredLoginsEmpty) {
+                processDeferredLogins();
+            }
         }
         for(int i = 0; i < eventCount; ++i) {
             auto& client = * (MQTTClientConnection*)events[i].data.ptr;
             try {
                 if(events[i].events & EPOLLERR) {
-                    client.getTcpClient().recv(bytes); // try to trigger proper error message
-                    throw std::runtime_error{"Socket error!"};
+                    // MSG_ZEROCOPY completions are reported through the error queue as well
+                    if(!client.getTcpClient().processErrorQueue()) {
+                        client.getTcpClient().recv(bytes); // try to trigger proper error message
+                        throw std::runtime_error{"Socket error!"};
+                    }
                 }
                 if(events[i].events & EPOLLOUT) {
                     // we can write some data!
@@ -89,16 +121,9 @@ void ClientThreadManager::receiverThreadFunction(size_t threadId) {
                     auto [sendTasksRef, sendTasksRefLock] = client.getSendTasks();
                     auto& sendTasks = sendTasksRef.get();
                     if(!sendTasks.empty()) {
-                        client.getTcpClient().sendScatter(sendTasks.data(), sendTasks.size());
-                        size_t donePackets = 0;
-                        for(InTransitEncodedPacket& packet: sendTasks) {
-                            if(packet.isDone()) {
-                                donePackets += 1;
-                            } else {
-                                break;
-                            }
-                        }
-                        sendTasks.erase(sendTasks.begin(), sendTasks.begin() + donePackets);
+                        auto sent = client.getTcpClient().sendScatter(sendTasks);
+                        sendTasks.popDone();
+                        client.getTraffic().sent(sent, sendTasks.size());
                         if(sendTasks.empty() && client.getStateAtomic() == MQTTClientConnection::ConnectionState::INVALID_PROTOCOL_VERSION) {
                             assert(sendTasks.empty());
                             throw CleanDisconnectException{};
@@ -117,10 +142,15 @@ void ClientThreadManager::receiverThreadFunction(size_t threadId) {
 
                     auto& recvData = client.getRecvData(recvDataRefLock);
                     do {
+                        auto recvStart = StageTimings::now();
                         bytesReceived = client.getTcpClient().recv(bytes);
                         spdlog::debug("Bytes read: {}", bytesReceived);
                         if(bytesReceived > 0) {
-                            client.setLastDataRecvTimestamp(std::chrono::steady_clock::now().time_since_epoch().count());
+                            // the last call of every loop only reports EAGAIN, so it isn't part of the latency of any packet
+                            StageTimings::recordSince(PublishStage::RECV, recvStart);
+                            auto timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
+                            client.setLastDataRecvTimestamp(timestamp);
+                            client.getTraffic().received(bytesReceived, timestamp);
                         }
                         for(uint i = 0; i < bytesReceived;) {
                             switch(recvData.recvState) {
@@ -177,7 +207,8 @@ void ClientThreadManager::receiverThreadFunction(size_t threadId) {
                             }
                             }
                         }
-                    } while(bytesReceived > 0);
+                        // receiving is paused while the client is logging in, see requestLogin
+                    } while(bytesReceived > 0 && client.getState(recvDataRefLock) != MQTTClientConnection::ConnectionState::CONNECTING);
                 }
             } catch(CleanDisconnectException&) {
                 mApp.requestChange(ChangeRequestLogoutClient{&client});
@@ -198,21 +229,96 @@ void ClientThreadManager::addClientConnection(MQTTClientConnection& conn) {
         exit(6);
     }
 }
+void ClientThreadManager::setReceivingEnabled(MQTTClientConnection& conn, bool enabled) {
+    // EPOLLEXCLUSIVE can't be used together with EPOLL_CTL_MOD, so we need to re-add the fd. Adding an fd reports its current
+    // readiness, so we don't miss any data that arrived while receiving was disabled.
+    std::unique_lock<std::mutex> lock{mEpollRegistrationMutex};
+    // the client is marked as logged out before its fd is removed, so we can't add an fd again that was removed or closed already
+    if(conn.isLoggedOut())
+        return;
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, conn.getTcpClient().getFd(), nullptr);
+    epoll_event ev = { 0 };
+    ev.data.ptr = &conn;
+    ev.events = EPOLLET | EPOLLOUT | EPOLLEXCLUSIVE | (enabled ? EPOLLIN : 0);
+    if(epoll_ctl(mEpollFd, EPOLL_CTL_ADD, conn.getTcpClient().getFd(), &ev) < 0) {
+        // we wouldn't get any events for this client anymore
+        spdlog::error("[{}] Failed to re-add fd to epoll: {}", conn.getClientId(), lib::errnoToString());
+        lock.unlock();
+        mApp.requestChange(ChangeRequestLogoutClient{&conn});
+    }
+}
 void ClientThreadManager::removeClientConnection(MQTTClientConnection& conn) {
-    if(epoll_ctl(mEpollFd, EPOLL_CTL_DEL, conn.getTcpClient().getFd(), nullptr) < 0) {
-        spdlog::debug("Failed to remove fd from epoll: {}", lib::errnoToString());
+    {
+        std::unique_lock<std::mutex> lock{mEpollRegistrationMutex};
+        if(epoll_ctl(mEpollFd, EPOLL_CTL_DEL, conn.getTcpClient().getFd(), nullptr) < 0) {
+            spdlog::debug("Failed to remove fd from epoll: {}", lib::errnoToString());
+        }
     }
-    std::unique_lock<std::mutex> lock{mRecentlyLoggedInClientsMutex};
-    std::erase_if(mRecentlyLoggedInClients, [&](auto& rliClient) {
-        return rliClient == &conn;
+    {
+        std::unique_lock<std::mutex> lock{mRecentlyLoggedInClientsMutex};
+        std::erase_if(mRecentlyLoggedInClients, [&](auto& rliClient) {
+            return rliClient == &conn;
+        });
+    }
+    std::unique_lock<std::mutex> lock{mDeferredLoginsMutex};
+    std::erase_if(mDeferredLogins, [&](auto& deferred) {
+        return deferred.client == &conn;
     });
+    mDeferredLoginsEmpty = mDeferredLogins.empty();
 }
 void ClientThreadManager::addRecentlyLoggedInClient(MQTTClientConnection* client) {
     std::unique_lock<std::mutex> lock{mRecentlyLoggedInClientsMutex};
     mRecentlyLoggedInClients.emplace_back(client);
+    mRecentlyLoggedInClientsEmpty = false;
     lock.unlock();
     pthread_kill(mReceiverThreads.at(0).native_handle(), SIGUSR1);
 }
+void ClientThreadManager::requestLogin(MQTTClientConnection& client, std::string clientId, CleanSession cleanSession) {
+    // Pause reading until the login has been processed. Packets that are still in our receive buffer are stored in the client and
+    // handled after the login. The receive loop stops reading once the client is connecting, so everything else stays in the kernel
+    // buffer, which in turn applies backpressure to the client.
+    setReceivingEnabled(client, false);
+    std::unique_lock<std::mutex> lock{mDeferredLoginsMutex};
+    if(mDeferredLogins.empty() && mPendingLogins < getGlobalConfig().maximumPendingLogins && mConnectRateLimiter.tryAcquire()) {
+        lock.unlock();
+        enqueueLogin(client, std::move(clientId), cleanSession);
+        return;
+    }
+    mDeferredLogins.emplace_back(DeferredLogin{&client, std::move(clientId), cleanSession});
+    mDeferredLoginsEmpty = false;
+    mDeferredLoginsTotal += 1;
+    spdlog::debug("[{}] Deferring login, {} logins are deferred", client.getTcpClient().getRemoteIp(), mDeferredLogins.size());
+}
+void ClientThreadManager::enqueueLogin(MQTTClientConnection& client, std::string&& clientId, CleanSession cleanSession) {
+    mPendingLogins += 1;
+    mApp.requestChange(ChangeRequestLoginClient{&client, std::move(clientId), cleanSession});
+}
+void ClientThreadManager::notifyLoginProcessed(MQTTClientConnection& client) {
+    mPendingLogins -= 1;
+    if(!client.isLoggedOut()) {
+        addRecentlyLoggedInClient(&client);
+    }
+}
+void ClientThreadManager::processDeferredLogins() {
+    std::unique_lock<std::mutex> lock{mDeferredLoginsMutex};
+    while(!mDeferredLogins.empty() && mPendingLogins < getGlobalConfig().maximumPendingLogins && mConnectRateLimiter.tryAcquire()) {
+        auto login = std::move(mDeferredLogins.front());
+        mDeferredLogins.pop_front();
+        mDeferredLoginsEmpty = mDeferredLogins.empty();
+        // requestChange might block if the queue is full, so don't hold the mutex while calling it
+        lock.unlock();
+        enqueueLogin(*login.client, std::move(login.clientId), login.cleanSession);
+        lock.lock();
+    }
+}
+void ClientThreadManager::scheduleFlushOnSenderThread(MQTTClientConnection& client) {
+    assert(!mSenderThreads.empty());
+    mSenderThreads[client.getTcpClient().getFd() % mSenderThreads.size()]->scheduleFlush(client);
+}
+LoginAdmissionStats ClientThreadManager::getLoginAdmissionStats() const {
+    std::unique_lock<std::mutex> lock{mDeferredLoginsMutex};
+    return LoginAdmissionStats{mPendingLogins, mDeferredLogins.size(), mDeferredLoginsTotal};
+}
 void handlePacketReceived(ApplicationState& app, MQTTClientConnection::ConnectionState state, MQTTClientConnection& client, const MQTTClientConnection::PacketReceiveData& recvData, std::unique_lock<std::mutex>& clientReceiveLock) {
     spdlog::debug("Received packet of type {}", recvData.messageType);
 
@@ -254,7 +360,7 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
             }
             bool cleanSession = connectFlags & 0x2;
             if(version == MQTTVersion::V5) {
-                client.setConnectProperties(decoder.decodeProperties());
+                client.setConnectProperties(clientReceiveLock, decoder.decodeProperties());
             }
 
             auto clientId = decoder.decodeString();
@@ -284,7 +390,7 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
                 auto password = decoder.decodeString();
             }
             client.setStateAtomic(MQTTClientConnection::ConnectionState::CONNECTING);
-            app.requestChange(ChangeRequestLoginClient{&client, std::move(clientId), cleanSession ? CleanSession::Yes : CleanSession::No});
+            app.requestLogin(client, std::move(clientId), cleanSession ? CleanSession::Yes : CleanSession::No);
 
             break;
         }
@@ -301,6 +407,7 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
     case MQTTClientConnection::ConnectionState::CONNECTED: {
         switch(recvData.messageType) {
         case MQTTMessageType::PUBLISH: {
+            auto parseStart = StageTimings::now();
             bool dup = recvData.firstByte & 0x8; // TODO handle
             uint8_t qosInt = (recvData.firstByte >> 1) & 0x3;
             if(qosInt >= 3) {
@@ -309,49 +416,83 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
             QoS qos = static_cast<QoS>(qosInt);
             auto retain = static_cast<Retain>(!!(recvData.firstByte & 0x1));
             auto topic = decoder.decodeString(); // TODO check for allowed chars
-            if(topic.empty()) {
+            if(topic.empty() && client.getMQTTVersion() != MQTTVersion::V5) {
                 protocolViolation("Invalid topic");
             }
+            uint16_t id = 0;
+            if(qos == QoS::QoS1 || qos == QoS::QoS2) {
+                id = decoder.decode2Bytes();
+            }
+            PropertyList properties;
+            if(client.getMQTTVersion() == MQTTVersion::V5) {
+                properties = decoder.decodeProperties();
+                // topic aliases are only valid for this connection, so they are resolved here and not passed on
+                if(auto alias = getIntegerProperty(properties, MQTTProperty::TOPIC_ALIAS)) {
+                    auto& aliases = client.getInboundTopicAliases(clientReceiveLock);
+                    if(*alias == 0 || *alias > aliases.size()) {
+                        protocolViolation("Invalid topic alias");
+                    }
+                    if(topic.empty()) {
+                        topic = aliases[*alias - 1];
+                    } else {
+                        aliases[*alias - 1] = topic;
+                    }
+                    properties.erase(MQTTProperty::TOPIC_ALIAS);
+                }
+                if(topic.empty()) {
+                    protocolViolation("Invalid topic");
+                }
+            }
             bool doDeliverOnward = true;
+            std::optional<EncodedPacket> ack;
             if(qos == QoS::QoS1 || qos == QoS::QoS2) {
-                auto id = decoder.decode2Bytes();
                 if(qos == QoS::QoS1) {
-                    // send PUBACK
+                    // prepare PUBACK
                     BinaryEncoder encoder;
                     encoder.encode2Bytes(id);
 
                     if(client.getMQTTVersion() == MQTTVersion::V5) {
-                        PropertyList properties;
+                        PropertyList ackProperties;
                         encoder.encodeByte(0); // Reason code success
-                        encoder.encodePropertyList(properties);
+                        encoder.encodePropertyList(ackProperties);
                     }
-                    client.sendData(EncodedPacket::fromData(static_cast<uint8_t>(MQTTMessageType::PUBACK) << 4, encoder.moveData()));
+                    ack = EncodedPacket::fromData(static_cast<uint8_t>(MQTTMessageType::PUBACK) << 4, encoder.moveData());
                 } else {
                     auto state = client.getPersistentClientState();
                     if(!state)
                         throw std::runtime_error{"Persistent state lost!"};
-                    auto lock = state->getLock();
-                    auto& recvPacketIds = state->getQoS2ReceivingPacketIds();
-                    doDeliverOnward = !recvPacketIds[id];
-                    recvPacketIds[id] = true;
-                    lock.unlock();
-                    // send PUBREC
+                    // marked only after the whole publish was validated, a rejected one mustn't count as received after reconnecting
+                    doDeliverOnward = !state->markQoS2Receiving(id);
+                    // prepare PUBREC
                     BinaryEncoder encoder;
                     encoder.encode2Bytes(id);
                     if(client.getMQTTVersion() == MQTTVersion::V5) {
-                        PropertyList properties;
+                        PropertyList ackProperties;
                         encoder.encodeByte(0); // Reason code success
-                        encoder.encodePropertyList(properties);
+                        encoder.encodePropertyList(ackProperties);
                     }
-                    client.sendData(EncodedPacket::fromData(static_cast<uint8_t>(MQTTMessageType::PUBREC) << 4, encoder.moveData()));
+                    ack = EncodedPacket::fromData(static_cast<uint8_t>(MQTTMessageType::PUBREC) << 4, encoder.moveData());
                 }
             }
-            if(doDeliverOnward) {
-                PropertyList properties;
-                if(client.getMQTTVersion() == MQTTVersion::V5) {
-                    properties = decoder.decodeProperties();
+            auto payload = decoder.getRemainingBytes();
+            StageTimings::recordSince(PublishStage::PARSE, parseStart);
+            Metrics::add(Counter::MSGS_IN);
+            client.getTraffic().receivedPublish();
+            WriteAheadLog::SegmentRef walSegment;
+            if(ack) {
+                auto wal = app.getWriteAheadLog();
+                if(!wal) {
+                    client.sendData(std::move(*ack));
+                } else if(doDeliverOnward) {
+                    // durable mode: the acknowledgement is sent once the message is on disk
+                    walSegment = wal->append(topic, payload, qos, retain, properties, client, id, std::move(*ack));
+                } else {
+                    // a duplicate that is already on disk, but acknowledgements have to stay in order
+                    wal->acknowledgeAfterCommit(client, std::move(*ack));
                 }
-                app.publish(std::move(topic), decoder.getRemainingBytes(), qos, retain, properties);
+            }
+            if(doDeliverOnward) {
+                app.publish(std::move(topic), payload, qos, retain, properties, client.getPersistentClientState(), std::move(walSegment));
             }
             break;
         }
@@ -365,9 +506,9 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
             auto state = client.getPersistentClientState();
             if(!state)
                 throw std::runtime_error{"Persistent state lost!"};
-            auto lock = state->getLock();
-            auto& sendingPackets = state->getHighQoSSendingPackets();
-            sendingPackets.erase(id);
+            state->acknowledgeSentPacket(id);
+            // this frees up space in the receive window
+            state->releaseQueuedPackets();
             break;
         }
         case MQTTMessageType::PUBREL: {
@@ -386,14 +527,9 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
                 auto state = client.getPersistentClientState();
                 if(!state)
                     throw std::runtime_error{"Persistent state lost!"};
-                auto stateLock = state->getLock();
-                auto &receivingPacketIds = state->getQoS2ReceivingPacketIds();
-                if(!receivingPacketIds[id]) {
-                    stateLock.unlock();
+                if(!state->unmarkQoS2Receiving(id)) {
                     packetIdentifierFound = false;
                     spdlog::warn("[{}] PUBREL no such message id", client.getClientId());
-                } else {
-                    receivingPacketIds[id] = false;
                 }
             }
 
@@ -424,13 +560,13 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
                 if(!state)
                     throw std::runtime_error{"Persistent state lost!"};
                 auto stateLock = state->getLock();
-                auto &sendingPackets = state->getHighQoSSendingPackets();
-                if(sendingPackets.erase(id) != 1) {
-                    stateLock.unlock();
+                if(state->acknowledgeSentPacket(id)) {
+                    state->markPubRecReceived(id);
+                } else if(!state->getQoS2PubRecReceived()[id]) {
+                    // not a repeated PUBREC either, so don't let the client take up packet ids and receive window slots
                     packetIdentifierFound = false;
                     spdlog::warn("[{}] PUBREC no such message id", client.getClientId());
                 }
-                state->getQoS2PubRecReceived()[id] = true;
             }
 
             // send PUBREL
@@ -458,7 +594,9 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
             if(!state)
                 throw std::runtime_error{"Persistent state lost!"};
 
-            state->getQoS2PubRecReceived()[id] = false;
+            state->markPubCompReceived(id);
+            // this frees up space in the receive window
+            state->releaseQueuedPackets();
             break;
         }
         case MQTTMessageType::SUBSCRIBE: {
@@ -479,22 +617,57 @@ void handlePacketReceived(ApplicationState& app, MQTTClientConnection::Connectio
                 encoder.encodePropertyList(properties);
             }
 
+            SubscriptionOptions options;
+            if(auto identifier = getIntegerProperty(properties, MQTTProperty::SUBSCRIPTION_IDENTIFIER)) {
+                if(*identifier == 0) {
+                    protocolViolation("SUBSCRIBE subscription identifier is 0");
+                }
+                options.subscriptionIdentifier = *identifier;
+            }
+
             do {
                 auto topic = decoder.decodeString();
                 if(topic.empty()) {
                     protocolViolation("SUBSCRIBE topic is empty");
                 }
                 spdlog::info("[{}] Subscribing to {}", client.getClientId(), topic);
-                uint8_t qosInt = decoder.decodeByte();
+                uint8_t optionsByte = decoder.decodeByte();
+                uint8_t qosInt = optionsByte & 0x03;
+                if(client.getMQTTVersion() == MQTTVersion::V5) {
+                    options.noLocal = optionsByte & 0x04;
+                    options.retainAsPublished = optionsByte & 0x08;
+                    options.retainHandling = (optionsByte >> 4) & 0x03;
+                    if((optionsByte & 0xC0) != 0 || options.retainHandling == 3) {
+                        protocolViolation("SUBSCRIBE invalid subscription options");
+                    }
+                } else {
+                    if(optionsByte != qosInt) {
+                        protocolViolation("SUBSCRIBE invalid qos");
+                    }
+                    // MQTT 3.1.1 has no Retain Handling, but we can opt out of resending retained messages for existing subscriptions
+                    options.retainHandling = getGlobalConfig().resendRetainedOnResubscribe ? 0 : 1;
+                }
                 if(qosInt >= 3) {
                     protocolViolation("SUBSCRIPE invalid qos");
                 }
                 auto qos = static_cast<QoS>(qosInt);
+                bool isShared = false;
+                try {
+                    isShared = SharedSubscriptions::parse(topic).has_value();
+                } catch(std::exception& e) {
+                    spdlog::warn("[{}] Invalid shared subscription {}: {}", client.getClientId(), topic, e.what());
+                    // 0x8F is "Topic Filter invalid", 0x80 the generic failure of MQTT 3.1.1
+                    encoder.encodeByte(client.getMQTTVersion() == MQTTVersion::V5 ? 0x8F : 0x80);
+                    continue;
+                }
+                if(isShared && options.noLocal) {
+                    protocolViolation("SUBSCRIBE No Local set on a shared subscription");
+                }
                 encoder.encodeByte(qosInt);
                 auto state = client.getPersistentClientState();
                 if(!state)
                     throw std::runtime_error{"Persistent state lost!"};
-                app.requestChange(ChangeRequestSubscribe{state, std::move(topic), qos});
+                app.requestChange(ChangeRequestSubscribe{state, std::move(topic), qos, SubscriptionType::NORMAL, options});
             } while(!decoder.empty());
 
             client.sendData(EncodedPacket::fromData(static_cast<uint8_t>(MQTTMessageType::SUBACK) << 4, encoder.moveData()));
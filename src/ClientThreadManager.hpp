@@ -5,12 +5,21 @@
 #include <thread>
 #include <vector>
 #include "Forward.hpp"
+#include "SenderThread.hpp"
+#include "TokenBucket.hpp"
+#include <deque>
 #include <shared_mutex>
 
 namespace nioev::mqtt {
 
 using namespace nioev::lib;
 
+struct LoginAdmissionStats {
+    uint64_t pendingLogins{0};
+    uint64_t deferredLogins{0};
+    uint64_t deferredLoginsTotal{0};
+};
+
 class ClientThreadManager {
 public:
     explicit ClientThreadManager(ApplicationState& bridge);
@@ -20,15 +29,31 @@ public:
 
     void addRecentlyLoggedInClient(MQTTClientConnection* client);
 
+    // Enqueues the login of a client that sent a CONNECT packet. If too many logins are already pending or the CONNECT rate
+    // limit has been reached, the login is deferred until there is room again. Reading from the socket is paused until
+    // the login has been processed (see notifyLoginProcessed).
+    void requestLogin(MQTTClientConnection& client, std::string clientId, CleanSession cleanSession);
+    // Called by the application state once a login that was enqueued by requestLogin has been executed.
+    void notifyLoginProcessed(MQTTClientConnection& client);
+    LoginAdmissionStats getLoginAdmissionStats() const;
+
+    // Only available if sender threads are enabled in the config
+    void scheduleFlushOnSenderThread(MQTTClientConnection& client);
+
     void suspendAllThreads();
     void resumeAllThreads();
 private:
     void receiverThreadFunction(size_t threadId);
     void handlePacketsReceivedWhileConnecting(std::unique_lock<std::mutex>& recvDataLock, MQTTClientConnection& client);
+    void setReceivingEnabled(MQTTClientConnection& conn, bool enabled);
+    void enqueueLogin(MQTTClientConnection& client, std::string&& clientId, CleanSession cleanSession);
+    void processDeferredLogins();
 private:
     std::vector<std::thread> mReceiverThreads;
     std::atomic<bool> mShouldQuit = false;
     int mEpollFd = -1;
+    // serializes re-adding fds in setReceivingEnabled with removing them, so that a logged out client isn't added again
+    std::mutex mEpollRegistrationMutex;
     ApplicationState& mApp;
     std::shared_mutex mSuspendMutex;
     std::shared_mutex mSuspendMutex2;
@@ -37,6 +62,20 @@ private:
     std::mutex mRecentlyLoggedInClientsMutex;
     std::vector<MQTTClientConnection*> mRecentlyLoggedInClients;
     std::atomic<bool> mRecentlyLoggedInClientsEmpty{true};
+
+    struct DeferredLogin {
+        MQTTClientConnection* client;
+        std::string clientId;
+        CleanSession cleanSession;
+    };
+    TokenBucket mConnectRateLimiter;
+    std::atomic<uint32_t> mPendingLogins{0};
+    mutable std::mutex mDeferredLoginsMutex;
+    std::deque<DeferredLogin> mDeferredLogins;
+    std::atomic<bool> mDeferredLoginsEmpty{true};
+    std::atomic<uint64_t> mDeferredLoginsTotal{0};
+
+    std::vector<std::unique_ptr<SenderThread>> mSenderThreads;
 };
 
 void handlePacketReceived(ApplicationState& app, MQTTClientConnection::ConnectionState state, MQTTClientConnection& client, const MQTTClientConnection::PacketReceiveData& recvData, std::unique_lock<std::mutex>& clientReceiveLock);
@@ -0,0 +1,61 @@
+#include "ClientTraffic.hpp"
+
+namespace nioev::mqtt {
+
+std::optional<ClientTrafficSortKey> clientTrafficSortKeyFromString(std::string_view str) {
+    if(str == "msgs_in")
+        return ClientTrafficSortKey::MSGS_IN;
+    if(str == "msgs_out")
+        return ClientTrafficSortKey::MSGS_OUT;
+    if(str == "bytes_in")
+        return ClientTrafficSortKey::BYTES_IN;
+    if(str == "bytes_out")
+        return ClientTrafficSortKey::BYTES_OUT;
+    if(str == "drops")
+        return ClientTrafficSortKey::DROPS;
+    if(str == "queue_depth")
+        return ClientTrafficSortKey::QUEUE_DEPTH;
+    if(str == "last_activity")
+        return ClientTrafficSortKey::LAST_ACTIVITY;
+    return {};
+}
+
+void sortClientTrafficPage(std::vector<ClientTrafficEntry>& entries, ClientTrafficSortKey sortBy, size_t offset, size_t limit) {
+    auto getKey = [sortBy](const ClientTrafficEntry& entry) -> int64_t {
+        auto& traffic = entry.traffic;
+        switch(sortBy) {
+        case ClientTrafficSortKey::MSGS_IN:
+            return traffic.msgsIn;
+        case ClientTrafficSortKey::MSGS_OUT:
+            return traffic.msgsOut;
+        case ClientTrafficSortKey::BYTES_IN:
+            return traffic.bytesIn;
+        case ClientTrafficSortKey::BYTES_OUT:
+            return traffic.bytesOut;
+        case ClientTrafficSortKey::DROPS:
+            return traffic.drops;
+        case ClientTrafficSortKey::QUEUE_DEPTH:
+            return traffic.queueDepth;
+        case ClientTrafficSortKey::LAST_ACTIVITY:
+            return traffic.lastActivity;
+        }
+        return 0;
+    };
+    auto compare = [&](const ClientTrafficEntry& a, const ClientTrafficEntry& b) {
+        auto keyA = getKey(a), keyB = getKey(b);
+        if(keyA != keyB)
+            return keyA > keyB;
+        // keeps the pages stable between requests if many clients have the same value, e.g. 0
+        return a.clientId < b.clientId;
+    };
+    if(offset >= entries.size()) {
+        entries.clear();
+        return;
+    }
+    auto end = std::min(entries.size(), offset + limit);
+    std::partial_sort(entries.begin(), entries.begin() + end, entries.end(), compare);
+    entries.erase(entries.begin() + end, entries.end());
+    entries.erase(entries.begin(), entries.begin() + offset);
+}
+
+}
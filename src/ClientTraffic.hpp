@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "GlobalConfig.hpp"
+
+namespace nioev::mqtt {
+
+/* Traffic counters of a single client, only maintained if per-client-packet-counters is enabled. The counters are split into groups
+ * that are each written by one thread at a time (see the comments of the methods), so the writers only use relaxed loads and stores
+ * instead of read-modify-write operations. Every group has its own cache line, so the receiver and the senders of a client don't
+ * contend for it. Any thread can take a snapshot without locking.
+ */
+class ClientTraffic final {
+public:
+    struct Snapshot {
+        uint64_t msgsIn{0};
+        uint64_t bytesIn{0};
+        uint64_t msgsOut{0};
+        uint64_t bytesOut{0};
+        uint64_t drops{0};
+        uint64_t queueDepth{0};
+        // steady clock nanoseconds of the last sent or received data, 0 if there was none yet
+        int64_t lastActivity{0};
+    };
+
+    static bool isEnabled() {
+        return getGlobalConfig().perClientPacketCounters;
+    }
+
+    // called by the receiver thread while holding the recv mutex
+    void received(uint64_t bytes, int64_t timestamp) {
+        if(!isEnabled())
+            return;
+        increment(mReceive.bytes, bytes);
+        mReceive.lastActivity.store(timestamp, std::memory_order_relaxed);
+    }
+    void receivedPublish() {
+        if(!isEnabled())
+            return;
+        increment(mReceive.msgs, 1);
+    }
+    // called while holding the lock of the persistent client state
+    void publishSent() {
+        if(!isEnabled())
+            return;
+        increment(mPublish.msgs, 1);
+    }
+    void dropped(uint64_t count = 1) {
+        if(!isEnabled())
+            return;
+        increment(mPublish.drops, count);
+    }
+    // called while holding the send mutex
+    void sent(uint64_t bytes, size_t queueDepth) {
+        if(!isEnabled())
+            return;
+        increment(mSend.bytes, bytes);
+        mSend.queueDepth.store(queueDepth, std::memory_order_relaxed);
+        if(bytes > 0) {
+            mSend.lastActivity.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        }
+    }
+    void queueDepthChanged(size_t queueDepth) {
+        if(!isEnabled())
+            return;
+        mSend.queueDepth.store(queueDepth, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] Snapshot snapshot() const {
+        Snapshot ret;
+        ret.msgsIn = mReceive.msgs.load(std::memory_order_relaxed);
+        ret.bytesIn = mReceive.bytes.load(std::memory_order_relaxed);
+        ret.msgsOut = mPublish.msgs.load(std::memory_order_relaxed);
+        ret.drops = mPublish.drops.load(std::memory_order_relaxed);
+        ret.bytesOut = mSend.bytes.load(std::memory_order_relaxed);
+        ret.queueDepth = mSend.queueDepth.load(std::memory_order_relaxed);
+        ret.lastActivity = std::max(mReceive.lastActivity.load(std::memory_order_relaxed), mSend.lastActivity.load(std::memory_order_relaxed));
+        return ret;
+    }
+
+private:
+    static void increment(std::atomic<uint64_t>& value, uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    struct alignas(64) ReceiveCounters {
+        std::atomic<uint64_t> msgs{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<int64_t> lastActivity{0};
+    } mReceive;
+    struct alignas(64) PublishCounters {
+        std::atomic<uint64_t> msgs{0};
+        std::atomic<uint64_t> drops{0};
+    } mPublish;
+    struct alignas(64) SendCounters {
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> queueDepth{0};
+        std::atomic<int64_t> lastActivity{0};
+    } mSend;
+};
+
+struct ClientTrafficEntry {
+    std::string clientId;
+    std::string remoteIp;
+    uint16_t remotePort{0};
+    ClientTraffic::Snapshot traffic;
+};
+
+enum class ClientTrafficSortKey {
+    MSGS_IN,
+    MSGS_OUT,
+    BYTES_IN,
+    BYTES_OUT,
+    DROPS,
+    QUEUE_DEPTH,
+    LAST_ACTIVITY
+};
+std::optional<ClientTrafficSortKey> clientTrafficSortKeyFromString(std::string_view str);
+
+// Keeps only the entries from offset to offset + limit of all entries sorted by the given key in descending order. Only sorts as
+// many entries as needed for that page.
+void sortClientTrafficPage(std::vector<ClientTrafficEntry>& entries, ClientTrafficSortKey sortBy, size_t offset, size_t limit);
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+namespace nioev::mqtt {
+
+/* Min-heap of expiry times, used to find expired entries without scanning every entry. Entries aren't removed when the
+ * corresponding object is replaced or deleted, so the consumer has to check whether a popped entry is still relevant.
+ * Thread safe; whether something expired can be checked without taking the lock.
+ */
+template<typename Key>
+class ExpiryHeap final {
+public:
+    void push(std::time_t expiresAt, Key key) {
+        std::unique_lock<std::mutex> lock{mMutex};
+        mHeap.emplace(Entry{ expiresAt, std::move(key) });
+        mNextExpiry.store(mHeap.top().expiresAt, std::memory_order_relaxed);
+    }
+    [[nodiscard]] bool hasExpired(std::time_t now) const {
+        auto next = mNextExpiry.load(std::memory_order_relaxed);
+        return next != 0 && next <= now;
+    }
+    // Calls callback(key, expiresAt) for every entry that expired. The lock isn't held while calling, so the callback may push.
+    template<typename T>
+    void popExpired(std::time_t now, T&& callback) {
+        std::vector<Entry> expired;
+        {
+            std::unique_lock<std::mutex> lock{mMutex};
+            while(!mHeap.empty() && mHeap.top().expiresAt <= now) {
+                expired.emplace_back(std::move(const_cast<Entry&>(mHeap.top())));
+                mHeap.pop();
+            }
+            mNextExpiry.store(mHeap.empty() ? 0 : mHeap.top().expiresAt, std::memory_order_relaxed);
+        }
+        for(auto& entry: expired) {
+            callback(entry.key, entry.expiresAt);
+        }
+    }
+
+private:
+    struct Entry {
+        std::time_t expiresAt;
+        Key key;
+        bool operator>(const Entry& other) const {
+            return expiresAt > other.expiresAt;
+        }
+    };
+    std::mutex mMutex;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> mHeap;
+    std::atomic<std::time_t> mNextExpiry{0};
+};
+
+}
@@ -1 +1,89 @@
 #include "GlobalConfig.hpp"
+#include "SharedSubscriptions.hpp"
+#include "rapidjson/document.h"
+#include "spdlog/spdlog.h"
+#include <algorithm>
+#include <fstream>
+
+namespace nioev::mqtt {
+
+GlobalConfig& getGlobalConfig() {
+    static GlobalConfig config;
+    return config;
+}
+
+void GlobalConfig::loadFromFile(const std::string& path) {
+    std::ifstream file{ path };
+    if(!file) {
+        spdlog::warn("Couldn't open config file {}, using defaults", path);
+        return;
+    }
+    std::string contents(std::istreambuf_iterator<char>(file), {});
+    rapidjson::Document doc;
+    doc.Parse(contents.c_str(), contents.size());
+    if(doc.HasParseError() || !doc.IsObject()) {
+        spdlog::error("Failed to parse config file {}, using defaults", path);
+        return;
+    }
+    auto readUint = [&](const char* key, uint32_t& target) {
+        auto it = doc.FindMember(key);
+        if(it == doc.MemberEnd())
+            return;
+        if(!it->value.IsUint()) {
+            spdlog::warn("Config option '{}' must be an unsigned integer, ignoring it", key);
+            return;
+        }
+        target = it->value.GetUint();
+    };
+    auto readBool = [&](const char* key, bool& target) {
+        auto it = doc.FindMember(key);
+        if(it == doc.MemberEnd())
+            return;
+        if(!it->value.IsBool()) {
+            spdlog::warn("Config option '{}' must be a boolean, ignoring it", key);
+            return;
+        }
+        target = it->value.GetBool();
+    };
+    auto readString = [&](const char* key, std::string& target) {
+        auto it = doc.FindMember(key);
+        if(it == doc.MemberEnd())
+            return;
+        if(!it->value.IsString()) {
+            spdlog::warn("Config option '{}' must be a string, ignoring it", key);
+            return;
+        }
+        target = it->value.GetString();
+    };
+    readUint("connect-rate-limit-per-second", connectRateLimitPerSecond);
+    readUint("connect-burst", connectBurst);
+    readUint("maximum-pending-logins", maximumPendingLogins);
+    readBool("write-batching", writeBatching);
+    readUint("sender-threads", senderThreads);
+    readUint("retained-mmap-threshold", retainedMmapThreshold);
+    readUint("zerocopy-threshold", zeroCopyThreshold);
+    readUint("topic-alias-maximum", topicAliasMaximum);
+    topicAliasMaximum = std::min<uint32_t>(topicAliasMaximum, UINT16_MAX);
+    readBool("resend-retained-on-resubscribe", resendRetainedOnResubscribe);
+    readString("session-journal", sessionJournal);
+    readUint("session-journal-compaction-threshold", sessionJournalCompactionThreshold);
+    readString("write-ahead-log", writeAheadLog);
+    readUint("write-ahead-log-group-commit-us", writeAheadLogGroupCommitUs);
+    readUint("maximum-queued-messages-per-session", maximumQueuedMessagesPerSession);
+    readBool("stage-timings", stageTimings);
+    readUint("statistics-top-topics", statisticsTopTopics);
+    readUint("statistics-topic-prefix-levels", statisticsTopicPrefixLevels);
+    readBool("per-client-packet-counters", perClientPacketCounters);
+    std::string strategy;
+    readString("shared-subscription-strategy", strategy);
+    if(!strategy.empty()) {
+        if(makeLoadBalancingStrategy(strategy)) {
+            sharedSubscriptionStrategy = std::move(strategy);
+        } else {
+            spdlog::warn("Unknown shared subscription strategy '{}', using '{}'", strategy, sharedSubscriptionStrategy);
+        }
+    }
+    spdlog::info("Loaded config from {}", path);
+}
+
+}
@@ -1,7 +1,69 @@
 #pragma once
 
+#include <cstdint>
+#include <string>
+
 namespace nioev::mqtt {
 
-class GlobalConfig { };
+class GlobalConfig {
+public:
+    // Maximum amount of CONNECT packets that are admitted per second; 0 disables the limiter.
+    uint32_t connectRateLimitPerSecond{0};
+    // Amount of CONNECT packets that can be admitted at once before the rate limit kicks in.
+    uint32_t connectBurst{100};
+    // Maximum amount of logins that may wait in the application state queue at once. Further logins are deferred
+    // until older ones have been processed, so that a connection storm can't fill up the queue.
+    uint32_t maximumPendingLogins{512};
+    // If enabled, data sent to clients during a publish fan-out or while handling received packets is queued and flushed with
+    // a single sendmsg per client at the end, which reduces syscalls and tiny TCP segments.
+    bool writeBatching{false};
+    // Amount of dedicated threads that perform the sendmsg calls for all clients. If 0, data is sent by the thread that
+    // publishes it (e.g. the receiver thread of the publishing client).
+    uint32_t senderThreads{0};
+    // Retained payloads of at least this many bytes are stored in a memory-mapped file and sent to subscribers without
+    // being copied into a new buffer for every one of them; 0 disables this.
+    uint32_t retainedMmapThreshold{1024 * 1024};
+    // Scatter sends of at least this many bytes use MSG_ZEROCOPY, so that large payloads which are fanned out to many
+    // clients aren't copied into every socket buffer; 0 disables this.
+    uint32_t zeroCopyThreshold{0};
+    // How messages on shared subscriptions are distributed among the members of a group:
+    // "round-robin", "least-inflight" or "sticky-hash".
+    std::string sharedSubscriptionStrategy{"round-robin"};
+    // Amount of MQTT 5 topic aliases that clients may use when publishing to us. Also the upper limit for the amount of
+    // aliases we use when sending to a client; 0 disables topic aliases.
+    uint32_t topicAliasMaximum{64};
+    // MQTT 3.1.1 requires resending all matching retained messages when a client repeats a SUBSCRIBE for a topic filter
+    // it's already subscribed to. Disabling this makes 3.1.1 clients behave like MQTT 5 clients with Retain Handling 1,
+    // which avoids replaying all retained messages when persistent sessions reconnect and resubscribe.
+    bool resendRetainedOnResubscribe{true};
+    // File that persistent sessions (subscriptions and in-flight QoS 1/2 messages) are journaled to, so that they survive a
+    // restart; empty disables persisting sessions.
+    std::string sessionJournal{"nioev-sessions.journal"};
+    // The session journal is compacted once this many bytes (or the size of the last compacted journal, if that is larger)
+    // have been appended to it.
+    uint32_t sessionJournalCompactionThreshold{64 * 1024 * 1024};
+    // Path prefix of the write-ahead log segments. If set, QoS 1/2 publishes are only acknowledged after they were written to disk;
+    // empty disables the write-ahead log.
+    std::string writeAheadLog;
+    // How long the write-ahead log waits for more publishes before syncing a batch to disk
+    uint32_t writeAheadLogGroupCommitUs{1000};
+    // Maximum amount of QoS 1/2 messages per session that are held back because the client's receive maximum is reached, e.g.
+    // while it's offline. Further messages are dropped; 0 means unlimited.
+    uint32_t maximumQueuedMessagesPerSession{10000};
+    // Record how long every stage of a publish (recv, parse, match, encode, enqueue, send) takes, see StageTimings.hpp
+    bool stageTimings{true};
+    // Per-topic statistics are only kept for this many of the most frequent topics, so that they need a fixed amount of memory
+    // no matter how many different topics are used.
+    uint32_t statisticsTopTopics{1000};
+    // If not 0, topics are cut off after this many levels for the per-topic statistics, e.g. with 2 the messages on
+    // "devices/1234/temperature" are counted for "devices/1234/#".
+    uint32_t statisticsTopicPrefixLevels{0};
+    // Count the messages, bytes and drops of every client, which can be queried via /clients/traffic
+    bool perClientPacketCounters{false};
+
+    void loadFromFile(const std::string& path);
+};
+
+GlobalConfig& getGlobalConfig();
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace nioev::mqtt {
+
+/* Finds the most frequent keys of a stream with fixed memory, using the SpaceSaving algorithm (Metwally et al.): at most capacity
+ * keys are tracked, and a new key replaces the one with the lowest count and inherits that count as its possible overestimation.
+ * Every key that occurs more often than total / capacity is guaranteed to be tracked. The counters are kept in a min-heap, so
+ * adding is O(log capacity). Not thread safe.
+ */
+template<typename Key>
+class HeavyHitters final {
+public:
+    struct Entry {
+        Key key;
+        // upper bound of the true count
+        uint64_t count{0};
+        // the true count is at least count - error
+        uint64_t error{0};
+    };
+
+    explicit HeavyHitters(size_t capacity)
+    : mCapacity(std::max<size_t>(capacity, 1)) {
+
+    }
+
+    // Returns the key that had to be evicted to make room for the new one, if any
+    std::optional<Key> add(const Key& key, uint64_t weight = 1) {
+        auto position = mPositions.find(key);
+        if(position != mPositions.end()) {
+            mHeap[position->second].count += weight;
+            siftDown(position->second);
+            return {};
+        }
+        if(mHeap.size() < mCapacity) {
+            mHeap.emplace_back(Entry{ key, weight, 0 });
+            mPositions.emplace(key, mHeap.size() - 1);
+            siftUp(mHeap.size() - 1);
+            return {};
+        }
+        auto& minimum = mHeap.front();
+        std::optional<Key> evicted{std::move(minimum.key)};
+        mPositions.erase(*evicted);
+        minimum.key = key;
+        minimum.error = minimum.count;
+        minimum.count += weight;
+        mPositions.emplace(key, 0);
+        siftDown(0);
+        return evicted;
+    }
+    void erase(const Key& key) {
+        auto position = mPositions.find(key);
+        if(position == mPositions.end())
+            return;
+        auto index = position->second;
+        mPositions.erase(position);
+        if(index != mHeap.size() - 1) {
+            mHeap[index] = std::move(mHeap.back());
+            mPositions[mHeap[index].key] = index;
+            mHeap.pop_back();
+            siftDown(siftUp(index));
+        } else {
+            mHeap.pop_back();
+        }
+    }
+    // Halves all counts, so that keys which were frequent a long time ago can be replaced by currently frequent ones. Doesn't
+    // change the order of the keys.
+    void decay() {
+        for(auto& entry: mHeap) {
+            entry.count /= 2;
+            entry.error /= 2;
+        }
+    }
+    [[nodiscard]] const Entry* find(const Key& key) const {
+        auto position = mPositions.find(key);
+        if(position == mPositions.end())
+            return nullptr;
+        return &mHeap[position->second];
+    }
+    // Tracked keys, most frequent first
+    [[nodiscard]] std::vector<Entry> getSorted() const {
+        std::vector<Entry> ret = mHeap;
+        std::sort(ret.begin(), ret.end(), [](const Entry& a, const Entry& b) {
+            return a.count > b.count;
+        });
+        return ret;
+    }
+    [[nodiscard]] size_t size() const {
+        return mHeap.size();
+    }
+
+private:
+    void swapEntries(size_t a, size_t b) {
+        std::swap(mHeap[a], mHeap[b]);
+        mPositions[mHeap[a].key] = a;
+        mPositions[mHeap[b].key] = b;
+    }
+    // returns the new index of the entry
+    size_t siftUp(size_t index) {
+        while(index > 0) {
+            auto parent = (index - 1) / 2;
+            if(mHeap[parent].count <= mHeap[index].count)
+                break;
+            swapEntries(parent, index);
+            index = parent;
+        }
+        return index;
+    }
+    void siftDown(size_t index) {
+        while(true) {
+            auto smallest = index;
+            for(auto child: { 2 * index + 1, 2 * index + 2 }) {
+                if(child < mHeap.size() && mHeap[child].count < mHeap[smallest].count) {
+                    smallest = child;
+                }
+            }
+            if(smallest == index)
+                break;
+            swapEntries(index, smallest);
+            index = smallest;
+        }
+    }
+
+    size_t mCapacity;
+    std::vector<Entry> mHeap;
+    std::unordered_map<Key, size_t> mPositions;
+};
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <sys/uio.h>
+#include <vector>
+
+namespace nioev::mqtt {
+
+/* Collects the iovecs for a single sendmsg call. Empty segments are skipped and tiny segments (e.g. the fixed header or packet
+ * id of a publish) are copied into an inline buffer and merged with adjacent tiny segments, so that one sendmsg can carry more
+ * packets before hitting the iovec limit. Meant to be reused (e.g. one instance per thread) so that no allocations happen per call.
+ */
+class IOVecBuilder final {
+public:
+    static constexpr size_t MAX_IOVECS = UIO_MAXIOV;
+    static constexpr size_t SMALL_SEGMENT_SIZE = 64;
+    static constexpr size_t INLINE_BUFFER_SIZE = 64 * 1024;
+
+    IOVecBuilder() {
+        mVecs.reserve(MAX_IOVECS);
+    }
+    IOVecBuilder(const IOVecBuilder&) = delete;
+    void operator=(const IOVecBuilder&) = delete;
+
+    void clear() {
+        if(!mInlineBuffer) {
+            // never reallocated while building, as the iovecs point into it
+            mInlineBuffer.reset(new uint8_t[INLINE_BUFFER_SIZE]);
+        }
+        mVecs.clear();
+        mInlineBufferUsed = 0;
+        mTotalLength = 0;
+    }
+    // Returns false if the segment couldn't be added because the iovec limit has been reached or the inline buffer is full.
+    // Small segments are always copied, so only the memory of large segments is referenced by the iovecs.
+    bool add(const void* data, size_t length) {
+        assert(mInlineBuffer);
+        if(length == 0)
+            return true;
+        if(length <= SMALL_SEGMENT_SIZE) {
+            if(mInlineBufferUsed + length > INLINE_BUFFER_SIZE)
+                return false;
+            uint8_t* dest = mInlineBuffer.get() + mInlineBufferUsed;
+            bool lastIsInline = !mVecs.empty() && (uint8_t*)mVecs.back().iov_base + mVecs.back().iov_len == dest;
+            if(!lastIsInline && mVecs.size() >= MAX_IOVECS)
+                return false;
+            memcpy(dest, data, length);
+            mInlineBufferUsed += length;
+            if(lastIsInline) {
+                mVecs.back().iov_len += length;
+            } else {
+                mVecs.push_back(iovec{ dest, length });
+            }
+        } else {
+            if(mVecs.size() >= MAX_IOVECS)
+                return false;
+            mVecs.push_back(iovec{ const_cast<void*>(data), length });
+        }
+        mTotalLength += length;
+        return true;
+    }
+    [[nodiscard]] iovec* data() {
+        return mVecs.data();
+    }
+    [[nodiscard]] size_t size() const {
+        return mVecs.size();
+    }
+    [[nodiscard]] bool empty() const {
+        return mVecs.empty();
+    }
+    [[nodiscard]] size_t totalLength() const {
+        return mTotalLength;
+    }
+    // Moves the copied small segments into a buffer of their own and points the iovecs to it, e.g. because the kernel still
+    // references them after a MSG_ZEROCOPY send. The new buffer is only as large as needed, so the inline buffer can still be
+    // reused by the next call. Returns null if there are no small segments.
+    std::unique_ptr<uint8_t[]> detachInlineSegments() {
+        if(mInlineBufferUsed == 0)
+            return {};
+        std::unique_ptr<uint8_t[]> ret{new uint8_t[mInlineBufferUsed]};
+        memcpy(ret.get(), mInlineBuffer.get(), mInlineBufferUsed);
+        auto inlineStart = mInlineBuffer.get();
+        for(auto& vec: mVecs) {
+            auto base = static_cast<uint8_t*>(vec.iov_base);
+            if(base >= inlineStart && base < inlineStart + mInlineBufferUsed) {
+                vec.iov_base = ret.get() + (base - inlineStart);
+            }
+        }
+        return ret;
+    }
+
+private:
+    std::vector<iovec> mVecs;
+    std::unique_ptr<uint8_t[]> mInlineBuffer;
+    size_t mInlineBufferUsed{0};
+    size_t mTotalLength{0};
+};
+
+}
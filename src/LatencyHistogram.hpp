@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <limits>
+
+namespace nioev::mqtt {
+
+class ConcurrentLatencyHistogram;
+
+/* Log-linear histogram in the style of HdrHistogram: values are grouped by their highest set bit and every such group is split
+ * into SUB_BUCKETS / 2 linear buckets, so the relative error of a percentile is below 2 / SUB_BUCKETS over the whole 64 bit range
+ * while the memory usage is fixed. Recording is a couple of bit operations and an increment. Not thread safe; record into one
+ * histogram per thread and merge them.
+ */
+class LatencyHistogram final {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 7;
+    static constexpr unsigned SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+
+    void record(uint64_t value, uint64_t count = 1) {
+        mCounts[bucketIndex(value)] += count;
+        mTotalCount += count;
+        mMin = std::min(mMin, value);
+        mMax = std::max(mMax, value);
+        mSum += value * count;
+    }
+    void merge(const LatencyHistogram& other) {
+        for(size_t i = 0; i < mCounts.size(); ++i) {
+            mCounts[i] += other.mCounts[i];
+        }
+        mTotalCount += other.mTotalCount;
+        mMin = std::min(mMin, other.mMin);
+        mMax = std::max(mMax, other.mMax);
+        mSum += other.mSum;
+    }
+    // Removes the values of an earlier snapshot of the same histogram, which leaves the values recorded since then. Minimum and
+    // maximum can't be restored exactly, so they are rounded to the bounds of the lowest and highest remaining bucket.
+    void subtract(const LatencyHistogram& earlier) {
+        mMin = std::numeric_limits<uint64_t>::max();
+        mMax = 0;
+        for(size_t i = 0; i < mCounts.size(); ++i) {
+            mCounts[i] -= earlier.mCounts[i];
+            if(mCounts[i] > 0) {
+                mMin = std::min(mMin, bucketLowerBound(i));
+                mMax = bucketUpperBound(i);
+            }
+        }
+        mTotalCount -= earlier.mTotalCount;
+        mSum -= earlier.mSum;
+    }
+    void reset() {
+        *this = LatencyHistogram{};
+    }
+
+    // Returns the value below which the given fraction (0 - 1) of all recorded values lie, rounded up to the end of its bucket
+    [[nodiscard]] uint64_t percentile(double fraction) const {
+        if(mTotalCount == 0)
+            return 0;
+        auto rank = static_cast<uint64_t>(fraction * static_cast<double>(mTotalCount) + 0.5);
+        rank = std::clamp<uint64_t>(rank, 1, mTotalCount);
+        uint64_t seen = 0;
+        for(size_t i = 0; i < mCounts.size(); ++i) {
+            seen += mCounts[i];
+            if(seen >= rank) {
+                return std::clamp(bucketUpperBound(i), mMin, mMax);
+            }
+        }
+        return mMax;
+    }
+    [[nodiscard]] uint64_t getTotalCount() const {
+        return mTotalCount;
+    }
+    [[nodiscard]] uint64_t getMin() const {
+        return mTotalCount ? mMin : 0;
+    }
+    [[nodiscard]] uint64_t getMax() const {
+        return mMax;
+    }
+    [[nodiscard]] double getMean() const {
+        return mTotalCount ? static_cast<double>(mSum) / static_cast<double>(mTotalCount) : 0.0;
+    }
+
+private:
+    friend class ConcurrentLatencyHistogram;
+
+    // values below SUB_BUCKETS get a bucket each, above that there are SUB_BUCKETS / 2 buckets per power of two
+    static constexpr size_t BUCKET_COUNT = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * (SUB_BUCKETS / 2);
+
+    static size_t bucketIndex(uint64_t value) {
+        if(value < SUB_BUCKETS)
+            return value;
+        unsigned magnitude = 63 - std::countl_zero(value);
+        unsigned shift = magnitude - (SUB_BUCKET_BITS - 1);
+        // the top bit is always set, so only the next SUB_BUCKET_BITS - 1 bits select the bucket
+        size_t subBucket = (value >> shift) - SUB_BUCKETS / 2;
+        return SUB_BUCKETS + (magnitude - SUB_BUCKET_BITS) * (SUB_BUCKETS / 2) + subBucket;
+    }
+    static uint64_t bucketLowerBound(size_t index) {
+        if(index < SUB_BUCKETS)
+            return index;
+        size_t group = (index - SUB_BUCKETS) / (SUB_BUCKETS / 2);
+        size_t subBucket = (index - SUB_BUCKETS) % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+        return static_cast<uint64_t>(subBucket) << (group + 1);
+    }
+    static uint64_t bucketUpperBound(size_t index) {
+        if(index < SUB_BUCKETS)
+            return index;
+        unsigned shift = (index - SUB_BUCKETS) / (SUB_BUCKETS / 2) + 1;
+        return bucketLowerBound(index) + ((uint64_t{1} << shift) - 1);
+    }
+
+    std::array<uint64_t, BUCKET_COUNT> mCounts{};
+    uint64_t mTotalCount{0};
+    uint64_t mMin{std::numeric_limits<uint64_t>::max()};
+    uint64_t mMax{0};
+    uint64_t mSum{0};
+};
+
+/* LatencyHistogram that is written by exactly one thread while other threads may read it at any time, without locks. The writer
+ * only uses relaxed loads and stores instead of read-modify-write operations, so recording is as cheap as with a plain
+ * LatencyHistogram on x86. A snapshot taken concurrently may miss the values that are being recorded at that moment.
+ */
+class ConcurrentLatencyHistogram final {
+public:
+    void record(uint64_t value) {
+        increment(mCounts[LatencyHistogram::bucketIndex(value)], 1);
+        increment(mSum, value);
+        if(value < mMin.load(std::memory_order_relaxed))
+            mMin.store(value, std::memory_order_relaxed);
+        if(value > mMax.load(std::memory_order_relaxed))
+            mMax.store(value, std::memory_order_relaxed);
+    }
+    // Adds the current values to the given histogram
+    void snapshotInto(LatencyHistogram& histogram) const {
+        uint64_t totalCount = 0;
+        for(size_t i = 0; i < mCounts.size(); ++i) {
+            auto count = mCounts[i].load(std::memory_order_relaxed);
+            histogram.mCounts[i] += count;
+            totalCount += count;
+        }
+        // summing the buckets keeps the total consistent with them, even if values are recorded in the meantime
+        histogram.mTotalCount += totalCount;
+        histogram.mSum += mSum.load(std::memory_order_relaxed);
+        histogram.mMin = std::min(histogram.mMin, mMin.load(std::memory_order_relaxed));
+        histogram.mMax = std::max(histogram.mMax, mMax.load(std::memory_order_relaxed));
+    }
+
+private:
+    static void increment(std::atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    std::array<std::atomic<uint64_t>, LatencyHistogram::BUCKET_COUNT> mCounts{};
+    std::atomic<uint64_t> mSum{0};
+    std::atomic<uint64_t> mMin{std::numeric_limits<uint64_t>::max()};
+    std::atomic<uint64_t> mMax{0};
+};
+
+}
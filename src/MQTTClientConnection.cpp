@@ -2,19 +2,59 @@
 #include "ApplicationState.hpp"
 #include "nioev/lib/Util.hpp"
 #include "MQTTPublishPacketBuilder.hpp"
+#include "GlobalConfig.hpp"
+#include "Metrics.hpp"
+#include "PropertyUtil.hpp"
+#include "StageTimings.hpp"
+#include "WriteBatch.hpp"
 
 namespace nioev::mqtt {
 
 using namespace nioev::lib;
 
 void MQTTClientConnection::publish(const std::string& topic, PayloadType payload, QoS qos, Retained retained, const PropertyList& properties, MQTTPublishPacketBuilder& packetBuilder, uint16_t packetId) {
-    sendData(InTransitEncodedPacket{packetBuilder.getPacket(qos, packetId, mMQTTVersion)});
+    Metrics::add(Counter::MSGS_OUT);
+    mTraffic.publishSent();
+    auto encodeStart = StageTimings::now();
+    if(mMQTTVersion == MQTTVersion::V5 && mOutboundTopicAliases.getMaximum() > 0) {
+        auto alias = mOutboundTopicAliases.lookupOrAssign(topic);
+        InTransitEncodedPacket packet{packetBuilder.getPacketWithTopicAlias(qos, packetId, alias.alias, alias.isNew)};
+        StageTimings::recordSince(PublishStage::ENCODE, encodeStart);
+        sendData(std::move(packet));
+        return;
+    }
+    InTransitEncodedPacket packet{packetBuilder.getPacket(qos, packetId, mMQTTVersion)};
+    StageTimings::recordSince(PublishStage::ENCODE, encodeStart);
+    sendData(std::move(packet));
+}
+void MQTTClientConnection::publishEncoded(EncodedPacket packet) {
+    Metrics::add(Counter::MSGS_OUT);
+    mTraffic.publishSent();
+    sendData(std::move(packet));
+}
+size_t MQTTClientConnection::getPublishPacketSize(const std::string& topic, QoS qos, MQTTPublishPacketBuilder& packetBuilder) {
+    // the packet id always takes two bytes, so 0 can be used here
+    if(mMQTTVersion == MQTTVersion::V5 && mOutboundTopicAliases.getMaximum() > 0) {
+        return packetBuilder.getPacketWithTopicAliasSize(qos, mOutboundTopicAliases.peek(topic).isNew);
+    }
+    return packetBuilder.getPacket(qos, 0, mMQTTVersion).fullSize();
+}
+void MQTTClientConnection::setConnectProperties(std::unique_lock<std::mutex>& recvMutex, PropertyList properties) {
+    assert(recvMutex.owns_lock());
+    assert(recvMutex.mutex() == &mRecvMutex);
+    mConnectProperties = std::move(properties);
+    auto maximum = getGlobalConfig().topicAliasMaximum;
+    mInboundTopicAliases.assign(maximum, std::string{});
+    // the client tells us how many aliases it accepts, the default is none
+    auto clientMaximum = getIntegerProperty(mConnectProperties, MQTTProperty::TOPIC_ALIAS_MAXIMUM).value_or(0);
+    mOutboundTopicAliases = TopicAliasCache{static_cast<uint16_t>(std::min(maximum, clientMaximum))};
 }
 
 void MQTTClientConnection::sendData(EncodedPacket packet) {
     sendData(InTransitEncodedPacket{std::move(packet)});
 }
 void MQTTClientConnection::sendData(InTransitEncodedPacket packet) {
+    auto enqueueStart = StageTimings::now();
     try {
         uint totalBytesSent = 0;
         uint bytesSent = 0;
@@ -26,17 +66,61 @@ void MQTTClientConnection::sendData(InTransitEncodedPacket packet) {
             spdlog::warn("[{}] Dropping packet due to large queue depth", mClientId);
             return false;
         }*/
+        if(getGlobalConfig().senderThreads > 0) {
+            mSendTasks.push(std::move(packet));
+            mTraffic.queueDepthChanged(mSendTasks.size());
+            lock.unlock();
+            if(markFlushScheduled()) {
+                mApp.scheduleFlushOnSenderThread(*this);
+            }
+            StageTimings::recordSince(PublishStage::ENQUEUE, enqueueStart);
+            return;
+        }
+        if(WriteBatchScope::isActive()) {
+            mSendTasks.push(std::move(packet));
+            mTraffic.queueDepthChanged(mSendTasks.size());
+            lock.unlock();
+            if(markFlushScheduled()) {
+                WriteBatchScope::scheduleFlush(*this);
+            }
+            StageTimings::recordSince(PublishStage::ENQUEUE, enqueueStart);
+            return;
+        }
+        // sending directly; the syscall itself is measured as its own stage
+        StageTimings::recordSince(PublishStage::ENQUEUE, enqueueStart);
+        uint sent = 0;
         if(mSendTasks.empty()) {
-            getTcpClient().sendScatter(&packet, 1);
+            sent = getTcpClient().sendScatter(packet);
         }
         if(!packet.isDone()) {
-            mSendTasks.emplace_back(std::move(packet));
+            mSendTasks.push(std::move(packet));
         }
+        mTraffic.sent(sent, mSendTasks.size());
     } catch(std::exception& e) {
         spdlog::error("[{}] Error while sending data: {}", getClientId(), e.what());
         // we aren't allowed to enqueue a change request here, because we could be inside ApplicationState::publish, where a shared lock is held.
-        // that's why we just set a flag which causes the logout to be enequeued later on
-        mSendError = true;
+        // that's why we just put ourselves onto a list of clients that the worker thread logs out later on
+        disconnectAfterError();
+    }
+}
+void MQTTClientConnection::disconnectAfterError() {
+    if(!mSendError.exchange(true)) {
+        mApp.notifySendError(*this);
+    }
+}
+void MQTTClientConnection::flushSendTasks() {
+    mFlushScheduled = false;
+    try {
+        std::unique_lock<std::timed_mutex> lock{mSendMutex};
+        if(mSendTasks.empty())
+            return;
+        auto sent = getTcpClient().sendScatter(mSendTasks);
+        // anything that couldn't be sent stays queued and will be sent once we receive EPOLLOUT
+        mSendTasks.popDone();
+        mTraffic.sent(sent, mSendTasks.size());
+    } catch(std::exception& e) {
+        spdlog::error("[{}] Error while sending data: {}", getClientId(), e.what());
+        disconnectAfterError();
     }
 }
 
@@ -7,11 +7,13 @@
 #include <optional>
 #include <queue>
 
+#include "ClientTraffic.hpp"
 #include "Forward.hpp"
 #include "MQTTPublishPacketBuilder.hpp"
 #include "nioev/lib/Enums.hpp"
 #include "Subscriber.hpp"
 #include "TcpClientConnection.hpp"
+#include "TopicAliasCache.hpp"
 
 namespace nioev::mqtt {
 
@@ -65,7 +67,7 @@ public:
         return mRecvData;
     }
 
-    std::pair<std::reference_wrapper<std::vector<InTransitEncodedPacket>>, std::unique_lock<std::timed_mutex>> getSendTasks() {
+    std::pair<std::reference_wrapper<SendQueue>, std::unique_lock<std::timed_mutex>> getSendTasks() {
         std::unique_lock<std::timed_mutex> lock{mSendMutex};
         return {mSendTasks, std::move(lock)};
     }
@@ -108,7 +110,7 @@ public:
         mProperClientId = std::move(clientId);
         mProperClientIdSet = true;
     }
-    const std::string& getClientId() {
+    const std::string& getClientId() const {
         if(mProperClientIdSet)
             return mProperClientId;
         static std::string tmp{"< INVALID CLIENT ID >"};
@@ -120,10 +122,14 @@ public:
     void setLastDataRecvTimestamp(int64_t newTimestamp) {
         mLastDataReceivedTimestamp = newTimestamp;
     }
-
-    void setConnectProperties(PropertyList properties) {
-        mConnectProperties = std::move(properties);
+    ClientTraffic& getTraffic() {
+        return mTraffic;
+    }
+    const ClientTraffic& getTraffic() const {
+        return mTraffic;
     }
+
+    void setConnectProperties(std::unique_lock<std::mutex>& recvMutex, PropertyList properties);
     const PropertyList& getConnectPropertyList() const {
         return mConnectProperties;
     }
@@ -136,6 +142,15 @@ public:
     bool hasSendError() {
         return mSendError;
     }
+    // Logs the client out from any thread, just like after a send error
+    void disconnectAfterError();
+    // used by ApplicationState to link clients with send errors together without allocating
+    MQTTClientConnection* getNextClientWithSendError() const {
+        return mNextClientWithSendError;
+    }
+    void setNextClientWithSendError(MQTTClientConnection* next) {
+        mNextClientWithSendError = next;
+    }
     PersistentClientState* getPersistentClientState() {
         return mPersistentClientState;
     }
@@ -152,13 +167,29 @@ public:
         assert(recvMutex.mutex() == &mRecvMutex);
         return mPacketsReceivedWhileWaitingForConnectingLogin;
     }
+    // topic aliases the client uses when publishing to us, index is alias - 1
+    std::vector<std::string>& getInboundTopicAliases(std::unique_lock<std::mutex>& recvMutex) {
+        assert(recvMutex.owns_lock());
+        assert(recvMutex.mutex() == &mRecvMutex);
+        return mInboundTopicAliases;
+    }
     std::unique_lock<std::mutex> getRecvMutexLock() {
         return std::unique_lock<std::mutex>{ mRecvMutex };
     }
 
     void sendData(EncodedPacket packet);
     void sendData(InTransitEncodedPacket packet);
+    // sends as much of the queued data as possible, used by write batching
+    void flushSendTasks();
+    // returns true if the caller is responsible for scheduling a flush
+    bool markFlushScheduled() {
+        return !mFlushScheduled.exchange(true);
+    }
     void publish(const std::string& topic, PayloadType payload, QoS qos, Retained retained, const PropertyList& properties, MQTTPublishPacketBuilder& packetBuilder, uint16_t packetId);
+    // Sends a PUBLISH that was encoded before, e.g. one that was held back or is resent after reconnecting, and counts it like publish
+    void publishEncoded(EncodedPacket packet);
+    // Size of the packet that publish would send right now, which depends on the topic aliases. Has the same locking requirements as publish.
+    size_t getPublishPacketSize(const std::string& topic, QoS qos, MQTTPublishPacketBuilder& packetBuilder);
 
 private:
     ApplicationState& mApp;
@@ -171,17 +202,22 @@ private:
     std::vector<PacketReceiveData> mPacketsReceivedWhileWaitingForConnectingLogin;
     uint16_t mKeepAliveIntervalSeconds = 10;
     PropertyList mConnectProperties;
+    std::vector<std::string> mInboundTopicAliases;
+    // only accessed by publish, which is serialized by the lock of the persistent client state
+    TopicAliasCache mOutboundTopicAliases{0};
     MQTTVersion mMQTTVersion = MQTTVersion::V4;
     std::string mProperClientId;
     std::atomic<ConnectionState> mState = ConnectionState::INITIAL;
     std::optional<MQTTPacket> mWill;
 
     std::timed_mutex mSendMutex;
-    std::vector<InTransitEncodedPacket> mSendTasks;
-
+    SendQueue mSendTasks;
+    std::atomic<bool> mFlushScheduled{false};
 
+    ClientTraffic mTraffic;
 
     std::atomic<bool> mLoggedOut = false, mSendError = false;
+    MQTTClientConnection* mNextClientWithSendError{nullptr};
     std::atomic<int64_t> mLastDataReceivedTimestamp = std::chrono::steady_clock::now().time_since_epoch().count();
 
     std::atomic<bool> mProperClientIdSet{false};
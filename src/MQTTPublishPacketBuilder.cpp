@@ -7,111 +7,283 @@ MQTTPublishPacketBuilder::MQTTPublishPacketBuilder(const std::string& topic, Pay
 : mTopic(topic), mPayload(payload), mRetained(retained), mProperties(properties) {
 
 }
-EncodedPacket MQTTPublishPacketBuilder::getPacket(QoS qos, uint16_t packetId, MQTTVersion version) {
-    auto qosInt = static_cast<int>(qos);
+MQTTPublishPacketBuilder::MQTTPublishPacketBuilder(const std::string& topic, PayloadType payload, std::shared_ptr<const void> payloadOwner, Retained retained, const PropertyList& properties)
+: mTopic(topic), mPayload(payload), mRetained(retained), mProperties(properties), mPayloadOwner(std::move(payloadOwner)) {
 
+}
+uint8_t MQTTPublishPacketBuilder::getFirstByte(QoS qos) const {
     uint8_t firstByte = static_cast<uint8_t>(qos) << 1;
     if(mRetained == Retained::Yes) {
         firstByte |= 1;
     }
     firstByte |= static_cast<uint8_t>(MQTTMessageType::PUBLISH) << 4;
+    return firstByte;
+}
+const SharedBuffer& MQTTPublishPacketBuilder::getMiddle() {
+    if(!mPacketMiddle) {
+        BinaryEncoder middleEncoder;
+        middleEncoder.encodeString(mTopic);
+        mPacketMiddle = middleEncoder.moveData();
+    }
+    return *mPacketMiddle;
+}
+EncodedPacket MQTTPublishPacketBuilder::getPacket(QoS qos, uint16_t packetId, MQTTVersion version) {
+    auto firstByte = getFirstByte(qos);
 
-    if(mPacketPostlude.count(version) && mPacketMiddle) {
-        if(qos == QoS::QoS0) {
-            return EncodedPacket::fromComponents(firstByte, mPacketMiddle.value(), mPacketPostlude.at(version));
-        } else {
-            return EncodedPacket::fromComponents(firstByte, mPacketMiddle.value(), packetId, mPacketPostlude.at(version));
+    auto postlude = mPacketPostlude.find(version);
+    if(postlude == mPacketPostlude.end()) {
+        BinaryEncoder endEncoder;
+        if(version == MQTTVersion::V5) {
+            encodeProperties(endEncoder, mProperties);
+        }
+        if(!mPayloadOwner) {
+            endEncoder.encodeBytes(mPayload.data(), mPayload.size());
         }
+        postlude = mPacketPostlude.emplace(version, endEncoder.moveData()).first;
     }
 
-    BinaryEncoder middleEncoder;
-    middleEncoder.encodeString(mTopic);
-    mPacketMiddle = middleEncoder.moveData();
-
-    BinaryEncoder endEncoder;
-    if(version == MQTTVersion::V5) {
-        endEncoder.encodePropertyList(mProperties);
+    if(qos == QoS::QoS0) {
+        return EncodedPacket::fromComponents(firstByte, getMiddle(), postlude->second, getExternalPayload());
+    } else {
+        return EncodedPacket::fromComponents(firstByte, getMiddle(), packetId, postlude->second, getExternalPayload());
+    }
+}
+const SharedBuffer& MQTTPublishPacketBuilder::getPropertiesAndPayload() {
+    if(!mPropertiesAndPayload) {
+        BinaryEncoder propertiesEncoder;
+        encodeProperties(propertiesEncoder, mProperties);
+        auto properties = propertiesEncoder.moveData();
+        size_t lengthBytes = 0;
+        mPropertiesLength = decodeListLength(properties, lengthBytes);
+        BinaryEncoder encoder;
+        encoder.encodeBytes(properties.data() + lengthBytes, properties.size() - lengthBytes);
+        if(!mPayloadOwner) {
+            encoder.encodeBytes(mPayload.data(), mPayload.size());
+        }
+        mPropertiesAndPayload = encoder.moveData();
     }
-    endEncoder.encodeBytes(mPayload.data(), mPayload.size());
+    return *mPropertiesAndPayload;
+}
+EncodedPacket MQTTPublishPacketBuilder::getPacketWithTopicAlias(QoS qos, uint16_t packetId, uint16_t topicAlias, bool sendTopic) {
+    assert(topicAlias > 0);
+    auto& propertiesAndPayload = getPropertiesAndPayload();
+    if(!sendTopic && !mEmptyTopic) {
+        BinaryEncoder emptyTopicEncoder;
+        emptyTopicEncoder.encode2Bytes(0);
+        mEmptyTopic = emptyTopicEncoder.moveData();
+    }
+    // The order of properties doesn't matter, so only the topic alias and the new length of the list are encoded for every
+    // receiver and the rest of the list is shared.
+    BinaryEncoder aliasEncoder;
+    auto listLength = encodeVarByteInt(mPropertiesLength + 3);
+    aliasEncoder.encodeBytes(listLength.value, listLength.valueLength);
+    aliasEncoder.encodeByte(static_cast<uint8_t>(MQTTProperty::TOPIC_ALIAS));
+    aliasEncoder.encode2Bytes(topicAlias);
 
-    mPacketPostlude.emplace(version, endEncoder.moveData());
+    std::optional<uint16_t> usedPacketId;
+    if(qos != QoS::QoS0) {
+        usedPacketId = packetId;
+    }
+    return EncodedPacket::fromPublishComponents(
+        getFirstByte(qos), sendTopic ? getMiddle() : *mEmptyTopic, usedPacketId, aliasEncoder.moveData(), propertiesAndPayload, getExternalPayload());
+}
+size_t MQTTPublishPacketBuilder::getPacketWithTopicAliasSize(QoS qos, bool sendTopic) {
+    auto& propertiesAndPayload = getPropertiesAndPayload();
+    size_t remainingLength = (sendTopic ? 2 + mTopic.size() : 2) + (qos != QoS::QoS0 ? 2 : 0);
+    remainingLength += encodeVarByteInt(mPropertiesLength + 3).valueLength + 3;
+    remainingLength += propertiesAndPayload.size() + getExternalPayload().size;
+    return 1 + encodeVarByteInt(remainingLength).valueLength + remainingLength;
+}
 
-    if(qos == QoS::QoS0) {
-        return EncodedPacket::fromComponents(firstByte, mPacketMiddle.value(), mPacketPostlude.at(version));
-    } else {
-        return EncodedPacket::fromComponents(firstByte, mPacketMiddle.value(), packetId, mPacketPostlude.at(version));
+uint32_t MQTTPublishPacketBuilder::decodeListLength(const SharedBuffer& list, size_t& lengthBytes) {
+    uint32_t listLength = 0;
+    uint32_t multiplier = 1;
+    lengthBytes = 0;
+    do {
+        listLength += (list.data()[lengthBytes] & 127) * multiplier;
+        multiplier *= 128;
+    } while(list.data()[lengthBytes++] & 128);
+    return listLength;
+}
+void MQTTPublishPacketBuilder::encodeProperties(BinaryEncoder& encoder, const PropertyList& properties) const {
+    if(mAdditionalSubscriptionIdentifiers.empty()) {
+        encoder.encodePropertyList(properties);
+        return;
+    }
+    BinaryEncoder listEncoder;
+    listEncoder.encodePropertyList(properties);
+    auto list = listEncoder.moveData();
+    // the list starts with its length as a variable byte integer, which grows by the appended identifiers
+    size_t lengthBytes = 0;
+    auto listLength = decodeListLength(list, lengthBytes);
+    BinaryEncoder identifiersEncoder;
+    for(auto identifier: mAdditionalSubscriptionIdentifiers) {
+        identifiersEncoder.encodeByte(static_cast<uint8_t>(MQTTProperty::SUBSCRIPTION_IDENTIFIER));
+        auto encodedIdentifier = encodeVarByteInt(identifier);
+        identifiersEncoder.encodeBytes(encodedIdentifier.value, encodedIdentifier.valueLength);
     }
+    auto identifiers = identifiersEncoder.moveData();
+    auto newLength = encodeVarByteInt(listLength + identifiers.size());
+    encoder.encodeBytes(newLength.value, newLength.valueLength);
+    encoder.encodeBytes(list.data() + lengthBytes, list.size() - lengthBytes);
+    encoder.encodeBytes(identifiers.data(), identifiers.size());
+}
+ExternalSegment MQTTPublishPacketBuilder::getExternalPayload() const {
+    if(!mPayloadOwner)
+        return {};
+    return { mPayloadOwner, mPayload.data(), mPayload.size() };
 }
 
-size_t EncodedPacket::constructIOVecs(size_t offset, iovec* iovecs) {
-    size_t ret = 0;
-    switch(mType) {
-    case Type::SingleByteWithLen:
-        assert(offset < mPreludeLength);
-        iovecs[0].iov_len = mPreludeLength - offset;
-        iovecs[0].iov_base = &mPrelude.firstByte + offset;
-        return 1;
-    case Type::SingleByteWithLenAndMiddle:
-        if(offset < mPreludeLength) {
-            iovecs[0].iov_len = mPreludeLength - offset;
-            iovecs[0].iov_base = &mPrelude.firstByte + offset;
-            iovecs[1].iov_len = mMiddle.size();
-            iovecs[1].iov_base = mMiddle.data();
-        } else {
-            iovecs[1].iov_len = mMiddle.size() - (offset - mPreludeLength);
-            iovecs[1].iov_base = mMiddle.data() + (offset - mPreludeLength);
+size_t EncodedPacket::getSegments(std::array<Segment, 6>& segments) const {
+    assert(mType != Type::Invalid);
+    size_t segmentCount = 0;
+    segments[segmentCount++] = { &mPrelude.firstByte, mPreludeLength };
+    if(mType != Type::SingleByteWithLen) {
+        segments[segmentCount++] = { mMiddle.data(), mMiddle.size() };
+    }
+    if(mPacketId) {
+        segments[segmentCount++] = { reinterpret_cast<const uint8_t*>(&mPacketId.value()), sizeof(uint16_t) };
+    }
+    if(mType == Type::SingleByteWithLenAndMiddleAndEnd || mType == Type::Full) {
+        segments[segmentCount++] = { mProperties.data(), mProperties.size() };
+        segments[segmentCount++] = { mEnd.data(), mEnd.size() };
+        segments[segmentCount++] = { mExternal.data, mExternal.size };
+    }
+    return segmentCount;
+}
+bool EncodedPacket::constructIOVecs(size_t offset, IOVecBuilder& builder) const {
+    std::array<Segment, 6> segments;
+    auto segmentCount = getSegments(segments);
+    for(size_t i = 0; i < segmentCount; ++i) {
+        auto& segment = segments[i];
+        if(offset >= segment.length) {
+            offset -= segment.length;
+            continue;
+        }
+        if(!builder.add(segment.data + offset, segment.length - offset))
+            return false;
+        offset = 0;
+    }
+    return true;
+}
+void EncodedPacket::appendTo(std::vector<uint8_t>& out) const {
+    std::array<Segment, 6> segments;
+    auto segmentCount = getSegments(segments);
+    for(size_t i = 0; i < segmentCount; ++i) {
+        out.insert(out.end(), segments[i].data, segments[i].data + segments[i].length);
+    }
+}
+static size_t skipFixedHeader(const uint8_t* data, size_t length) {
+    // skip the first byte and the variable length, which is recalculated when constructing the packet
+    size_t offset = 1;
+    while(offset < length && offset <= 4 && (data[offset] & 0x80)) {
+        offset += 1;
+    }
+    offset += 1;
+    if(offset > length) {
+        throw std::runtime_error{"Packet too short"};
+    }
+    return offset;
+}
+EncodedPacket EncodedPacket::fromBytes(const uint8_t* data, size_t length) {
+    auto offset = skipFixedHeader(data, length);
+    BinaryEncoder encoder;
+    encoder.encodeBytes(data + offset, length - offset);
+    return fromData(data[0], encoder.moveData());
+}
+EncodedPacket EncodedPacket::fromPublishBytes(const uint8_t* data, size_t length) {
+    auto offset = skipFixedHeader(data, length);
+    if(offset + 2 > length) {
+        throw std::runtime_error{"Packet too short"};
+    }
+    size_t topicEnd = offset + 2 + ((data[offset] << 8) | data[offset + 1]);
+    if(topicEnd + 2 > length) {
+        throw std::runtime_error{"Packet too short"};
+    }
+    BinaryEncoder topic;
+    topic.encodeBytes(data + offset, topicEnd - offset);
+    uint16_t packetId = (data[topicEnd] << 8) | data[topicEnd + 1];
+    // the properties (MQTT 5) and the payload
+    BinaryEncoder rest;
+    rest.encodeBytes(data + topicEnd + 2, length - topicEnd - 2);
+    return fromComponents(data[0], topic.moveData(), packetId, rest.moveData());
+}
+// The length of the value of an MQTT 5 property, starting at data
+static size_t getPropertyValueLength(MQTTProperty property, const uint8_t* data, const uint8_t* end) {
+    auto lengthPrefixed = [&](size_t offset) -> size_t {
+        if(data + offset + 2 > end) {
+            throw std::runtime_error{"Property list too short"};
         }
+        return 2 + ((data[offset] << 8) | data[offset + 1]);
+    };
+    switch(property) {
+    case MQTTProperty::MESSAGE_EXPIRY_INTERVAL:
+    case MQTTProperty::SESSION_EXPIRY_INTERVAL:
+    case MQTTProperty::WILL_DELAY_INTERVAL:
+    case MQTTProperty::MAXIMUM_PACKET_SIZE:
+        return 4;
+    case MQTTProperty::SERVER_KEEP_ALIVE:
+    case MQTTProperty::RECEIVE_MAXIMUM:
+    case MQTTProperty::TOPIC_ALIAS_MAXIMUM:
+    case MQTTProperty::TOPIC_ALIAS:
         return 2;
-    case Type::SingleByteWithLenAndMiddleAndEnd:
-        if(offset < mPreludeLength) {
-            iovecs[0].iov_len = mPreludeLength - offset;
-            iovecs[0].iov_base = &mPrelude.firstByte + offset;
-            iovecs[1].iov_len = mMiddle.size();
-            iovecs[1].iov_base = mMiddle.data();
-            iovecs[2].iov_len = mEnd.size();
-            iovecs[2].iov_base = mEnd.data();
-        } else if(offset < mPreludeLength + mMiddle.size()) {
-            iovecs[1].iov_len = mMiddle.size() - (offset - mPreludeLength);
-            iovecs[1].iov_base = mMiddle.data() + (offset - mPreludeLength);
-            iovecs[2].iov_len = mEnd.size();
-            iovecs[2].iov_base = mEnd.data();
-        } else {
-            iovecs[2].iov_len = mEnd.size() - (offset - mPreludeLength - mMiddle.size());
-            iovecs[2].iov_base = mEnd.data() + (offset - mPreludeLength - mMiddle.size());
+    case MQTTProperty::SUBSCRIPTION_IDENTIFIER: {
+        size_t length = 1;
+        while(data + length <= end && (data[length - 1] & 0x80)) {
+            length += 1;
+        }
+        return length;
+    }
+    case MQTTProperty::CONTENT_TYPE:
+    case MQTTProperty::RESPONSE_TOPIC:
+    case MQTTProperty::CORRELATION_DATA:
+    case MQTTProperty::ASSIGNED_CLIENT_IDENTIFIER:
+    case MQTTProperty::AUTHENTICATION_METHOD:
+    case MQTTProperty::AUTHENTICATION_DATA:
+    case MQTTProperty::RESPONSE_INFORMATION:
+    case MQTTProperty::SERVER_REFERENCE:
+    case MQTTProperty::REASON_STRING:
+        return lengthPrefixed(0);
+    case MQTTProperty::USER_PROPERTY: {
+        auto keyLength = lengthPrefixed(0);
+        return keyLength + lengthPrefixed(keyLength);
+    }
+    default:
+        return 1;
+    }
+}
+EncodedPacket EncodedPacket::withMessageExpiryInterval(uint32_t interval) const {
+    std::vector<uint8_t> bytes;
+    bytes.reserve(fullSize());
+    appendTo(bytes);
+    auto offset = skipFixedHeader(bytes.data(), bytes.size());
+    if(offset + 2 > bytes.size()) {
+        throw std::runtime_error{"Packet too short"};
+    }
+    // skip the topic and the packet id
+    offset += 2 + ((bytes[offset] << 8) | bytes[offset + 1]) + 2;
+    uint32_t listLength = 0;
+    uint32_t multiplier = 1;
+    do {
+        if(offset >= bytes.size()) {
+            throw std::runtime_error{"Packet too short"};
         }
-        return 3;
-    case Type::Full:
-        if(offset < mPreludeLength) {
-            iovecs[0].iov_len = mPreludeLength - offset;
-            iovecs[0].iov_base = &mPrelude.firstByte + offset;
-            iovecs[1].iov_len = mMiddle.size();
-            iovecs[1].iov_base = mMiddle.data();
-            iovecs[2].iov_len = sizeof(uint16_t);
-            iovecs[2].iov_base = &mPacketId.value();
-            iovecs[3].iov_len = mEnd.size();
-            iovecs[3].iov_base = mEnd.data();
-        } else if(offset < mPreludeLength + mMiddle.size()) {
-            iovecs[1].iov_len = mMiddle.size() - (offset - mPreludeLength);
-            iovecs[1].iov_base = mMiddle.data() + (offset - mPreludeLength);
-            iovecs[2].iov_len = sizeof(uint16_t);
-            iovecs[2].iov_base = &mPacketId.value();
-            iovecs[3].iov_len = mEnd.size();
-            iovecs[3].iov_base = mEnd.data();
-        } else if(offset < mPreludeLength + mMiddle.size() + sizeof(uint16_t)) {
-            iovecs[2].iov_len = sizeof(uint16_t) - (offset - mPreludeLength - mMiddle.size());
-            iovecs[2].iov_base = &mPacketId.value() + (offset - mPreludeLength - mMiddle.size());
-            iovecs[3].iov_len = mEnd.size();
-            iovecs[3].iov_base = mEnd.data();
-        } else {
-            iovecs[3].iov_len = mEnd.size() - (offset - mPreludeLength - mMiddle.size() - sizeof(uint16_t));
-            iovecs[3].iov_base = mEnd.data() + (offset - mPreludeLength - mMiddle.size() - sizeof(uint16_t));
+        listLength += (bytes[offset] & 127) * multiplier;
+        multiplier *= 128;
+    } while(bytes[offset++] & 128);
+    const uint8_t* it = bytes.data() + offset;
+    const uint8_t* bytesEnd = bytes.data() + bytes.size();
+    const uint8_t* listEnd = std::min(it + listLength, bytesEnd);
+    while(it < listEnd) {
+        auto property = static_cast<MQTTProperty>(*it++);
+        if(property == MQTTProperty::MESSAGE_EXPIRY_INTERVAL && it + 4 <= listEnd) {
+            // the value has a fixed size, so it can be replaced in place
+            uint32_t value = htonl(interval);
+            memcpy(bytes.data() + (it - bytes.data()), &value, sizeof(value));
+            return fromPublishBytes(bytes.data(), bytes.size());
         }
-        return 4;
-    case Type::Invalid:
-        assert(0);
-        break;
+        it += getPropertyValueLength(property, it, listEnd);
     }
-    assert(0);
-    return 0;
+    return *this;
 }
 }
\ No newline at end of file
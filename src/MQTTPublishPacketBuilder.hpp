@@ -1,13 +1,23 @@
 #pragma once
 
 #include "nioev/lib/Util.hpp"
+#include "IOVecBuilder.hpp"
 #include "Subscriber.hpp"
 #include <array>
 #include <functional>
+#include <memory>
 namespace nioev::mqtt {
 using namespace nioev::lib;
 
 
+// A segment that is sent after the end of an EncodedPacket and references memory owned by someone else (e.g. a MappedPayload).
+// The owner is kept alive as long as the packet exists.
+struct ExternalSegment {
+    std::shared_ptr<const void> owner;
+    const uint8_t* data{nullptr};
+    size_t size{0};
+};
+
 class EncodedPacket {
     enum class Type {
         Invalid,
@@ -35,38 +45,79 @@ public:
         ret.mPreludeLength = varLength.valueLength + 1;
         return ret;
     }
-    static EncodedPacket fromComponents(uint8_t firstByte, SharedBuffer middle, uint16_t packetId, SharedBuffer end) {
+    static EncodedPacket fromComponents(uint8_t firstByte, SharedBuffer middle, uint16_t packetId, SharedBuffer end, ExternalSegment external = {}) {
         EncodedPacket ret;
         ret.mType = Type::Full;
-        auto varLength = encodeVarByteInt(end.size() + middle.size() + 2);
+        auto varLength = encodeVarByteInt(end.size() + middle.size() + 2 + external.size);
         ret.mMiddle = std::move(middle);
         ret.mPrelude.firstByte = firstByte;
         memcpy(ret.mPrelude.varLength, varLength.value, varLength.valueLength);
         ret.mPreludeLength = varLength.valueLength + 1;
         ret.mPacketId = htons(packetId);
         ret.mEnd = std::move(end);
+        ret.mExternal = std::move(external);
         return ret;
     }
-    static EncodedPacket fromComponents(uint8_t firstByte, SharedBuffer middle, SharedBuffer end) {
+    static EncodedPacket fromComponents(uint8_t firstByte, SharedBuffer middle, SharedBuffer end, ExternalSegment external = {}) {
         EncodedPacket ret;
         ret.mType = Type::SingleByteWithLenAndMiddleAndEnd;
-        auto varLength = encodeVarByteInt(end.size() + middle.size());
+        auto varLength = encodeVarByteInt(end.size() + middle.size() + external.size);
         ret.mMiddle = std::move(middle);
         ret.mPrelude.firstByte = firstByte;
         memcpy(ret.mPrelude.varLength, varLength.value, varLength.valueLength);
         ret.mPreludeLength = varLength.valueLength + 1;
         ret.mEnd = std::move(end);
+        ret.mExternal = std::move(external);
         return ret;
     }
+    // A PUBLISH whose property list is a separate segment between the packet id and the payload, so that it can be varied
+    // per receiver (e.g. for topic aliases) while the payload is still shared.
+    static EncodedPacket fromPublishComponents(uint8_t firstByte, SharedBuffer topic, std::optional<uint16_t> packetId, SharedBuffer properties, SharedBuffer payload, ExternalSegment external = {}) {
+        EncodedPacket ret;
+        ret.mType = packetId ? Type::Full : Type::SingleByteWithLenAndMiddleAndEnd;
+        auto varLength = encodeVarByteInt(topic.size() + (packetId ? 2 : 0) + properties.size() + payload.size() + external.size);
+        ret.mMiddle = std::move(topic);
+        ret.mPrelude.firstByte = firstByte;
+        memcpy(ret.mPrelude.varLength, varLength.value, varLength.valueLength);
+        ret.mPreludeLength = varLength.valueLength + 1;
+        if(packetId) {
+            ret.mPacketId = htons(*packetId);
+        }
+        ret.mProperties = std::move(properties);
+        ret.mEnd = std::move(payload);
+        ret.mExternal = std::move(external);
+        return ret;
+    }
+    // Parses a complete packet as written by appendTo, e.g. after reading it from disk
+    static EncodedPacket fromBytes(const uint8_t* data, size_t length);
+    // Same as above for a QoS 1/2 PUBLISH, but the packet id stays separate, so that it can be set later
+    static EncodedPacket fromPublishBytes(const uint8_t* data, size_t length);
+    // Returns a copy of an MQTT 5 QoS 1/2 PUBLISH with the value of its Message Expiry Interval replaced. Packets without that
+    // property are returned unchanged.
+    EncodedPacket withMessageExpiryInterval(uint32_t interval) const;
+    // only valid for packets that have a packet id
+    void setPacketId(uint16_t packetId) {
+        assert(mPacketId);
+        mPacketId = htons(packetId);
+    }
     void setDupFlag() {
         mPrelude.firstByte |= 0x08;
     }
-    size_t constructIOVecs(size_t offset, iovec* iovecs);
+    // Adds the segments that haven't been sent yet. Returns false if the builder ran out of iovecs before the whole packet was added.
+    bool constructIOVecs(size_t offset, IOVecBuilder& builder) const;
+    // Appends a copy of the whole packet
+    void appendTo(std::vector<uint8_t>& out) const;
 
     size_t fullSize() const {
-        return mPreludeLength + mMiddle.size() + (mPacketId.has_value() ? sizeof(uint16_t) : 0) + mEnd.size();
+        return mPreludeLength + mMiddle.size() + (mPacketId.has_value() ? sizeof(uint16_t) : 0) + mProperties.size() + mEnd.size() + mExternal.size;
     }
 private:
+    struct Segment {
+        const uint8_t* data;
+        size_t length;
+    };
+    size_t getSegments(std::array<Segment, 6>& segments) const;
+
     struct {
         uint8_t _padding[3];
         uint8_t firstByte{0};
@@ -75,7 +126,9 @@ private:
     uint32_t mPreludeLength{1};
     SharedBuffer mMiddle;
     std::optional<uint16_t> mPacketId;
+    SharedBuffer mProperties;
     SharedBuffer mEnd;
+    ExternalSegment mExternal;
     Type mType{Type::Invalid};
 };
 
@@ -99,14 +152,39 @@ class MQTTPublishPacketBuilder {
 public:
     // A reference to topic & payload is captured, so be cautious about lifetimes!
     MQTTPublishPacketBuilder(const std::string& topic, PayloadType payload, Retained retained, const PropertyList& properties);
+    // The payload isn't copied into the packets, but referenced directly. The owner keeps it alive until all packets are gone.
+    MQTTPublishPacketBuilder(const std::string& topic, PayloadType payload, std::shared_ptr<const void> payloadOwner, Retained retained, const PropertyList& properties);
     EncodedPacket getPacket(QoS qos, uint16_t packetId, MQTTVersion version);
+    // Same as above, but uses the given MQTT 5 topic alias. If sendTopic is false, the topic is left out and only the alias is sent.
+    EncodedPacket getPacketWithTopicAlias(QoS qos, uint16_t packetId, uint16_t topicAlias, bool sendTopic);
+    // The size of the packet returned by getPacketWithTopicAlias, without encoding it
+    size_t getPacketWithTopicAliasSize(QoS qos, bool sendTopic);
+    // MQTT 5 requires a publish to carry the identifiers of all matching subscriptions, but a PropertyList can only hold one of
+    // them. The others are set here and appended to the encoded properties. Call before getting any packets.
+    void setAdditionalSubscriptionIdentifiers(std::vector<uint32_t> identifiers) {
+        mAdditionalSubscriptionIdentifiers = std::move(identifiers);
+    }
 private:
+    void encodeProperties(BinaryEncoder& encoder, const PropertyList& properties) const;
+    // the value of the variable byte integer an encoded property list starts with
+    static uint32_t decodeListLength(const SharedBuffer& list, size_t& lengthBytes);
+    ExternalSegment getExternalPayload() const;
+    uint8_t getFirstByte(QoS qos) const;
+    const SharedBuffer& getMiddle();
+    const SharedBuffer& getPropertiesAndPayload();
+
     const std::string& mTopic;
     PayloadType mPayload;
     Retained mRetained;
     std::optional<SharedBuffer> mPacketMiddle;
     std::unordered_map<MQTTVersion, SharedBuffer> mPacketPostlude;
+    // used for packets with topic aliases: the encoded property list without its length, followed by the payload
+    std::optional<SharedBuffer> mPropertiesAndPayload;
+    uint32_t mPropertiesLength{0};
+    std::optional<SharedBuffer> mEmptyTopic;
     const PropertyList& mProperties;
+    std::vector<uint32_t> mAdditionalSubscriptionIdentifiers;
+    std::shared_ptr<const void> mPayloadOwner;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,37 @@
+#include "MappedPayload.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace nioev::mqtt {
+
+std::shared_ptr<const MappedPayload> MappedPayload::create(PayloadType payload) {
+    int fd = memfd_create("nioev-retained", MFD_CLOEXEC);
+    if(fd < 0) {
+        throwErrno("memfd_create()");
+    }
+    DestructWrapper closeFd{[fd] { ::close(fd); }};
+    if(ftruncate(fd, payload.size()) < 0) {
+        throwErrno("ftruncate()");
+    }
+    size_t written = 0;
+    while(written < payload.size()) {
+        auto result = ::pwrite(fd, payload.data() + written, payload.size() - written, written);
+        if(result < 0) {
+            if(errno == EINTR)
+                continue;
+            throwErrno("pwrite()");
+        }
+        written += result;
+    }
+    // the mapping keeps the file alive, so the fd can be closed right away
+    void* data = mmap(nullptr, payload.size(), PROT_READ, MAP_SHARED, fd, 0);
+    if(data == MAP_FAILED) {
+        throwErrno("mmap()");
+    }
+    return std::shared_ptr<const MappedPayload>{new MappedPayload{data, payload.size()}};
+}
+MappedPayload::~MappedPayload() {
+    munmap(mData, mSize);
+}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "nioev/lib/Util.hpp"
+#include <memory>
+
+namespace nioev::mqtt {
+using namespace nioev::lib;
+
+/* A read-only payload that lives in a memory-mapped anonymous file (memfd) instead of the heap. Used for large retained messages
+ * (firmware images, map tiles, ...), so that they can be swapped out by the kernel and referenced directly by outgoing packets
+ * without copying them into a new buffer for every subscriber.
+ */
+class MappedPayload final {
+public:
+    // throws on error
+    static std::shared_ptr<const MappedPayload> create(PayloadType payload);
+    ~MappedPayload();
+
+    MappedPayload(const MappedPayload&) = delete;
+    void operator=(const MappedPayload&) = delete;
+
+    [[nodiscard]] PayloadType getPayload() const {
+        return { static_cast<const uint8_t*>(mData), mSize };
+    }
+    [[nodiscard]] size_t size() const {
+        return mSize;
+    }
+
+private:
+    MappedPayload(void* data, size_t size)
+    : mData(data), mSize(size) {
+
+    }
+    void* mData;
+    size_t mSize;
+};
+
+}
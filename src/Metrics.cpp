@@ -0,0 +1,53 @@
+#include "Metrics.hpp"
+#include <array>
+#include <atomic>
+
+namespace nioev::mqtt::Metrics {
+
+namespace {
+
+constexpr size_t COUNTER_COUNT = static_cast<size_t>(Counter::$COUNT);
+constexpr size_t GAUGE_COUNT = static_cast<size_t>(Gauge::$COUNT);
+// more shards than threads that update metrics in a typical setup, so most threads get one for themselves
+constexpr size_t SHARD_COUNT = 32;
+
+// gauges are stored as the sum of their deltas, which wraps around correctly even if a single shard becomes "negative"
+struct alignas(64) Shard {
+    std::array<std::atomic<uint64_t>, COUNTER_COUNT + GAUGE_COUNT> values{};
+};
+std::array<Shard, SHARD_COUNT> gShards;
+std::atomic<uint32_t> gNextShard{0};
+
+static thread_local Shard* tShard = nullptr;
+
+std::atomic<uint64_t>& getValue(size_t index) {
+    if(!tShard) {
+        tShard = &gShards[gNextShard.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT];
+    }
+    return tShard->values[index];
+}
+uint64_t sum(size_t index) {
+    uint64_t ret = 0;
+    for(auto& shard: gShards) {
+        ret += shard.values[index].load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+}
+
+void add(Counter counter, uint64_t amount) {
+    getValue(static_cast<size_t>(counter)).fetch_add(amount, std::memory_order_relaxed);
+}
+void add(Gauge gauge, int64_t delta) {
+    getValue(COUNTER_COUNT + static_cast<size_t>(gauge)).fetch_add(static_cast<uint64_t>(delta), std::memory_order_relaxed);
+}
+
+uint64_t get(Counter counter) {
+    return sum(static_cast<size_t>(counter));
+}
+int64_t get(Gauge gauge) {
+    return static_cast<int64_t>(sum(COUNTER_COUNT + static_cast<size_t>(gauge)));
+}
+
+}
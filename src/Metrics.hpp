@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+namespace nioev::mqtt {
+
+// Monotonically increasing values
+enum class Counter : uint8_t {
+    CONNECTIONS_TOTAL,
+    MSGS_IN,  // PUBLISH packets received from clients
+    MSGS_OUT, // PUBLISH packets sent to clients
+    BYTES_IN,
+    BYTES_OUT,
+    DROPPED_MSGS, // messages that weren't delivered to a subscriber, e.g. because they expired or were too large
+    $COUNT
+};
+
+// Values that go up and down
+enum class Gauge : uint8_t {
+    CONNECTIONS,
+    SEND_QUEUE_PACKETS, // packets waiting in the send queues of all clients
+    RETAINED_MSGS,
+    RETAINED_BYTES,
+    $COUNT
+};
+
+/* Counters and gauges that are cheap enough to be updated on the hot path and can be read at any time without locking anything.
+ * Every value is split into cache-line aligned shards, each thread adds to the shard it was assigned to and reading sums up all
+ * shards. This avoids that all receiver threads bounce the same cache line on every message.
+ */
+namespace Metrics {
+
+void add(Counter counter, uint64_t amount = 1);
+void add(Gauge gauge, int64_t delta);
+
+uint64_t get(Counter counter);
+int64_t get(Gauge gauge);
+
+}
+
+}
@@ -0,0 +1,76 @@
+#include "OpenMetrics.hpp"
+#include "ApplicationState.hpp"
+#include "Metrics.hpp"
+#include "StageTimings.hpp"
+#include <spdlog/fmt/fmt.h>
+#include <iterator>
+
+namespace nioev::mqtt::OpenMetrics {
+
+namespace {
+
+class Writer {
+public:
+    void family(const char* name, const char* type, const char* help) {
+        fmt::format_to(std::back_inserter(mBuffer), "# TYPE {} {}\n# HELP {} {}\n", name, type, name, help);
+    }
+    template<typename T>
+    void sample(const char* name, T value) {
+        fmt::format_to(std::back_inserter(mBuffer), "{} {}\n", name, value);
+    }
+    void counter(const char* name, const char* help, Counter counter) {
+        family(name, "counter", help);
+        fmt::format_to(std::back_inserter(mBuffer), "{}_total {}\n", name, Metrics::get(counter));
+    }
+    template<typename T>
+    void gauge(const char* name, const char* help, T value) {
+        family(name, "gauge", help);
+        sample(name, value);
+    }
+    std::string finish() {
+        mBuffer += "# EOF\n";
+        return std::move(mBuffer);
+    }
+    std::string& buffer() {
+        return mBuffer;
+    }
+
+private:
+    std::string mBuffer;
+};
+
+}
+
+std::string render(ApplicationState& app) {
+    Writer writer;
+    writer.counter("nioev_connections", "Accepted TCP connections.", Counter::CONNECTIONS_TOTAL);
+    writer.gauge("nioev_connected_clients", "Currently open client connections.", Metrics::get(Gauge::CONNECTIONS));
+    writer.counter("nioev_messages_received", "PUBLISH packets received from clients.", Counter::MSGS_IN);
+    writer.counter("nioev_messages_sent", "PUBLISH packets sent to clients.", Counter::MSGS_OUT);
+    writer.counter("nioev_received_bytes", "Bytes received from clients.", Counter::BYTES_IN);
+    writer.counter("nioev_sent_bytes", "Bytes sent to clients.", Counter::BYTES_OUT);
+    writer.counter("nioev_dropped_messages", "Messages that weren't delivered because they expired or exceeded the maximum packet size of the receiver.", Counter::DROPPED_MSGS);
+    writer.gauge("nioev_send_queue_packets", "Packets waiting in the send queues of all clients.", Metrics::get(Gauge::SEND_QUEUE_PACKETS));
+    writer.gauge("nioev_worker_queue_depth", "Change requests waiting for the worker thread.", app.getCurrentWorkerThreadQueueDepth());
+    writer.gauge("nioev_retained_messages", "Stored retained messages.", Metrics::get(Gauge::RETAINED_MSGS));
+    writer.gauge("nioev_retained_bytes", "Size of all retained messages including their topics.", Metrics::get(Gauge::RETAINED_BYTES));
+
+    auto stageTimings = StageTimings::snapshot();
+    writer.family("nioev_publish_stage_latency_seconds", "summary", "Time spent in every stage of a publish since the start of the broker.");
+    auto& out = writer.buffer();
+    for(size_t i = 0; i < stageTimings.stages.size(); ++i) {
+        auto& histogram = stageTimings.stages[i];
+        auto stage = publishStageToString(static_cast<PublishStage>(i));
+        auto toSeconds = [&](double ticks) {
+            return ticks * stageTimings.nanosecondsPerTick / 1e9;
+        };
+        for(auto quantile: { 0.5, 0.9, 0.99, 0.999 }) {
+            fmt::format_to(std::back_inserter(out), "nioev_publish_stage_latency_seconds{{stage=\"{}\",quantile=\"{}\"}} {}\n", stage, quantile, toSeconds(histogram.percentile(quantile)));
+        }
+        fmt::format_to(std::back_inserter(out), "nioev_publish_stage_latency_seconds_count{{stage=\"{}\"}} {}\n", stage, histogram.getTotalCount());
+        fmt::format_to(std::back_inserter(out), "nioev_publish_stage_latency_seconds_sum{{stage=\"{}\"}} {}\n", stage, toSeconds(histogram.getMean() * histogram.getTotalCount()));
+    }
+    return writer.finish();
+}
+
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <string>
+#include "Forward.hpp"
+
+namespace nioev::mqtt::OpenMetrics {
+
+constexpr const char* CONTENT_TYPE = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+// Renders the counters and gauges of Metrics and the stage timings in the OpenMetrics text format. Only reads values that are
+// maintained all the time, so it doesn't trigger a statistical analysis.
+std::string render(ApplicationState& app);
+
+}
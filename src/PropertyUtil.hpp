@@ -0,0 +1,36 @@
+#pragma once
+
+#include "nioev/lib/Util.hpp"
+#include <ctime>
+#include <optional>
+#include <type_traits>
+#include <variant>
+
+namespace nioev::mqtt {
+using namespace nioev::lib;
+
+// Returns the value of an integer property (byte, two byte, four byte or variable byte integer), if it's present.
+inline std::optional<uint32_t> getIntegerProperty(const PropertyList& properties, MQTTProperty property) {
+    auto it = properties.find(property);
+    if(it == properties.end())
+        return {};
+    return std::visit(
+        [](const auto& value) -> std::optional<uint32_t> {
+            if constexpr(std::is_integral_v<std::decay_t<decltype(value)>>) {
+                return static_cast<uint32_t>(value);
+            } else {
+                return {};
+            }
+        },
+        it->second);
+}
+
+// Returns the point in time at which a message with the given properties expires, or 0 if it doesn't have a Message Expiry Interval.
+inline std::time_t getMessageExpiry(const PropertyList& properties, std::time_t now) {
+    auto interval = getIntegerProperty(properties, MQTTProperty::MESSAGE_EXPIRY_INTERVAL);
+    if(!interval)
+        return 0;
+    return now + *interval;
+}
+
+}
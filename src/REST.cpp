@@ -2,6 +2,7 @@
 #include "App.h"
 #include "ApplicationState.hpp"
 #include "HttpResponse.h"
+#include "OpenMetrics.hpp"
 #include "quickjs_h_embedded.hpp"
 #include "StatisticsConverter.hpp"
 #include <fstream>
@@ -290,6 +291,61 @@ void RESTAPI::run(ApplicationState& app) {
                     res->end(e.what(), true);
                 }
             })
+        .get(
+            "/clients/traffic",
+            [&app](uWS::HttpResponse<false>* res, uWS::HttpRequest* req) {
+                try {
+                    if(!ClientTraffic::isEnabled()) {
+                        res->writeStatus("404 Not Found");
+                        res->end("per-client-packet-counters is disabled", true);
+                        return;
+                    }
+                    auto sortBy = ClientTrafficSortKey::BYTES_OUT;
+                    auto sortStr = req->getQuery("sort");
+                    if(!sortStr.empty()) {
+                        auto parsed = clientTrafficSortKeyFromString(sortStr);
+                        if(!parsed) {
+                            res->writeStatus("400 Bad Request");
+                            res->end("Invalid sort (msgs_in, msgs_out, bytes_in, bytes_out, drops, queue_depth or last_activity allowed)", true);
+                            return;
+                        }
+                        sortBy = *parsed;
+                    }
+                    size_t offset = 0, limit = 100;
+                    try {
+                        std::string offsetStr{ req->getQuery("offset") };
+                        if(!offsetStr.empty())
+                            offset = std::stoul(offsetStr);
+                        std::string limitStr{ req->getQuery("limit") };
+                        if(!limitStr.empty())
+                            limit = std::min<size_t>(std::stoul(limitStr), 10000);
+                    } catch(std::exception&) {
+                        res->writeStatus("400 Bad Request");
+                        res->end("Invalid offset or limit", true);
+                        return;
+                    }
+                    auto entries = app.getClientTraffic();
+                    auto totalClientCount = entries.size();
+                    sortClientTrafficPage(entries, sortBy, offset, limit);
+                    res->end(StatisticsConverter::clientTrafficToJson(entries, totalClientCount), true);
+                } catch(std::exception& e) {
+                    res->writeStatus("500 Internal Server Error");
+                    res->end(e.what(), true);
+                }
+            })
+        .get(
+            "/metrics",
+            [&app](uWS::HttpResponse<false>* res, uWS::HttpRequest* req) {
+                try {
+                    // unlike /statistics this is cheap enough to be scraped frequently
+                    std::string body = OpenMetrics::render(app);
+                    res->writeHeader("Content-Type", OpenMetrics::CONTENT_TYPE);
+                    res->end(body, true);
+                } catch(std::exception& e) {
+                    res->writeStatus("500 Internal Server Error");
+                    res->end(e.what(), true);
+                }
+            })
         .get(
             "/*",
             [](uWS::HttpResponse<false>* res, uWS::HttpRequest* req) {
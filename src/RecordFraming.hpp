@@ -0,0 +1,147 @@
+#pragma once
+
+#include "nioev/lib/Util.hpp"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nioev::mqtt::records {
+using namespace nioev::lib;
+
+/* Helpers for the append-only files of the broker (session journal, write-ahead log). Every record starts with the length of its
+ * body and a checksum of it, so that a partially written record at the end of a file, e.g. after a crash, can be detected. Values
+ * are stored in host byte order, the files aren't meant to be moved between machines.
+ */
+constexpr size_t HEADER_SIZE = 2 * sizeof(uint32_t);
+
+inline uint32_t checksum(const uint8_t* data, size_t length) {
+    // FNV-1a, only used to detect torn writes
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+template<typename T>
+void put(std::vector<uint8_t>& out, T value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    auto offset = out.size();
+    out.resize(offset + sizeof(T));
+    memcpy(out.data() + offset, &value, sizeof(T));
+}
+inline void putBytes(std::vector<uint8_t>& out, const uint8_t* data, size_t length) {
+    put<uint32_t>(out, length);
+    out.insert(out.end(), data, data + length);
+}
+inline void putString(std::vector<uint8_t>& out, std::string_view str) {
+    putBytes(out, reinterpret_cast<const uint8_t*>(str.data()), str.size());
+}
+
+// Reserves space for the header of a new record and returns its start, which has to be passed to end() once the body is complete
+inline size_t begin(std::vector<uint8_t>& out) {
+    auto start = out.size();
+    out.resize(start + HEADER_SIZE);
+    return start;
+}
+inline void end(std::vector<uint8_t>& out, size_t start) {
+    uint32_t length = out.size() - start - HEADER_SIZE;
+    uint32_t sum = checksum(out.data() + start + HEADER_SIZE, length);
+    memcpy(out.data() + start, &length, sizeof(length));
+    memcpy(out.data() + start + sizeof(length), &sum, sizeof(sum));
+}
+
+// Calls callback(body, length) for every complete record, starting at offset. Returns the offset after the last complete record.
+template<typename T>
+size_t forEach(const std::vector<uint8_t>& data, size_t offset, T&& callback) {
+    while(data.size() - offset >= HEADER_SIZE) {
+        uint32_t length, sum;
+        memcpy(&length, data.data() + offset, sizeof(length));
+        memcpy(&sum, data.data() + offset + sizeof(length), sizeof(sum));
+        auto body = data.data() + offset + HEADER_SIZE;
+        if(data.size() - offset - HEADER_SIZE < length || checksum(body, length) != sum) {
+            break;
+        }
+        callback(body, length);
+        offset += HEADER_SIZE + length;
+    }
+    return offset;
+}
+
+class Decoder {
+public:
+    Decoder(const uint8_t* data, size_t size)
+    : mData(data), mSize(size) {
+
+    }
+    template<typename T>
+    T get() {
+        T value;
+        memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+    std::pair<const uint8_t*, size_t> getBytes() {
+        auto length = get<uint32_t>();
+        return {take(length), length};
+    }
+    std::string getString() {
+        auto [data, length] = getBytes();
+        return std::string{reinterpret_cast<const char*>(data), length};
+    }
+
+private:
+    const uint8_t* take(size_t length) {
+        if(mSize - mOffset < length) {
+            throw std::runtime_error{"Record too short"};
+        }
+        auto ret = mData + mOffset;
+        mOffset += length;
+        return ret;
+    }
+    const uint8_t* mData;
+    size_t mSize;
+    size_t mOffset{0};
+};
+
+inline void writeAll(int fd, const uint8_t* data, size_t length) {
+    size_t written = 0;
+    while(written < length) {
+        auto result = ::write(fd, data + written, length - written);
+        if(result < 0) {
+            if(errno == EINTR)
+                continue;
+            throwErrno("write()");
+        }
+        written += result;
+    }
+}
+inline std::vector<uint8_t> readAll(int fd) {
+    struct stat info = { 0 };
+    if(fstat(fd, &info) < 0) {
+        throwErrno("fstat()");
+    }
+    std::vector<uint8_t> data(info.st_size);
+    size_t readBytes = 0;
+    while(readBytes < data.size()) {
+        auto result = ::pread(fd, data.data() + readBytes, data.size() - readBytes, readBytes);
+        if(result < 0) {
+            if(errno == EINTR)
+                continue;
+            throwErrno("pread()");
+        }
+        if(result == 0)
+            break;
+        readBytes += result;
+    }
+    data.resize(readBytes);
+    return data;
+}
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "MQTTPublishPacketBuilder.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
+#include <span>
+#include <vector>
+
+namespace nioev::mqtt {
+
+/* Ring buffer of packets waiting to be sent to a client. Finished packets are popped from the front in O(1), so draining a deep
+ * backlog piece by piece on EPOLLOUT doesn't degrade into O(n²) like erasing from the front of a vector did. The queued packets
+ * are exposed as (at most) two contiguous spans for iovec construction.
+ */
+class SendQueue final {
+public:
+    SendQueue() = default;
+    SendQueue(const SendQueue&) = delete;
+    void operator=(const SendQueue&) = delete;
+    ~SendQueue() {
+        if(mSize > 0) {
+            Metrics::add(Gauge::SEND_QUEUE_PACKETS, -static_cast<int64_t>(mSize));
+        }
+    }
+
+    void push(InTransitEncodedPacket&& packet) {
+        if(mSize == mBuffer.size()) {
+            grow();
+        }
+        mBuffer[(mHead + mSize) & (mBuffer.size() - 1)] = std::move(packet);
+        mSize += 1;
+        Metrics::add(Gauge::SEND_QUEUE_PACKETS, 1);
+    }
+    // pops all packets from the front that have been sent completely
+    void popDone() {
+        size_t popped = 0;
+        while(mSize > 0 && mBuffer[mHead].isDone()) {
+            // release the shared buffers right away
+            mBuffer[mHead] = InTransitEncodedPacket{};
+            mHead = (mHead + 1) & (mBuffer.size() - 1);
+            mSize -= 1;
+            popped += 1;
+        }
+        if(mSize == 0) {
+            mHead = 0;
+        }
+        if(popped > 0) {
+            Metrics::add(Gauge::SEND_QUEUE_PACKETS, -static_cast<int64_t>(popped));
+        }
+    }
+    [[nodiscard]] bool empty() const {
+        return mSize == 0;
+    }
+    [[nodiscard]] size_t size() const {
+        return mSize;
+    }
+    // the packets starting at the front up to the end of the buffer
+    [[nodiscard]] std::span<InTransitEncodedPacket> firstSpan() {
+        if(mSize == 0)
+            return {};
+        return { mBuffer.data() + mHead, std::min(mSize, mBuffer.size() - mHead) };
+    }
+    // the packets that wrapped around to the start of the buffer
+    [[nodiscard]] std::span<InTransitEncodedPacket> secondSpan() {
+        auto firstSize = std::min(mSize, mBuffer.size() - mHead);
+        return { mBuffer.data(), mSize - firstSize };
+    }
+
+private:
+    void grow() {
+        std::vector<InTransitEncodedPacket> newBuffer(mBuffer.empty() ? 16 : mBuffer.size() * 2);
+        for(size_t i = 0; i < mSize; ++i) {
+            newBuffer[i] = std::move(mBuffer[(mHead + i) & (mBuffer.size() - 1)]);
+        }
+        mBuffer = std::move(newBuffer);
+        mHead = 0;
+    }
+
+    // size is always zero or a power of two
+    std::vector<InTransitEncodedPacket> mBuffer;
+    size_t mHead{0};
+    size_t mSize{0};
+};
+
+}
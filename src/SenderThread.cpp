@@ -0,0 +1,44 @@
+#include "SenderThread.hpp"
+#include "MQTTClientConnection.hpp"
+
+namespace nioev::mqtt {
+
+SenderThread::SenderThread(size_t id) {
+    mThread = std::thread{[this, id] {
+        std::string threadName = "S-" + std::to_string(id);
+        pthread_setname_np(pthread_self(), threadName.c_str());
+        threadFunc();
+    }};
+}
+SenderThread::~SenderThread() {
+    mShouldRun = false;
+    mWakeupCounter += 1;
+    mWakeupCounter.notify_one();
+    mThread.join();
+}
+void SenderThread::scheduleFlush(MQTTClientConnection& client) {
+    // the reference keeps the client alive until we've flushed it
+    client.incTaskQueueRefCount();
+    if(!mQueue.try_push(&client)) {
+        // we are way behind, so just send inline instead of blocking the caller
+        client.flushSendTasks();
+        client.decTaskQueueRefCount();
+        return;
+    }
+    mWakeupCounter += 1;
+    mWakeupCounter.notify_one();
+}
+void SenderThread::threadFunc() {
+    while(mShouldRun) {
+        auto counter = mWakeupCounter.load();
+        MQTTClientConnection* client = nullptr;
+        while(mQueue.try_pop(client)) {
+            client->flushSendTasks();
+            client->decTaskQueueRefCount();
+        }
+        // if something was pushed after we drained the queue, the counter has changed and we don't sleep
+        mWakeupCounter.wait(counter);
+    }
+}
+
+}
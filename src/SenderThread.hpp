@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Forward.hpp"
+#include <atomic_queue/atomic_queue.h>
+#include <atomic>
+#include <thread>
+
+namespace nioev::mqtt {
+
+/* Optional writer stage: Instead of calling sendmsg inline while fanning out a publish, clients just queue their packets and get
+ * scheduled on one of these threads, which then flushes all queued packets of a client with a single sendScatter call. A client is
+ * always scheduled on the same thread, so the order of packets is kept.
+ */
+class SenderThread final {
+public:
+    explicit SenderThread(size_t id);
+    ~SenderThread();
+    SenderThread(const SenderThread&) = delete;
+    void operator=(const SenderThread&) = delete;
+
+    void scheduleFlush(MQTTClientConnection& client);
+private:
+    void threadFunc();
+
+    atomic_queue::AtomicQueueB2<MQTTClientConnection*> mQueue{64 * 1024};
+    // incremented on every push, the thread sleeps on this using atomic wait
+    std::atomic<uint32_t> mWakeupCounter{0};
+    std::atomic<bool> mShouldRun{true};
+    std::thread mThread;
+};
+
+}
@@ -0,0 +1,435 @@
+#include "SessionJournal.hpp"
+#include "RecordFraming.hpp"
+#include <spdlog/spdlog.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace nioev::mqtt {
+
+namespace {
+
+// File layout: an 8 byte magic, followed by records as described in RecordFraming.hpp
+constexpr char FILE_MAGIC[8] = { 'N', 'I', 'O', 'E', 'V', 'S', 'J', '1' };
+constexpr size_t WRITE_THRESHOLD = 64 * 1024;
+
+enum class RecordType : uint8_t {
+    SessionCreated = 1,
+    SessionDeleted,
+    Subscribed,
+    Unsubscribed,
+    PacketStored,
+    PacketAcknowledged,
+    PubRecReceived,
+    QoS2Receiving,
+    PacketQueued,
+    QueuedPacketReleased,
+    QueuedPacketDropped
+};
+
+using records::put;
+using records::putString;
+
+size_t beginRecord(std::vector<uint8_t>& out, RecordType type, const std::string& clientId) {
+    auto start = records::begin(out);
+    put(out, type);
+    putString(out, clientId);
+    return start;
+}
+void endRecord(std::vector<uint8_t>& out, size_t start) {
+    records::end(out, start);
+}
+
+void encodeSessionCreated(std::vector<uint8_t>& out, const std::string& clientId) {
+    endRecord(out, beginRecord(out, RecordType::SessionCreated, clientId));
+}
+void encodeSessionDeleted(std::vector<uint8_t>& out, const std::string& clientId) {
+    endRecord(out, beginRecord(out, RecordType::SessionDeleted, clientId));
+}
+void encodeSubscribed(std::vector<uint8_t>& out, const std::string& clientId, const std::string& topic, QoS qos, const SubscriptionOptions& options) {
+    auto start = beginRecord(out, RecordType::Subscribed, clientId);
+    putString(out, topic);
+    put<uint8_t>(out, static_cast<uint8_t>(qos));
+    put<uint8_t>(out, options.noLocal);
+    put<uint8_t>(out, options.retainAsPublished);
+    put<uint8_t>(out, options.retainHandling);
+    put<uint32_t>(out, options.subscriptionIdentifier);
+    endRecord(out, start);
+}
+void encodeUnsubscribed(std::vector<uint8_t>& out, const std::string& clientId, const std::string& topic) {
+    auto start = beginRecord(out, RecordType::Unsubscribed, clientId);
+    putString(out, topic);
+    endRecord(out, start);
+}
+void encodePacketStored(std::vector<uint8_t>& out, const std::string& clientId, uint16_t packetId, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet) {
+    auto start = beginRecord(out, RecordType::PacketStored, clientId);
+    put<uint16_t>(out, packetId);
+    put<uint8_t>(out, static_cast<uint8_t>(qos));
+    put<uint8_t>(out, static_cast<uint8_t>(version));
+    put<int64_t>(out, expiresAt);
+    put<uint32_t>(out, packet.fullSize());
+    packet.appendTo(out);
+    endRecord(out, start);
+}
+void encodePacketQueued(std::vector<uint8_t>& out, const std::string& clientId, uint64_t queueNumber, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet) {
+    auto start = beginRecord(out, RecordType::PacketQueued, clientId);
+    put<uint64_t>(out, queueNumber);
+    put<uint8_t>(out, static_cast<uint8_t>(qos));
+    put<uint8_t>(out, static_cast<uint8_t>(version));
+    put<int64_t>(out, expiresAt);
+    put<uint32_t>(out, packet.fullSize());
+    packet.appendTo(out);
+    endRecord(out, start);
+}
+void encodeQueuedPacketReleased(std::vector<uint8_t>& out, const std::string& clientId, uint64_t queueNumber, uint16_t packetId) {
+    auto start = beginRecord(out, RecordType::QueuedPacketReleased, clientId);
+    put<uint64_t>(out, queueNumber);
+    put<uint16_t>(out, packetId);
+    endRecord(out, start);
+}
+void encodeQueuedPacketDropped(std::vector<uint8_t>& out, const std::string& clientId, uint64_t queueNumber) {
+    auto start = beginRecord(out, RecordType::QueuedPacketDropped, clientId);
+    put<uint64_t>(out, queueNumber);
+    endRecord(out, start);
+}
+void encodePacketAcknowledged(std::vector<uint8_t>& out, const std::string& clientId, uint16_t packetId) {
+    auto start = beginRecord(out, RecordType::PacketAcknowledged, clientId);
+    put<uint16_t>(out, packetId);
+    endRecord(out, start);
+}
+void encodePacketIdFlag(std::vector<uint8_t>& out, RecordType type, const std::string& clientId, uint16_t packetId, bool value) {
+    auto start = beginRecord(out, type, clientId);
+    put<uint16_t>(out, packetId);
+    put<uint8_t>(out, value);
+    endRecord(out, start);
+}
+
+void applyRecord(std::unordered_map<std::string, SessionJournal::RestoredSession>& sessions, records::Decoder& decoder, uint64_t sequence) {
+    auto type = decoder.get<RecordType>();
+    auto clientId = decoder.getString();
+    if(type == RecordType::SessionCreated) {
+        sessions.insert_or_assign(std::move(clientId), SessionJournal::RestoredSession{});
+        return;
+    }
+    auto session = sessions.find(clientId);
+    if(session == sessions.end()) {
+        // belongs to a session that was deleted in the meantime
+        return;
+    }
+    auto& state = session->second;
+    switch(type) {
+    case RecordType::SessionDeleted:
+        sessions.erase(session);
+        break;
+    case RecordType::Subscribed: {
+        auto topic = decoder.getString();
+        SessionJournal::RestoredSubscription sub;
+        sub.qos = static_cast<QoS>(decoder.get<uint8_t>());
+        sub.options.noLocal = decoder.get<uint8_t>();
+        sub.options.retainAsPublished = decoder.get<uint8_t>();
+        sub.options.retainHandling = decoder.get<uint8_t>();
+        sub.options.subscriptionIdentifier = decoder.get<uint32_t>();
+        state.subscriptions.insert_or_assign(std::move(topic), sub);
+        break;
+    }
+    case RecordType::Unsubscribed:
+        state.subscriptions.erase(decoder.getString());
+        break;
+    case RecordType::PacketStored: {
+        auto packetId = decoder.get<uint16_t>();
+        auto qos = static_cast<QoS>(decoder.get<uint8_t>());
+        auto version = static_cast<MQTTVersion>(decoder.get<uint8_t>());
+        std::time_t expiresAt = decoder.get<int64_t>();
+        auto [packet, packetLength] = decoder.getBytes();
+        state.inFlightPackets.insert_or_assign(packetId, SessionJournal::RestoredPacket{qos, version, expiresAt, EncodedPacket::fromBytes(packet, packetLength), sequence});
+        break;
+    }
+    case RecordType::PacketAcknowledged:
+        state.inFlightPackets.erase(decoder.get<uint16_t>());
+        break;
+    case RecordType::PacketQueued: {
+        auto queueNumber = decoder.get<uint64_t>();
+        auto qos = static_cast<QoS>(decoder.get<uint8_t>());
+        auto version = static_cast<MQTTVersion>(decoder.get<uint8_t>());
+        std::time_t expiresAt = decoder.get<int64_t>();
+        auto [packet, packetLength] = decoder.getBytes();
+        state.queuedPackets.insert_or_assign(queueNumber, SessionJournal::RestoredPacket{qos, version, expiresAt, EncodedPacket::fromPublishBytes(packet, packetLength), sequence});
+        break;
+    }
+    case RecordType::QueuedPacketReleased: {
+        auto queued = state.queuedPackets.find(decoder.get<uint64_t>());
+        auto packetId = decoder.get<uint16_t>();
+        // missing if the packet was released before the last compaction already
+        if(queued == state.queuedPackets.end())
+            break;
+        queued->second.packet.setPacketId(packetId);
+        state.inFlightPackets.insert_or_assign(packetId, std::move(queued->second));
+        state.queuedPackets.erase(queued);
+        break;
+    }
+    case RecordType::QueuedPacketDropped:
+        state.queuedPackets.erase(decoder.get<uint64_t>());
+        break;
+    case RecordType::PubRecReceived:
+    case RecordType::QoS2Receiving: {
+        auto& ids = type == RecordType::PubRecReceived ? state.pubRecReceived : state.qos2ReceivingPacketIds;
+        auto packetId = decoder.get<uint16_t>();
+        if(decoder.get<uint8_t>()) {
+            ids.emplace(packetId);
+        } else {
+            ids.erase(packetId);
+        }
+        break;
+    }
+    default:
+        throw std::runtime_error{"Unknown record type " + std::to_string(static_cast<int>(type))};
+    }
+}
+
+
+}
+
+SessionJournal::SessionJournal(std::string path, size_t compactionThreshold)
+: mPath(std::move(path)), mCompactionThreshold(compactionThreshold) {
+    openForAppending();
+}
+SessionJournal::~SessionJournal() {
+    flush();
+    if(mFd >= 0) {
+        ::close(mFd);
+    }
+}
+void SessionJournal::openForAppending() {
+    mFd = ::open(mPath.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(mFd < 0) {
+        throwErrno("open(" + mPath + ")");
+    }
+}
+
+std::unordered_map<std::string, SessionJournal::RestoredSession> SessionJournal::restore() {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto data = records::readAll(mFd);
+
+    std::unordered_map<std::string, RestoredSession> sessions;
+    if(data.size() < sizeof(FILE_MAGIC) || memcmp(data.data(), FILE_MAGIC, sizeof(FILE_MAGIC)) != 0) {
+        if(!data.empty()) {
+            spdlog::error("{} isn't a session journal, starting without persisted sessions", mPath);
+        }
+        if(ftruncate(mFd, 0) < 0) {
+            throwErrno("ftruncate()");
+        }
+        records::writeAll(mFd, reinterpret_cast<const uint8_t*>(FILE_MAGIC), sizeof(FILE_MAGIC));
+        mCompactedSize = sizeof(FILE_MAGIC);
+        return sessions;
+    }
+    size_t recordCount = 0;
+    auto offset = records::forEach(data, sizeof(FILE_MAGIC), [&](const uint8_t* body, size_t length) {
+        try {
+            records::Decoder decoder{body, length};
+            applyRecord(sessions, decoder, recordCount);
+        } catch(std::exception& e) {
+            spdlog::warn("Skipping invalid session journal record: {}", e.what());
+        }
+        recordCount += 1;
+    });
+    if(offset != data.size()) {
+        spdlog::warn("Cutting off {} bytes of incomplete records at the end of {}", data.size() - offset, mPath);
+        if(ftruncate(mFd, offset) < 0) {
+            throwErrno("ftruncate()");
+        }
+    }
+    mCompactedSize = offset;
+    spdlog::info("Restored {} sessions from {} journal records", sessions.size(), recordCount);
+    return sessions;
+}
+
+void SessionJournal::sessionCreated(const std::string& clientId) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodeSessionCreated(mBuffer, clientId);
+    recordAppended(start);
+}
+void SessionJournal::sessionDeleted(const std::string& clientId) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodeSessionDeleted(mBuffer, clientId);
+    recordAppended(start);
+}
+void SessionJournal::subscribed(const std::string& clientId, const std::string& topic, QoS qos, const SubscriptionOptions& options) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodeSubscribed(mBuffer, clientId, topic, qos, options);
+    recordAppended(start);
+}
+void SessionJournal::unsubscribed(const std::string& clientId, const std::string& topic) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodeUnsubscribed(mBuffer, clientId, topic);
+    recordAppended(start);
+}
+void SessionJournal::packetStored(const std::string& clientId, uint16_t packetId, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodePacketStored(mBuffer, clientId, packetId, qos, version, expiresAt, packet);
+    recordAppended(start);
+}
+void SessionJournal::packetAcknowledged(const std::string& clientId, uint16_t packetId) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodePacketAcknowledged(mBuffer, clientId, packetId);
+    recordAppended(start);
+}
+void SessionJournal::packetQueued(const std::string& clientId, uint64_t queueNumber, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodePacketQueued(mBuffer, clientId, queueNumber, qos, version, expiresAt, packet);
+    recordAppended(start);
+}
+void SessionJournal::queuedPacketReleased(const std::string& clientId, uint64_t queueNumber, uint16_t packetId) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodeQueuedPacketReleased(mBuffer, clientId, queueNumber, packetId);
+    recordAppended(start);
+}
+void SessionJournal::queuedPacketDropped(const std::string& clientId, uint64_t queueNumber) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodeQueuedPacketDropped(mBuffer, clientId, queueNumber);
+    recordAppended(start);
+}
+void SessionJournal::pubRecReceived(const std::string& clientId, uint16_t packetId, bool received) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodePacketIdFlag(mBuffer, RecordType::PubRecReceived, clientId, packetId, received);
+    recordAppended(start);
+}
+void SessionJournal::qos2Receiving(const std::string& clientId, uint16_t packetId, bool receiving) {
+    std::unique_lock<std::mutex> lock{mMutex};
+    auto start = mBuffer.size();
+    encodePacketIdFlag(mBuffer, RecordType::QoS2Receiving, clientId, packetId, receiving);
+    recordAppended(start);
+}
+void SessionJournal::recordAppended(size_t start) {
+    auto length = mBuffer.size() - start;
+    mBytesSinceCompaction += length;
+    if(mCompacting) {
+        mRecordsDuringCompaction.insert(mRecordsDuringCompaction.end(), mBuffer.begin() + start, mBuffer.end());
+    }
+    if(mBuffer.size() >= WRITE_THRESHOLD) {
+        flushLocked();
+    }
+}
+
+void SessionJournal::flush() {
+    std::unique_lock<std::mutex> lock{mMutex};
+    flushLocked();
+}
+void SessionJournal::sync() {
+    std::unique_lock<std::mutex> lock{mMutex};
+    flushLocked();
+    if(fdatasync(mFd) < 0) {
+        spdlog::error("Failed to sync session journal: {}", errnoToString());
+    }
+}
+void SessionJournal::flushLocked() {
+    if(mBuffer.empty())
+        return;
+    try {
+        records::writeAll(mFd, mBuffer.data(), mBuffer.size());
+    } catch(std::exception& e) {
+        // the state in memory is still correct, so keep running; only a restart would lose the changes
+        spdlog::error("Failed to write session journal: {}", e.what());
+    }
+    mBuffer.clear();
+}
+
+bool SessionJournal::needsCompaction() const {
+    std::unique_lock<std::mutex> lock{mMutex};
+    return mBytesSinceCompaction >= std::max(mCompactionThreshold, mCompactedSize);
+}
+
+void SessionJournal::compact(const std::function<void(Snapshot&)>& writeSnapshot) {
+    {
+        std::unique_lock<std::mutex> lock{mMutex};
+        flushLocked();
+        mCompacting = true;
+        mRecordsDuringCompaction.clear();
+    }
+    auto tmpPath = mPath + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    try {
+        if(fd < 0) {
+            throwErrno("open(" + tmpPath + ")");
+        }
+        Snapshot snapshot{fd};
+        writeSnapshot(snapshot);
+
+        std::unique_lock<std::mutex> lock{mMutex};
+        // everything that was appended since the compaction started goes after the snapshot
+        snapshot.mBuffer.insert(snapshot.mBuffer.end(), mRecordsDuringCompaction.begin(), mRecordsDuringCompaction.end());
+        records::writeAll(fd, snapshot.mBuffer.data(), snapshot.mBuffer.size());
+        snapshot.mBytesWritten += snapshot.mBuffer.size();
+        if(fsync(fd) < 0) {
+            throwErrno("fsync()");
+        }
+        if(rename(tmpPath.c_str(), mPath.c_str()) < 0) {
+            throwErrno("rename()");
+        }
+        ::close(fd);
+        ::close(mFd);
+        openForAppending();
+        // the unwritten records are already part of the new file
+        mBuffer.clear();
+        mCompactedSize = snapshot.mBytesWritten;
+        mBytesSinceCompaction = 0;
+        mCompacting = false;
+        mRecordsDuringCompaction = {};
+        spdlog::info("Compacted session journal to {} bytes", mCompactedSize);
+    } catch(...) {
+        if(fd >= 0) {
+            ::close(fd);
+            unlink(tmpPath.c_str());
+        }
+        std::unique_lock<std::mutex> lock{mMutex};
+        mCompacting = false;
+        mRecordsDuringCompaction = {};
+        throw;
+    }
+}
+
+SessionJournal::Snapshot::Snapshot(int fd)
+: mFd(fd) {
+    mBuffer.insert(mBuffer.end(), FILE_MAGIC, FILE_MAGIC + sizeof(FILE_MAGIC));
+}
+void SessionJournal::Snapshot::writeIfFull() {
+    if(mBuffer.size() < WRITE_THRESHOLD)
+        return;
+    records::writeAll(mFd, mBuffer.data(), mBuffer.size());
+    mBytesWritten += mBuffer.size();
+    mBuffer.clear();
+}
+void SessionJournal::Snapshot::sessionCreated(const std::string& clientId) {
+    encodeSessionCreated(mBuffer, clientId);
+    writeIfFull();
+}
+void SessionJournal::Snapshot::subscribed(const std::string& clientId, const std::string& topic, QoS qos, const SubscriptionOptions& options) {
+    encodeSubscribed(mBuffer, clientId, topic, qos, options);
+    writeIfFull();
+}
+void SessionJournal::Snapshot::packetStored(const std::string& clientId, uint16_t packetId, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet) {
+    encodePacketStored(mBuffer, clientId, packetId, qos, version, expiresAt, packet);
+    writeIfFull();
+}
+void SessionJournal::Snapshot::packetQueued(const std::string& clientId, uint64_t queueNumber, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet) {
+    encodePacketQueued(mBuffer, clientId, queueNumber, qos, version, expiresAt, packet);
+    writeIfFull();
+}
+void SessionJournal::Snapshot::pubRecReceived(const std::string& clientId, uint16_t packetId, bool received) {
+    encodePacketIdFlag(mBuffer, RecordType::PubRecReceived, clientId, packetId, received);
+    writeIfFull();
+}
+void SessionJournal::Snapshot::qos2Receiving(const std::string& clientId, uint16_t packetId, bool receiving) {
+    encodePacketIdFlag(mBuffer, RecordType::QoS2Receiving, clientId, packetId, receiving);
+    writeIfFull();
+}
+
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "MQTTPublishPacketBuilder.hpp"
+#include "Subscriber.hpp"
+#include <ctime>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nioev::mqtt {
+
+/* Append-only journal of the state of persistent sessions (CleanSession::No): their subscriptions, in-flight QoS 1/2 packets, the
+ * QoS 1/2 packets that are held back by the receive maximum and the QoS 2 packet id state. Held back packets are identified by a
+ * queue number until they are released and get a packet id. It's replayed on startup, so that sessions survive broker restarts without clients having to resubscribe.
+ *
+ * Every record sets a single piece of state to a new value (or removes it), so applying a record a second time or after a snapshot
+ * that already contains its effect doesn't change the result. This allows compacting the journal while other threads keep appending.
+ * Records are buffered and written by flush(), which is called periodically, so a crash loses the changes since the last flush.
+ * Thread safe.
+ */
+class SessionJournal final {
+public:
+    struct RestoredSubscription {
+        QoS qos{QoS::QoS0};
+        SubscriptionOptions options;
+    };
+    struct RestoredPacket {
+        QoS qos{QoS::QoS1};
+        MQTTVersion version{MQTTVersion::V4};
+        std::time_t expiresAt{0};
+        EncodedPacket packet;
+        // position in the journal, i.e. the order in which the packets were stored
+        uint64_t sequence{0};
+    };
+    struct RestoredSession {
+        std::unordered_map<std::string, RestoredSubscription> subscriptions;
+        std::map<uint16_t, RestoredPacket> inFlightPackets;
+        // keyed by queue number, i.e. in the order in which they are released
+        std::map<uint64_t, RestoredPacket> queuedPackets;
+        std::set<uint16_t> pubRecReceived;
+        std::set<uint16_t> qos2ReceivingPacketIds;
+    };
+
+    // Writes the complete state of all sessions into a new journal file during compaction
+    class Snapshot final {
+    public:
+        void sessionCreated(const std::string& clientId);
+        void subscribed(const std::string& clientId, const std::string& topic, QoS qos, const SubscriptionOptions& options);
+        void packetStored(const std::string& clientId, uint16_t packetId, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet);
+        void packetQueued(const std::string& clientId, uint64_t queueNumber, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet);
+        void pubRecReceived(const std::string& clientId, uint16_t packetId, bool received);
+        void qos2Receiving(const std::string& clientId, uint16_t packetId, bool receiving);
+
+    private:
+        friend class SessionJournal;
+        explicit Snapshot(int fd);
+        void writeIfFull();
+        int mFd{-1};
+        size_t mBytesWritten{0};
+        std::vector<uint8_t> mBuffer;
+    };
+
+    SessionJournal(std::string path, size_t compactionThreshold);
+    ~SessionJournal();
+    SessionJournal(const SessionJournal&) = delete;
+    SessionJournal& operator=(const SessionJournal&) = delete;
+
+    // Reads the whole journal, call once on startup before appending anything. A torn record at the end, e.g. from a crash
+    // during a write, is cut off.
+    std::unordered_map<std::string, RestoredSession> restore();
+
+    void sessionCreated(const std::string& clientId);
+    void sessionDeleted(const std::string& clientId);
+    void subscribed(const std::string& clientId, const std::string& topic, QoS qos, const SubscriptionOptions& options);
+    void unsubscribed(const std::string& clientId, const std::string& topic);
+    void packetStored(const std::string& clientId, uint16_t packetId, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet);
+    void packetAcknowledged(const std::string& clientId, uint16_t packetId);
+    // A held back packet is added with a packet id of 0; once released, it becomes an in-flight packet with the given id
+    void packetQueued(const std::string& clientId, uint64_t queueNumber, QoS qos, MQTTVersion version, std::time_t expiresAt, const EncodedPacket& packet);
+    void queuedPacketReleased(const std::string& clientId, uint64_t queueNumber, uint16_t packetId);
+    void queuedPacketDropped(const std::string& clientId, uint64_t queueNumber);
+    void pubRecReceived(const std::string& clientId, uint16_t packetId, bool received);
+    void qos2Receiving(const std::string& clientId, uint16_t packetId, bool receiving);
+
+    void flush();
+    // Flushes and waits until everything is on disk
+    void sync();
+
+    // True if the journal grew so much since the last compaction that it's worth rewriting it
+    bool needsCompaction() const;
+    // Replaces the journal with a snapshot of the current state. writeSnapshot has to write every session into the snapshot;
+    // records appended concurrently are added after it.
+    void compact(const std::function<void(Snapshot&)>& writeSnapshot);
+
+private:
+    // called after a record was encoded into mBuffer at the given offset
+    void recordAppended(size_t start);
+    void flushLocked();
+    void openForAppending();
+
+    std::string mPath;
+    size_t mCompactionThreshold;
+    int mFd{-1};
+    mutable std::mutex mMutex;
+    std::vector<uint8_t> mBuffer;
+    // size of the file after the last compaction and the amount of bytes appended since then
+    size_t mCompactedSize{0};
+    size_t mBytesSinceCompaction{0};
+    // records that were appended while a compaction is running; they are added to the new file once the snapshot is complete
+    bool mCompacting{false};
+    std::vector<uint8_t> mRecordsDuringCompaction;
+};
+
+}
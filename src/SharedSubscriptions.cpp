@@ -0,0 +1,107 @@
+#include "SharedSubscriptions.hpp"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace nioev::mqtt {
+
+size_t RoundRobinStrategy::pickMember(const std::vector<Subscription>& members, const std::string&, std::atomic<size_t>& counter) const {
+    return counter.fetch_add(1, std::memory_order_relaxed) % members.size();
+}
+
+size_t LeastInFlightStrategy::pickMember(const std::vector<Subscription>& members, const std::string&, std::atomic<size_t>& counter) const {
+    auto start = counter.fetch_add(1, std::memory_order_relaxed);
+    size_t best = start % members.size();
+    size_t bestInFlight = std::numeric_limits<size_t>::max();
+    for(size_t i = 0; i < members.size(); ++i) {
+        auto index = (start + i) % members.size();
+        auto inFlight = members[index].subscriber->getInFlightCount();
+        if(inFlight < bestInFlight) {
+            best = index;
+            bestInFlight = inFlight;
+            if(inFlight == 0)
+                break;
+        }
+    }
+    return best;
+}
+
+size_t StickyHashStrategy::pickMember(const std::vector<Subscription>& members, const std::string& topic, std::atomic<size_t>&) const {
+    return std::hash<std::string>()(topic) % members.size();
+}
+
+std::unique_ptr<LoadBalancingStrategy> makeLoadBalancingStrategy(std::string_view name) {
+    if(name == "round-robin")
+        return std::make_unique<RoundRobinStrategy>();
+    if(name == "least-inflight")
+        return std::make_unique<LeastInFlightStrategy>();
+    if(name == "sticky-hash")
+        return std::make_unique<StickyHashStrategy>();
+    return nullptr;
+}
+
+SharedSubscriptions::SharedSubscriptions(std::unique_ptr<LoadBalancingStrategy> strategy)
+: mStrategy(std::move(strategy)) {
+
+}
+std::optional<SharedSubscriptions::ParsedTopic> SharedSubscriptions::parse(std::string_view topic) {
+    constexpr std::string_view prefix = "$share/";
+    if(!topic.starts_with(prefix))
+        return {};
+    topic.remove_prefix(prefix.size());
+    auto slash = topic.find('/');
+    if(slash == std::string_view::npos || slash == 0 || slash + 1 >= topic.size()) {
+        throw std::runtime_error{"Shared subscription needs a share name and a topic filter"};
+    }
+    auto shareName = topic.substr(0, slash);
+    if(shareName.find_first_of("+#") != std::string_view::npos) {
+        throw std::runtime_error{"Share name mustn't contain wildcards"};
+    }
+    return ParsedTopic{ shareName, topic.substr(slash + 1) };
+}
+void SharedSubscriptions::subscribe(const ParsedTopic& topic, Subscription sub) {
+    std::string key{topic.shareName};
+    key += '/';
+    key += topic.filter;
+    auto it = mGroups.find(key);
+    if(it == mGroups.end()) {
+        auto group = std::make_unique<SharedSubscriptionGroup>();
+        group->filter = std::string{topic.filter};
+        mTree.addSubscription(group->filter, SharedSubscriptionGroupRef{group.get()});
+        it = mGroups.emplace(std::move(key), std::move(group)).first;
+    }
+    auto& members = it->second->members;
+    auto existing = std::find(members.begin(), members.end(), sub);
+    if(existing != members.end()) {
+        // resubscribing only updates the QoS
+        *existing = sub;
+    } else {
+        members.emplace_back(sub);
+    }
+}
+void SharedSubscriptions::unsubscribe(const ParsedTopic& topic, Subscriber* sub) {
+    std::string key{topic.shareName};
+    key += '/';
+    key += topic.filter;
+    auto it = mGroups.find(key);
+    if(it == mGroups.end())
+        return;
+    removeMember(it, sub);
+}
+void SharedSubscriptions::unsubscribeFromAll(Subscriber* sub) {
+    for(auto it = mGroups.begin(); it != mGroups.end();) {
+        auto next = std::next(it);
+        removeMember(it, sub);
+        it = next;
+    }
+}
+void SharedSubscriptions::removeMember(std::unordered_map<std::string, std::unique_ptr<SharedSubscriptionGroup>>::iterator group, Subscriber* sub) {
+    auto& members = group->second->members;
+    members.erase(std::remove(members.begin(), members.end(), Subscription{sub, QoS::QoS0}), members.end());
+    if(members.empty()) {
+        mTree.removeSubscription(group->second->filter, SharedSubscriptionGroupRef{group->second.get()});
+        mGroups.erase(group);
+    }
+}
+
+}
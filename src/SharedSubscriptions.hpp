@@ -0,0 +1,108 @@
+#pragma once
+
+#include "Subscriber.hpp"
+#include "nioev/lib/SubscriptionTree.hpp"
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace nioev::mqtt {
+
+// Decides which member of a shared subscription group receives a message. Called concurrently from multiple publishing threads.
+class LoadBalancingStrategy {
+public:
+    virtual ~LoadBalancingStrategy() = default;
+    // members is never empty
+    virtual size_t pickMember(const std::vector<Subscription>& members, const std::string& topic, std::atomic<size_t>& counter) const = 0;
+};
+
+class RoundRobinStrategy final : public LoadBalancingStrategy {
+public:
+    size_t pickMember(const std::vector<Subscription>& members, const std::string& topic, std::atomic<size_t>& counter) const override;
+};
+
+// Picks the member with the fewest unacknowledged messages; ties are broken in a round-robin fashion.
+class LeastInFlightStrategy final : public LoadBalancingStrategy {
+public:
+    size_t pickMember(const std::vector<Subscription>& members, const std::string& topic, std::atomic<size_t>& counter) const override;
+};
+
+// Messages on the same topic always go to the same member, as long as the group doesn't change.
+class StickyHashStrategy final : public LoadBalancingStrategy {
+public:
+    size_t pickMember(const std::vector<Subscription>& members, const std::string& topic, std::atomic<size_t>& counter) const override;
+};
+
+// returns nullptr if the name is unknown
+std::unique_ptr<LoadBalancingStrategy> makeLoadBalancingStrategy(std::string_view name);
+
+struct SharedSubscriptionGroup {
+    std::string filter;
+    std::vector<Subscription> members;
+    std::atomic<size_t> counter{0};
+};
+struct SharedSubscriptionGroupRef {
+    SharedSubscriptionGroup* group{nullptr};
+    bool operator==(const SharedSubscriptionGroupRef& other) const {
+        return group == other.group;
+    }
+};
+
+}
+
+namespace std {
+template<>
+struct hash<nioev::mqtt::SharedSubscriptionGroupRef> {
+    size_t operator()(const nioev::mqtt::SharedSubscriptionGroupRef& ref) const {
+        return std::hash<void*>()(ref.group);
+    }
+};
+}
+
+namespace nioev::mqtt {
+
+/* MQTT 5 shared subscriptions ($share/{ShareName}/{filter}). Every message that matches the filter of a group is delivered to
+ * exactly one member of that group. Modifications need an exclusive lock of the application state, forEveryMatch only a shared one.
+ */
+class SharedSubscriptions final {
+public:
+    explicit SharedSubscriptions(std::unique_ptr<LoadBalancingStrategy> strategy);
+
+    struct ParsedTopic {
+        std::string_view shareName;
+        std::string_view filter;
+    };
+    // Returns nullopt if the topic isn't a shared subscription. Throws if it starts with $share/ but is malformed.
+    static std::optional<ParsedTopic> parse(std::string_view topic);
+
+    void subscribe(const ParsedTopic& topic, Subscription sub);
+    void unsubscribe(const ParsedTopic& topic, Subscriber* sub);
+    void unsubscribeFromAll(Subscriber* sub);
+
+    // Calls the callback once for every matching group with the member that should receive the message.
+    template<typename T>
+    void forEveryMatch(const std::string& topic, T&& callback) {
+        if(mGroups.empty())
+            return;
+        mTree.forEveryMatch(topic, [&](SharedSubscriptionGroupRef& ref) {
+            auto& members = ref.group->members;
+            if(members.empty())
+                return;
+            callback(members[mStrategy->pickMember(members, topic, ref.group->counter)]);
+        });
+    }
+
+private:
+    void removeMember(std::unordered_map<std::string, std::unique_ptr<SharedSubscriptionGroup>>::iterator group, Subscriber* sub);
+
+    std::unique_ptr<LoadBalancingStrategy> mStrategy;
+    // key is "{ShareName}/{filter}"
+    std::unordered_map<std::string, std::unique_ptr<SharedSubscriptionGroup>> mGroups;
+    SubscriptionTree<SharedSubscriptionGroupRef> mTree;
+};
+
+}
@@ -0,0 +1,123 @@
+#include "StageTimings.hpp"
+#include "GlobalConfig.hpp"
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <vector>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+namespace nioev::mqtt::StageTimings {
+
+namespace {
+
+uint64_t readClock() {
+#if defined(__x86_64__)
+    // all CPUs of the last decade have an invariant TSC, which ticks at a constant rate on every core
+    return __rdtsc();
+#else
+    timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+#endif
+}
+
+// the rate of the TSC is determined by comparing it to the steady clock over the whole runtime
+struct ClockOrigin {
+    uint64_t ticks;
+    std::chrono::steady_clock::time_point time;
+};
+const ClockOrigin gClockOrigin{readClock(), std::chrono::steady_clock::now()};
+
+double nanosecondsPerTick() {
+#if defined(__x86_64__)
+    auto ticks = readClock() - gClockOrigin.ticks;
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - gClockOrigin.time).count();
+    if(ticks == 0 || nanoseconds <= 0)
+        return 1.0;
+    return static_cast<double>(nanoseconds) / static_cast<double>(ticks);
+#else
+    return 1.0;
+#endif
+}
+
+struct ThreadHistograms {
+    std::array<ConcurrentLatencyHistogram, static_cast<size_t>(PublishStage::$COUNT)> stages;
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<ThreadHistograms*> threads;
+    // values of threads that already exited
+    std::array<LatencyHistogram, static_cast<size_t>(PublishStage::$COUNT)> exited;
+};
+Registry& getRegistry() {
+    // never destroyed, as threads may still exit after static destruction started
+    static auto registry = new Registry;
+    return *registry;
+}
+
+// moves the histograms of the thread into the registry when it exits
+struct ThreadRegistration {
+    std::unique_ptr<ThreadHistograms> histograms;
+
+    ThreadRegistration() {
+        histograms = std::make_unique<ThreadHistograms>();
+        auto& registry = getRegistry();
+        std::unique_lock<std::mutex> lock{registry.mutex};
+        registry.threads.emplace_back(histograms.get());
+    }
+    ~ThreadRegistration() {
+        auto& registry = getRegistry();
+        std::unique_lock<std::mutex> lock{registry.mutex};
+        for(size_t i = 0; i < histograms->stages.size(); ++i) {
+            histograms->stages[i].snapshotInto(registry.exited[i]);
+        }
+        std::erase(registry.threads, histograms.get());
+    }
+};
+
+// the plain pointer avoids the initialization check of a thread_local object on every access
+static thread_local ThreadHistograms* tHistograms = nullptr;
+
+ThreadHistograms& getThreadHistograms() {
+    if(!tHistograms) {
+        static thread_local ThreadRegistration tRegistration;
+        tHistograms = tRegistration.histograms.get();
+    }
+    return *tHistograms;
+}
+
+}
+
+uint64_t now() {
+    if(!getGlobalConfig().stageTimings)
+        return 0;
+    return readClock();
+}
+void recordSince(PublishStage stage, uint64_t start) {
+    if(start == 0)
+        return;
+    auto end = readClock();
+    // the TSCs of different sockets may be slightly apart, so guard against going back in time after a migration
+    getThreadHistograms().stages[static_cast<size_t>(stage)].record(end > start ? end - start : 0);
+}
+
+Snapshot snapshot() {
+    Snapshot ret;
+    auto& registry = getRegistry();
+    std::unique_lock<std::mutex> lock{registry.mutex};
+    ret.stages = registry.exited;
+    for(auto thread: registry.threads) {
+        for(size_t i = 0; i < thread->stages.size(); ++i) {
+            thread->stages[i].snapshotInto(ret.stages[i]);
+        }
+    }
+    lock.unlock();
+    ret.nanosecondsPerTick = nanosecondsPerTick();
+    return ret;
+}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "LatencyHistogram.hpp"
+#include <array>
+#include <cstdint>
+
+namespace nioev::mqtt {
+
+// The stages a published message passes through, in order
+enum class PublishStage : uint8_t {
+    RECV,    // recv() syscall that read (part of) the packet
+    PARSE,   // decoding the PUBLISH packet and preparing its acknowledgement
+    MATCH,   // finding the subscribers, excluding the time spent delivering to them
+    ENCODE,  // building the packet for a single subscriber
+    ENQUEUE, // handing the packet to the send queue or socket of a subscriber, including waiting for its send mutex
+    SEND,    // sendmsg() syscall
+    $COUNT
+};
+
+inline const char* publishStageToString(PublishStage stage) {
+    switch(stage) {
+    case PublishStage::RECV:
+        return "recv";
+    case PublishStage::PARSE:
+        return "parse";
+    case PublishStage::MATCH:
+        return "match";
+    case PublishStage::ENCODE:
+        return "encode";
+    case PublishStage::ENQUEUE:
+        return "enqueue";
+    case PublishStage::SEND:
+        return "send";
+    case PublishStage::$COUNT:
+        break;
+    }
+    return "unknown";
+}
+
+/* Measures how long the stages of a publish take, so that latency can be broken down by stage. Timestamps are taken from the
+ * TSC on x86-64 (a few nanoseconds per call) and from CLOCK_MONOTONIC elsewhere. Every thread records into its own histograms,
+ * which can be read at any time without blocking the recording threads.
+ *
+ *     auto start = StageTimings::now();
+ *     doWork();
+ *     StageTimings::recordSince(PublishStage::PARSE, start);
+ */
+namespace StageTimings {
+
+// Current timestamp in clock ticks, or 0 if stage timings are disabled
+uint64_t now();
+// Records the time passed since start, which has to be a value returned by now(); does nothing if start is 0
+void recordSince(PublishStage stage, uint64_t start);
+
+struct Snapshot {
+    // in clock ticks
+    std::array<LatencyHistogram, static_cast<size_t>(PublishStage::$COUNT)> stages;
+    double nanosecondsPerTick{1.0};
+};
+// Merges the histograms of all threads, including the ones that already exited
+Snapshot snapshot();
+
+}
+
+}
@@ -2,12 +2,41 @@
 #include "ApplicationState.hpp"
 #include "MQTTPublishPacketBuilder.hpp"
 #include "StatisticsConverter.hpp"
+#include "GlobalConfig.hpp"
 #include "nioev/lib/Timers.hpp"
+#include <algorithm>
 
 namespace nioev::mqtt {
 
+namespace {
+// the statistics only have a resolution of one second, so the coarse clock is sufficient and much cheaper
+std::time_t coarseNow() {
+    timespec ts = { 0 };
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+}
+// the topic that the per-topic statistics are kept for
+std::string aggregateTopic(const std::string& topic, uint32_t prefixLevels) {
+    if(prefixLevels == 0)
+        return topic;
+    size_t position = 0;
+    for(uint32_t level = 0; level < prefixLevels; ++level) {
+        position = topic.find('/', position);
+        if(position == std::string::npos)
+            return topic;
+        position += 1;
+    }
+    return topic.substr(0, position) + "#";
+}
+// Every distinct topic keeps its id forever, so the amount of ids is limited. The messages on topics beyond that are counted for
+// the topic "#". Threads forget their cached ids when they've got too many, the ids themselves stay valid.
+constexpr size_t MAX_INTERNED_TOPICS = 100000;
+constexpr size_t MAX_CACHED_TOPIC_IDS = 100000;
+const std::string OVERFLOW_TOPIC = "#";
+}
+
 Statistics::Statistics(ApplicationState& app)
-: mApp(app) {
+: mApp(app), mTopTopics(getGlobalConfig().statisticsTopTopics) {
     mBatchAnalysisTimer.addPeriodicTask(std::chrono::seconds(1), [this] {
         std::unique_lock<std::shared_mutex> lock{mMutex};
         refreshInternal();
@@ -16,16 +45,12 @@ Statistics::Statistics(ApplicationState& app)
         auto currentSleepLevel = mApp.getCurrentWorkerThreadSleepLevel();
         {
             std::unique_lock<std::shared_mutex> lock{mMutex};
-            auto nowRounded = std::chrono::floor<std::chrono::minutes>(std::chrono::system_clock::now());
-            ensureEnoughSpace<std::chrono::minutes, 60>(mSleepLevelSampleCounts, nowRounded);
-            mSleepLevelSampleCounts.back().samples.at(static_cast<int>(currentSleepLevel)) += 1;
+            mSleepLevelSampleCounts.get(std::chrono::system_clock::now())->samples.at(static_cast<int>(currentSleepLevel)) += 1;
         }
     });
     mStartTime = std::chrono::steady_clock::now();
 }
 void Statistics::init() {
-    mApp.requestChange(ChangeRequestSubscribe{this, "", QoS::QoS2, SubscriptionType::OMNI});
-
     // TODO move ui logic to nioev-scripting?
     mApp.publishAsync(MQTTPacket{"nioev/ui/services/mqtt", stringToBuffer("{}"), QoS::QoS2, Retain::Yes});
     mApp.publishAsync(MQTTPacket{"nioev/ui/services/mqtt/Stats", stringToBuffer(R"({"type": "list", "orientation": "vertical"})"), QoS::QoS2, Retain::Yes});
@@ -36,72 +61,198 @@ void Statistics::init() {
     mApp.publishAsync(MQTTPacket{"nioev/ui/services/mqtt/Stats/05_grid/02_msg_per_minute", stringToBuffer(R"({"type": "graph", "headline": "Messages per Minute"})"), QoS::QoS2, Retain::Yes});
     refresh();
 }
-void Statistics::publish(const std::string& topic, PayloadType payload, QoS qos, Retained retained, const PropertyList& properties, MQTTPublishPacketBuilder& packetBuilder) {
-    // TODO remove system clock syscall somehow?
-    PacketData packet{topic, payload.size(), std::chrono::system_clock::now(), qos};
-    push(mCollectedData, std::move(packet));
-    mTotalPacketCountCounter++;
+void Statistics::record(const std::string& topic, size_t payloadLength, QoS qos) {
+    auto& buffer = getThreadBuffer();
+    auto now = coarseNow();
+    // swapped out, so that the analysis can't take it over while it's modified
+    std::unique_ptr<StatisticsBatch> batch{buffer.current.exchange(nullptr, std::memory_order_acquire)};
+    if(batch && batch->second != now) {
+        buffer.handOff(std::move(batch));
+    }
+    if(!batch) {
+        batch = std::make_unique<StatisticsBatch>();
+        batch->second = now;
+        buffer.lastCounts = nullptr;
+    }
+    batch->packetCount += 1;
+    batch->cummulativePacketSize += payloadLength;
+    if(!buffer.lastTopic || buffer.lastTopic->first != topic) {
+        buffer.lastTopic = &internTopic(buffer, topic);
+        buffer.lastCounts = nullptr;
+    }
+    if(!buffer.lastCounts) {
+        buffer.lastCounts = &batch->topics[buffer.lastTopic->second];
+    }
+    auto& counts = *buffer.lastCounts;
+    counts.packetCount += 1;
+    counts.cummulativePacketSize += payloadLength;
+    counts.qosPacketCounts[static_cast<uint8_t>(qos)] += 1;
+    buffer.current.store(batch.release(), std::memory_order_release);
 }
-void Statistics::push(atomic_queue::AtomicQueueB2<PacketData>& queue, PacketData&& packet) {
-    while(!queue.try_push(std::move(packet))) {
-        PacketData poppedPacket;
-        // pop 10 packets at once to increase the success rate of pushing
-        for(int i = 0; i < 10; ++i) {
-            if(!queue.try_pop(poppedPacket))
-                break;
+std::pair<const std::string, uint32_t>& Statistics::internTopic(ThreadBuffer& buffer, const std::string& topic) {
+    auto cached = buffer.topicIds.find(topic);
+    if(cached != buffer.topicIds.end())
+        return *cached;
+    if(buffer.topicIds.size() >= MAX_CACHED_TOPIC_IDS) {
+        buffer.topicIds.clear();
+    }
+    auto aggregated = aggregateTopic(topic, getGlobalConfig().statisticsTopicPrefixLevels);
+    std::optional<uint32_t> id;
+    {
+        std::shared_lock<std::shared_mutex> lock{mTopicIdsMutex};
+        auto it = mTopicIds.find(aggregated);
+        if(it != mTopicIds.end()) {
+            id = it->second;
+        }
+    }
+    if(!id) {
+        std::unique_lock<std::shared_mutex> lock{mTopicIdsMutex};
+        if(mTopicNames.size() >= MAX_INTERNED_TOPICS) {
+            aggregated = OVERFLOW_TOPIC;
+        }
+        auto [it, inserted] = mTopicIds.emplace(std::move(aggregated), mTopicNames.size());
+        if(inserted) {
+            mTopicNames.emplace_back(it->first);
         }
+        id = it->second;
     }
+    return *buffer.topicIds.emplace(topic, *id).first;
 }
-void Statistics::refreshInternal() {
-    Stopwatch stopwatch{"Statistical analysis"};
-    {
-        PacketData packet;
-        while(mCollectedData.try_pop(packet)) {
-            mAnalysisData.emplace_back(std::move(packet));
+void Statistics::ThreadBuffer::handOff(std::unique_ptr<StatisticsBatch> batch) {
+    std::unique_lock<std::mutex> lock{mutex};
+    completed.emplace_back(std::move(*batch));
+}
+Statistics::ThreadBuffer& Statistics::getThreadBuffer() {
+    // hands over the last batch and marks the buffer as exited when the thread ends, so that the analysis can release it after
+    // collecting its last batches
+    struct Registration {
+        std::shared_ptr<ThreadBuffer> buffer;
+        ~Registration() {
+            if(!buffer)
+                return;
+            std::unique_ptr<StatisticsBatch> batch{buffer->current.exchange(nullptr, std::memory_order_acquire)};
+            if(batch) {
+                buffer->handOff(std::move(batch));
+            }
+            std::unique_lock<std::mutex> lock{buffer->mutex};
+            buffer->exited = true;
         }
+    };
+    static thread_local Registration tRegistration;
+    static thread_local Statistics* tOwner = nullptr;
+    if(tOwner != this) {
+        auto buffer = std::make_shared<ThreadBuffer>();
+        {
+            std::unique_lock<std::mutex> lock{mThreadBuffersMutex};
+            mThreadBuffers.emplace_back(buffer);
+        }
+        tRegistration.buffer = std::move(buffer);
+        tOwner = this;
+    }
+    return *tRegistration.buffer;
+}
+std::vector<StatisticsBatch> Statistics::collectBatches() {
+    std::vector<StatisticsBatch> batches;
+    auto now = coarseNow();
+    std::unique_lock<std::mutex> lock{mThreadBuffersMutex};
+    for(auto& buffer: mThreadBuffers) {
+        // take over the batch of a thread that didn't publish since its second ended
+        std::unique_ptr<StatisticsBatch> current{buffer->current.exchange(nullptr, std::memory_order_acquire)};
+        if(current && current->second >= now) {
+            // still in use, so it's given back, unless the thread started a new batch in the meantime
+            StatisticsBatch* expected = nullptr;
+            if(buffer->current.compare_exchange_strong(expected, current.get(), std::memory_order_release)) {
+                current.release();
+            }
+        }
+        if(current) {
+            batches.emplace_back(std::move(*current));
+        }
+        std::unique_lock<std::mutex> bufferLock{buffer->mutex};
+        std::move(buffer->completed.begin(), buffer->completed.end(), std::back_inserter(batches));
+        buffer->completed.clear();
     }
+    std::erase_if(mThreadBuffers, [](const std::shared_ptr<ThreadBuffer>& buffer) {
+        std::unique_lock<std::mutex> bufferLock{buffer->mutex};
+        return buffer->exited && buffer->completed.empty();
+    });
+    lock.unlock();
+    // the histograms expect the batches in chronological order
+    std::stable_sort(batches.begin(), batches.end(), [](const StatisticsBatch& a, const StatisticsBatch& b) {
+        return a.second < b.second;
+    });
+    return batches;
+}
+void Statistics::refreshInternal() {
+    Stopwatch stopwatch{"Statistical analysis"};
+    auto batches = collectBatches();
 
     mAnalysisResult.sleepLevelSampleCounts = mSleepLevelSampleCounts;
     mAnalysisResult.appStateQueueDepth = mApp.getCurrentWorkerThreadQueueDepth();
+    auto loginAdmissionStats = mApp.getLoginAdmissionStats();
+    mAnalysisResult.pendingLoginCount = loginAdmissionStats.pendingLogins;
+    mAnalysisResult.deferredLoginCount = loginAdmissionStats.deferredLogins;
+    mAnalysisResult.deferredLoginsTotal = loginAdmissionStats.deferredLoginsTotal;
     mAnalysisResult.currentSleepLevel = mApp.getCurrentWorkerThreadSleepLevel();
-    mAnalysisResult.totalPacketCount = mTotalPacketCountCounter;
     mAnalysisResult.retainedMsgCount = mApp.getRetainedMsgCount();
     mAnalysisResult.retainedMsgCummulativeSize = mApp.getRetainedMsgCummulativeSize();
     mAnalysisResult.activeSubscriptions = mApp.getSubscriptionsCount();
     mAnalysisResult.uptimeSeconds = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - mStartTime).count();
+    refreshStageLatencies();
 
     mAnalysisResult.clients.clear();
     mApp.forEachClient([&](const std::string& clientId, const std::string& hostname = {}, uint16_t port = 0) {
        mAnalysisResult.clients.emplace_back(AnalysisResults::ClientInfo{clientId, hostname, port});
     });
 
-    for(auto& packet: mAnalysisData) {
-        auto it = mAnalysisResult.topics.find(packet.topic);
-        if(it == mAnalysisResult.topics.end()) {
-            auto inserted = mAnalysisResult.topics.emplace(std::piecewise_construct, std::make_tuple(std::move(packet.topic)), std::make_tuple());
-            assert(inserted.second);
-            it = inserted.first;
+    auto currentMinute = std::chrono::floor<std::chrono::minutes>(std::chrono::system_clock::now());
+    if(currentMinute != mTopTopicsDecayMinute) {
+        mTopTopics.decay();
+        mTopTopicsDecayMinute = currentMinute;
+    }
+    // new ids are only added with the exclusive lock, so the names stay valid while it is held
+    std::shared_lock<std::shared_mutex> topicIdsLock{mTopicIdsMutex};
+    for(auto& batch: batches) {
+        auto timestamp = std::chrono::system_clock::from_time_t(batch.second);
+        mAnalysisResult.totalPacketCount += batch.packetCount;
+        for(auto& [topicId, counts]: batch.topics) {
+            auto& topic = mTopicNames.at(topicId);
+            if(auto evicted = mTopTopics.add(topic, counts.packetCount)) {
+                mAnalysisResult.topics.erase(*evicted);
+            }
+            auto it = mAnalysisResult.topics.find(topic);
+            if(it == mAnalysisResult.topics.end()) {
+                it = mAnalysisResult.topics.emplace(topic, TimeSeries<AnalysisResults::TopicInfo, std::chrono::minutes, 60>{}).first;
+            }
+            auto info = it->second.get(timestamp);
+            if(!info)
+                continue;
+            info->cummulativePacketSize += counts.cummulativePacketSize;
+            info->packetCount += counts.packetCount;
+            for(size_t i = 0; i < counts.qosPacketCounts.size(); ++i) {
+                info->qosPacketCounts[i] += counts.qosPacketCounts[i];
+            }
         }
-        auto nowRounded = std::chrono::floor<std::chrono::minutes>(std::chrono::system_clock::now());
-        ensureEnoughSpace<std::chrono::minutes, 60>(it->second, nowRounded);
-        it->second.back().cummulativePacketSize += packet.payloadLength;
-        it->second.back().packetCount += 1;
-        it->second.back().qosPacketCounts[static_cast<uint8_t>(packet.qos)] += 1;
     }
+    topicIdsLock.unlock();
     for(auto it = mAnalysisResult.topics.begin(); it != mAnalysisResult.topics.end();) {
-        if(!it->second.empty() && (it->second.begin()->timestamp + std::chrono::minutes(65)) < std::chrono::system_clock::now()) {
+        // drop topics that didn't get a message for as long as their buckets reach back
+        if(!it->second.empty() && (it->second.back().timestamp + std::chrono::minutes(60)) < std::chrono::system_clock::now()) {
+            mTopTopics.erase(it->first);
             it = mAnalysisResult.topics.erase(it);
         } else {
             it++;
         }
     }
+    mAnalysisResult.topTopics.clear();
+    for(auto& entry: mTopTopics.getSorted()) {
+        mAnalysisResult.topTopics.emplace_back(AnalysisResults::TopTopic{std::move(entry.key), entry.count, entry.error});
+    }
 
-    createHistogram<std::chrono::minutes, 60 * 24>(mAnalysisResult.packetsPerMinute);
-    ensureEnoughSpace<std::chrono::minutes, 60 * 24>(mAnalysisResult.packetsPerMinute, std::chrono::floor<std::chrono::minutes>(std::chrono::system_clock::now()) - std::chrono::minutes(1));
-    createHistogram<std::chrono::seconds, 60 * 2>(mAnalysisResult.packetsPerSecond);
-    ensureEnoughSpace<std::chrono::seconds , 60 * 2>(mAnalysisResult.packetsPerSecond, std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now()) - std::chrono::seconds(1));
-
-    mAnalysisData.clear();
+    createHistogram(mAnalysisResult.packetsPerMinute, batches);
+    mAnalysisResult.packetsPerMinute.advanceTo(std::chrono::system_clock::now() - std::chrono::minutes(1));
+    createHistogram(mAnalysisResult.packetsPerSecond, batches);
+    mAnalysisResult.packetsPerSecond.advanceTo(std::chrono::system_clock::now() - std::chrono::seconds(1));
 
     mApp.publishAsync(MQTTPacket{"$NIOEV/stats", stringToBuffer(StatisticsConverter::statsToJson(mAnalysisResult)), QoS::QoS2, Retain::Yes});
     mApp.publishAsync(MQTTPacket{"nioev/ui/services/mqtt/Stats/05_grid/01_msg_per_second/data", stringToBuffer(StatisticsConverter::statsToMsgPerSecondJsonWebUI(mAnalysisResult)), QoS::QoS2, Retain::Yes});
@@ -136,6 +287,39 @@ void Statistics::refreshInternal() {
     }
     mApp.publishAsync(MQTTPacket{"nioev/ui/services/mqtt/Stats/05_grid/05_clients", stringToBuffer(R"({"type": "items", "headline": "Clients", "lines": )" + StatisticsConverter::stringListToJSON(rows) + "}"), QoS::QoS2, Retain::Yes});
 }
+static AnalysisResults::StageLatency summarizeStageLatency(const LatencyHistogram& histogram, double nanosecondsPerTick) {
+    auto toMicroseconds = [&](double ticks) {
+        return ticks * nanosecondsPerTick / 1000.0;
+    };
+    AnalysisResults::StageLatency ret;
+    ret.count = histogram.getTotalCount();
+    ret.p50 = toMicroseconds(histogram.percentile(0.5));
+    ret.p90 = toMicroseconds(histogram.percentile(0.9));
+    ret.p99 = toMicroseconds(histogram.percentile(0.99));
+    ret.p999 = toMicroseconds(histogram.percentile(0.999));
+    ret.max = toMicroseconds(histogram.getMax());
+    ret.mean = toMicroseconds(histogram.getMean());
+    return ret;
+}
+void Statistics::refreshStageLatencies() {
+    auto snapshot = StageTimings::snapshot();
+    for(size_t i = 0; i < snapshot.stages.size(); ++i) {
+        mAnalysisResult.stageLatencies[i] = summarizeStageLatency(snapshot.stages[i], snapshot.nanosecondsPerTick);
+    }
+    auto currentMinute = std::chrono::floor<std::chrono::minutes>(std::chrono::system_clock::now());
+    if(currentMinute == mStageTimingsMinuteStart)
+        return;
+    // the first minute after the start isn't complete, so it isn't reported
+    if(mStageTimingsMinuteStart.time_since_epoch().count() != 0) {
+        for(size_t i = 0; i < snapshot.stages.size(); ++i) {
+            auto lastMinute = snapshot.stages[i];
+            lastMinute.subtract(mStageTimingsAtMinuteStart.stages[i]);
+            mAnalysisResult.stageLatenciesLastMinute[i] = summarizeStageLatency(lastMinute, snapshot.nanosecondsPerTick);
+        }
+    }
+    mStageTimingsAtMinuteStart = std::move(snapshot);
+    mStageTimingsMinuteStart = currentMinute;
+}
 AnalysisResults Statistics::getResults() {
     std::unique_lock<std::shared_mutex> lock{mMutex};
     refreshInternal();
@@ -1,17 +1,32 @@
 #pragma once
 
 #include "Subscriber.hpp"
+#include "HeavyHitters.hpp"
+#include "StageTimings.hpp"
+#include "TimeSeries.hpp"
 #include "nioev/lib/Timers.hpp"
-#include "atomic_queue/atomic_queue.h"
+#include <atomic>
+#include <ctime>
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
+#include <unordered_map>
 
 namespace nioev::mqtt {
 
-struct PacketData {
-    std::string topic;
-    size_t payloadLength{0};
-    std::chrono::system_clock::time_point timestamp;
-    QoS qos{QoS::QoS0};
+// Messages published on a single topic within one second
+struct TopicCounts {
+    uint64_t packetCount{0};
+    uint64_t cummulativePacketSize{0};
+    std::array<uint64_t, 3> qosPacketCounts{0, 0, 0};
+};
+struct StatisticsBatch {
+    std::time_t second{0};
+    // keyed by the interned id of the topic, see Statistics::internTopic
+    std::unordered_map<uint32_t, TopicCounts> topics;
+    // sums of all topics
+    uint64_t packetCount{0};
+    uint64_t cummulativePacketSize{0};
 };
 
 struct SleepLevelSampleCounts {
@@ -29,9 +44,21 @@ struct AnalysisResults {
         std::array<uint64_t, 3> qosPacketCounts{0, 0, 0};
         std::chrono::system_clock::time_point timestamp;
     };
-    std::unordered_map<std::string, std::vector<TopicInfo>> topics;
+    // only contains the topics of topTopics
+    std::unordered_map<std::string, TimeSeries<TopicInfo, std::chrono::minutes, 60>> topics;
+    struct TopTopic {
+        std::string topic;
+        // estimated message count, which decays by half every minute; it may be too high by at most msgCountError
+        uint64_t msgCount{0};
+        uint64_t msgCountError{0};
+    };
+    // most frequent topics first
+    std::vector<TopTopic> topTopics;
     uint64_t totalPacketCount{0};
     uint64_t appStateQueueDepth{0};
+    uint64_t pendingLoginCount{0};
+    uint64_t deferredLoginCount{0};
+    uint64_t deferredLoginsTotal{0};
     uint64_t retainedMsgCount{0};
     uint64_t retainedMsgCummulativeSize{0};
     uint64_t uptimeSeconds{0};
@@ -43,8 +70,8 @@ struct AnalysisResults {
         uint64_t packetCount{0};
         uint64_t cummulativePacketSize{0};
     };
-    std::vector<TimeInfo> packetsPerMinute;
-    std::vector<TimeInfo> packetsPerSecond;
+    TimeSeries<TimeInfo, std::chrono::minutes, 60 * 24> packetsPerMinute;
+    TimeSeries<TimeInfo, std::chrono::seconds, 60 * 2> packetsPerSecond;
 
     struct ClientInfo {
         std::string clientId;
@@ -54,62 +81,90 @@ struct AnalysisResults {
     std::vector<ClientInfo> clients;
 
     WorkerThreadSleepLevel currentSleepLevel{WorkerThreadSleepLevel::YIELD};
-    std::vector<SleepLevelSampleCounts> sleepLevelSampleCounts{};
+    TimeSeries<SleepLevelSampleCounts, std::chrono::minutes, 60> sleepLevelSampleCounts;
+
+    struct StageLatency {
+        uint64_t count{0};
+        // in microseconds
+        double p50{0}, p90{0}, p99{0}, p999{0}, max{0}, mean{0};
+    };
+    // indexed by PublishStage; since the start of the broker and during the last full minute
+    std::array<StageLatency, static_cast<size_t>(PublishStage::$COUNT)> stageLatencies{};
+    std::array<StageLatency, static_cast<size_t>(PublishStage::$COUNT)> stageLatenciesLastMinute{};
 };
 /* This class is kind of similiar to the kappa architecture.
+ *
+ * Every thread that publishes counts its messages per topic and second in its own batch without any locking. Topics are interned
+ * to ids once per thread, so the batches don't copy any strings and recording a message skips even the hash lookup of the id if
+ * the topic is the same as the one of the previous message. Once the second is over, the thread hands the batch over to the
+ * analysis. The batch of the current second is published in an atomic pointer which the thread swaps out while recording, so
+ * that the analysis can take over the batch of a thread that stopped publishing. As batches are merged by their second, partial
+ * batches still end up in the right buckets.
  */
-class Statistics : public Subscriber {
+class Statistics {
 public:
     Statistics(ApplicationState& app);
     void init();
-    void publish(const std::string& topic, PayloadType payload, QoS qos, Retained retained, const PropertyList& properties, MQTTPublishPacketBuilder& packetBuilder) override;
+    // called for every published message
+    void record(const std::string& topic, size_t payloadLength, QoS qos);
     AnalysisResults getResults();
-    virtual const char* getType() const override {
-        return "stats";
-    }
     void refresh();
 private:
-    void push(atomic_queue::AtomicQueueB2<PacketData>& queue, PacketData&& packet);
-    void refreshInternal();
-
-    template<typename Interval, size_t MaxSize>
-    void createHistogram(std::vector<AnalysisResults::TimeInfo>& list) {
-        for(auto it = mAnalysisData.begin(); it != mAnalysisData.end(); ++it) {
-            auto rounded = std::chrono::floor<Interval>(it->timestamp);
-            ensureEnoughSpace<Interval, MaxSize>(list, rounded);
-            list.back().packetCount += 1;
-            list.back().cummulativePacketSize += it->payloadLength;
+    struct ThreadBuffer {
+        ~ThreadBuffer() {
+            delete current.load();
         }
+        // null while the owning thread records into it or after the analysis took it over
+        std::atomic<StatisticsBatch*> current{nullptr};
+
+        // only accessed by the owning thread
+        std::unordered_map<std::string, uint32_t> topicIds;
+        // entries of the topic of the previous message, nodes of the maps don't move
+        std::pair<const std::string, uint32_t>* lastTopic{nullptr};
+        TopicCounts* lastCounts{nullptr};
+
+        // moves a batch of a past second to the completed ones
+        void handOff(std::unique_ptr<StatisticsBatch> batch);
+        // only contended when the analysis collects the batches
+        std::mutex mutex;
+        std::vector<StatisticsBatch> completed;
+        bool exited{false};
     };
+    ThreadBuffer& getThreadBuffer();
+    std::pair<const std::string, uint32_t>& internTopic(ThreadBuffer& buffer, const std::string& topic);
+    std::vector<StatisticsBatch> collectBatches();
+    void refreshInternal();
+    void refreshStageLatencies();
 
-    template<typename Interval, size_t MaxSize, typename T>
-    void ensureEnoughSpace(std::vector<T>& list, std::chrono::system_clock::time_point roundedTimestamp) {
-        if(list.empty()) {
-            list.emplace_back();
-            list.back().timestamp = roundedTimestamp;
-        } else {
-            while(list.back().timestamp < roundedTimestamp) {
-                list.emplace_back();
-                list.back().timestamp = list.at(list.size() - 2).timestamp + Interval{1};
-
-                while(list.size() > MaxSize) {
-                    list.erase(list.begin());
-                }
-            }
-        }
-        while(list.size() > MaxSize) {
-            list.erase(list.begin());
+    template<typename Series>
+    static void createHistogram(Series& series, const std::vector<StatisticsBatch>& batches) {
+        for(auto& batch: batches) {
+            auto bucket = series.get(std::chrono::system_clock::from_time_t(batch.second));
+            if(!bucket)
+                continue;
+            bucket->packetCount += batch.packetCount;
+            bucket->cummulativePacketSize += batch.cummulativePacketSize;
         }
-    }
+    };
 
-    atomic_queue::AtomicQueueB2<PacketData> mCollectedData{100'000};
-    std::atomic<uint64_t> mTotalPacketCountCounter{0};
-    std::vector<PacketData> mAnalysisData;
     ApplicationState& mApp;
 
+    std::mutex mThreadBuffersMutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> mThreadBuffers;
+    // the topics (after aggregateTopic) that the ids of the batches refer to
+    std::shared_mutex mTopicIdsMutex;
+    std::unordered_map<std::string, uint32_t> mTopicIds;
+    std::vector<std::string> mTopicNames;
+    // decides which topics are tracked in AnalysisResults::topics
+    HeavyHitters<std::string> mTopTopics;
+    std::chrono::system_clock::time_point mTopTopicsDecayMinute;
+
     std::shared_mutex mMutex;
-    std::vector<SleepLevelSampleCounts> mSleepLevelSampleCounts;
+    TimeSeries<SleepLevelSampleCounts, std::chrono::minutes, 60> mSleepLevelSampleCounts;
     AnalysisResults mAnalysisResult;
+    // stage timings at the start of the current minute, the difference to them yields the values of the last minute
+    StageTimings::Snapshot mStageTimingsAtMinuteStart;
+    std::chrono::system_clock::time_point mStageTimingsMinuteStart;
     std::chrono::steady_clock::time_point mStartTime;
     Timers mBatchAnalysisTimer, mSampleWorkerThreadTimer; // TODO make single timer
 };
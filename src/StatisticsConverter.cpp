@@ -20,6 +20,9 @@ std::string statsToJson(const AnalysisResults& stats) {
     doc.AddMember(rapidjson::StringRef("total_msg_count"), rapidjson::Value{ stats.totalPacketCount }, doc.GetAllocator());
     doc.AddMember(rapidjson::StringRef("current_sleep_level"), rapidjson::StringRef(workerThreadSleepLevelToString(stats.currentSleepLevel)), doc.GetAllocator());
     doc.AddMember(rapidjson::StringRef("app_state_queue_depth"), rapidjson::Value{ stats.appStateQueueDepth }, doc.GetAllocator());
+    doc.AddMember(rapidjson::StringRef("pending_login_count"), rapidjson::Value{ stats.pendingLoginCount }, doc.GetAllocator());
+    doc.AddMember(rapidjson::StringRef("deferred_login_count"), rapidjson::Value{ stats.deferredLoginCount }, doc.GetAllocator());
+    doc.AddMember(rapidjson::StringRef("deferred_logins_total"), rapidjson::Value{ stats.deferredLoginsTotal }, doc.GetAllocator());
     doc.AddMember(rapidjson::StringRef("retained_msg_count"), rapidjson::Value{ stats.retainedMsgCount }, doc.GetAllocator());
     doc.AddMember(rapidjson::StringRef("retained_msg_size_sum"), rapidjson::Value{ stats.retainedMsgCummulativeSize }, doc.GetAllocator());
     doc.AddMember(rapidjson::StringRef("uptime_seconds"), rapidjson::Value{ stats.uptimeSeconds }, doc.GetAllocator());
@@ -88,7 +91,20 @@ std::string statsToJson(const AnalysisResults& stats) {
         doc.AddMember(rapidjson::StringRef("topics"), std::move(topics.Move()), doc.GetAllocator());
     }
     {
-        auto addHistogram = [&](const std::vector<AnalysisResults::TimeInfo>& data, const char* name) {
+        rapidjson::Value topTopics;
+        topTopics.SetArray();
+        for(auto& topic : stats.topTopics) {
+            rapidjson::Value topicJson;
+            topicJson.SetObject();
+            topicJson.AddMember(rapidjson::StringRef("topic"), rapidjson::Value{ topic.topic.c_str(), static_cast<rapidjson::SizeType>(topic.topic.size()), doc.GetAllocator() }, doc.GetAllocator());
+            topicJson.AddMember(rapidjson::StringRef("msg_count"), rapidjson::Value{ topic.msgCount }, doc.GetAllocator());
+            topicJson.AddMember(rapidjson::StringRef("msg_count_error"), rapidjson::Value{ topic.msgCountError }, doc.GetAllocator());
+            topTopics.PushBack(std::move(topicJson.Move()), doc.GetAllocator());
+        }
+        doc.AddMember(rapidjson::StringRef("top_topics"), std::move(topTopics.Move()), doc.GetAllocator());
+    }
+    {
+        auto addHistogram = [&](const auto& data, const char* name) {
             rapidjson::Value obj;
             obj.SetObject();
             for(auto& interval: data) {
@@ -106,6 +122,28 @@ std::string statsToJson(const AnalysisResults& stats) {
         addHistogram(stats.packetsPerSecond, "msg_per_second");
         addHistogram(stats.packetsPerMinute, "msg_per_minute");
     }
+    {
+        auto addStageLatencies = [&](const std::array<AnalysisResults::StageLatency, static_cast<size_t>(PublishStage::$COUNT)>& data, const char* name) {
+            rapidjson::Value obj;
+            obj.SetObject();
+            for(size_t i = 0; i < data.size(); ++i) {
+                auto& stage = data[i];
+                rapidjson::Value stageObj;
+                stageObj.SetObject();
+                stageObj.AddMember(rapidjson::StringRef("count"), rapidjson::Value{ stage.count }, doc.GetAllocator());
+                stageObj.AddMember(rapidjson::StringRef("p50"), rapidjson::Value{ stage.p50 }, doc.GetAllocator());
+                stageObj.AddMember(rapidjson::StringRef("p90"), rapidjson::Value{ stage.p90 }, doc.GetAllocator());
+                stageObj.AddMember(rapidjson::StringRef("p99"), rapidjson::Value{ stage.p99 }, doc.GetAllocator());
+                stageObj.AddMember(rapidjson::StringRef("p999"), rapidjson::Value{ stage.p999 }, doc.GetAllocator());
+                stageObj.AddMember(rapidjson::StringRef("max"), rapidjson::Value{ stage.max }, doc.GetAllocator());
+                stageObj.AddMember(rapidjson::StringRef("mean"), rapidjson::Value{ stage.mean }, doc.GetAllocator());
+                obj.AddMember(rapidjson::StringRef(publishStageToString(static_cast<PublishStage>(i))), std::move(stageObj.Move()), doc.GetAllocator());
+            }
+            doc.AddMember(rapidjson::StringRef(name), std::move(obj.Move()), doc.GetAllocator());
+        };
+        addStageLatencies(stats.stageLatencies, "stage_latency_us");
+        addStageLatencies(stats.stageLatenciesLastMinute, "stage_latency_us_last_minute");
+    }
     return stringify(doc);
 }
 std::string statsToMsgPerSecondJsonWebUI(const AnalysisResults& res) {
@@ -146,5 +184,35 @@ std::string stringListToJSON(const std::vector<std::string>& strs) {
     }
     return stringify(doc);
 }
+std::string clientTrafficToJson(const std::vector<ClientTrafficEntry>& page, size_t totalClientCount) {
+    rapidjson::Document doc;
+    doc.SetObject();
+    doc.AddMember(rapidjson::StringRef("total_client_count"), rapidjson::Value{ static_cast<uint64_t>(totalClientCount) }, doc.GetAllocator());
+    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    rapidjson::Value clients;
+    clients.SetArray();
+    for(auto& entry: page) {
+        auto& traffic = entry.traffic;
+        rapidjson::Value obj;
+        obj.SetObject();
+        obj.AddMember(rapidjson::StringRef("client_id"), rapidjson::Value{ entry.clientId.c_str(), static_cast<rapidjson::SizeType>(entry.clientId.size()), doc.GetAllocator() }, doc.GetAllocator());
+        obj.AddMember(rapidjson::StringRef("hostname"), rapidjson::Value{ entry.remoteIp.c_str(), static_cast<rapidjson::SizeType>(entry.remoteIp.size()), doc.GetAllocator() }, doc.GetAllocator());
+        obj.AddMember(rapidjson::StringRef("port"), entry.remotePort, doc.GetAllocator());
+        obj.AddMember(rapidjson::StringRef("msgs_in"), rapidjson::Value{ traffic.msgsIn }, doc.GetAllocator());
+        obj.AddMember(rapidjson::StringRef("msgs_out"), rapidjson::Value{ traffic.msgsOut }, doc.GetAllocator());
+        obj.AddMember(rapidjson::StringRef("bytes_in"), rapidjson::Value{ traffic.bytesIn }, doc.GetAllocator());
+        obj.AddMember(rapidjson::StringRef("bytes_out"), rapidjson::Value{ traffic.bytesOut }, doc.GetAllocator());
+        obj.AddMember(rapidjson::StringRef("drops"), rapidjson::Value{ traffic.drops }, doc.GetAllocator());
+        obj.AddMember(rapidjson::StringRef("queue_depth"), rapidjson::Value{ traffic.queueDepth }, doc.GetAllocator());
+        if(traffic.lastActivity != 0) {
+            obj.AddMember(rapidjson::StringRef("idle_seconds"), rapidjson::Value{ static_cast<double>(now - traffic.lastActivity) / 1e9 }, doc.GetAllocator());
+        } else {
+            obj.AddMember(rapidjson::StringRef("idle_seconds"), rapidjson::Value{}, doc.GetAllocator());
+        }
+        clients.PushBack(std::move(obj.Move()), doc.GetAllocator());
+    }
+    doc.AddMember(rapidjson::StringRef("clients"), std::move(clients.Move()), doc.GetAllocator());
+    return stringify(doc);
+}
 
 }
\ No newline at end of file
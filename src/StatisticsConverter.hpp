@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include "ClientTraffic.hpp"
 #include "Statistics.hpp"
 
 namespace nioev::mqtt::StatisticsConverter {
@@ -9,5 +10,7 @@ std::string statsToMsgPerSecondJsonWebUI(const AnalysisResults& res);
 std::string statsToMsgPerMinuteJsonWebUI(const AnalysisResults& res);
 std::string stringToJSON(const std::string& str);
 std::string stringListToJSON(const std::vector<std::string>& strs);
+// totalClientCount is the amount of clients on all pages
+std::string clientTrafficToJson(const std::vector<ClientTrafficEntry>& page, size_t totalClientCount);
 
 }
@@ -11,6 +11,8 @@
 namespace nioev::mqtt {
 using namespace nioev::lib;
 
+struct Subscription;
+
 class Subscriber : public TaskQueueRefCount {
 public:
     virtual void publish(const std::string& topic, PayloadType payload, QoS qos, Retained retained, const PropertyList& properties, MQTTPublishPacketBuilder& packetBuilder) = 0;
@@ -21,6 +23,68 @@ public:
     }
 
     virtual const char* getType() const = 0;
+
+    // Amount of messages that have been sent to the subscriber, but weren't acknowledged yet. Used for load balancing shared subscriptions.
+    virtual size_t getInFlightCount() const {
+        return 0;
+    }
+
+    // Called when the subscriber subscribes to or unsubscribes from a topic filter, e.g. to persist its subscriptions.
+    // Not called for subscriptions that are restored on startup.
+    virtual void onSubscribe(const std::string& topic, const Subscription& sub) {
+
+    }
+    virtual void onUnsubscribe(const std::string& topic) {
+
+    }
+
+    // Amount of topic filters the subscriber is subscribed to. Only changed while the application state is locked exclusively,
+    // so it can be read while publishing.
+    size_t getSubscriptionCount() const {
+        return mSubscriptionCount;
+    }
+    void setSubscriptionCount(size_t count) {
+        mSubscriptionCount = count;
+    }
+private:
+    size_t mSubscriptionCount{0};
 };
 
-}
\ No newline at end of file
+// MQTT 5 subscription options, see chapter 3.8.3.1 of the spec. The defaults correspond to the MQTT 3.1.1 behaviour.
+struct SubscriptionOptions {
+    // Don't forward messages published by the subscriber itself
+    bool noLocal{false};
+    // Keep the retain flag of forwarded messages instead of clearing it
+    bool retainAsPublished{false};
+    // 0 = send retained messages on subscribe, 1 = only if the subscription didn't exist yet, 2 = never
+    uint8_t retainHandling{0};
+    // 0 means no identifier was set
+    uint32_t subscriptionIdentifier{0};
+};
+
+struct Subscription {
+    Subscriber* subscriber = nullptr;
+    QoS qos = QoS::QoS0;
+    SubscriptionOptions options;
+    Subscription() {
+
+    }
+    Subscription(Subscriber* conn, QoS qos, SubscriptionOptions options = {})
+    : subscriber(std::move(conn)), qos(qos), options(options) {
+
+    }
+    bool operator==(const Subscription& b) const {
+        return subscriber == b.subscriber;
+    }
+};
+
+}
+
+namespace std {
+template<>
+struct hash<nioev::mqtt::Subscription> {
+    size_t operator()(const nioev::mqtt::Subscription& sub) const {
+        return std::hash<void*>()(sub.subscriber);
+    }
+};
+}
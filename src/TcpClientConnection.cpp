@@ -1,8 +1,13 @@
 #include "TcpClientConnection.hpp"
 
+#include "GlobalConfig.hpp"
+#include "Metrics.hpp"
+#include "StageTimings.hpp"
 #include "nioev/lib/Util.hpp"
 #include "spdlog/spdlog.h"
 #include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -13,14 +18,25 @@ using namespace nioev::lib;
 
 TcpClientConnection::TcpClientConnection(int sockFd, std::string remoteIp, uint16_t remotePort)
 : mSockFd(sockFd), mRemoteIp(std::move(remoteIp)), mRemotePort(remotePort) {
-
+    if(getGlobalConfig().zeroCopyThreshold > 0) {
+        int one = 1;
+        if(setsockopt(sockFd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+            mZeroCopyEnabled = true;
+        } else {
+            spdlog::warn("Failed to enable SO_ZEROCOPY: {}", errnoToString());
+        }
+    }
 }
 TcpClientConnection::~TcpClientConnection() {
     close();
 }
 TcpClientConnection::TcpClientConnection(TcpClientConnection&& other) noexcept
 : mRemoteIp(std::move(other.mRemoteIp)), mRemotePort(other.mRemotePort) {
+    std::unique_lock<std::mutex> lock{other.mZeroCopyMutex};
     mSockFd = other.mSockFd.load();
+    mZeroCopyEnabled = other.mZeroCopyEnabled.load();
+    mNextZeroCopySendId = other.mNextZeroCopySendId;
+    mZeroCopyInFlight = std::move(other.mZeroCopyInFlight);
     other.mRemotePort = 0;
     other.mRemoteIp = "";
     other.mSockFd = -1;
@@ -41,6 +57,7 @@ uint TcpClientConnection::recv(std::vector<uint8_t>& buffer) {
         // connection dropped or so
         throwErrno("recv()");
     }
+    Metrics::add(Counter::BYTES_IN, result);
     return result;
 }
 uint TcpClientConnection::send(const uint8_t* data, uint len) {
@@ -58,36 +75,76 @@ uint TcpClientConnection::send(const uint8_t* data, uint len) {
         }
         throwErrno("send()");
     }
+    Metrics::add(Counter::BYTES_OUT, result);
     return result;
 }
 void TcpClientConnection::close() {
     int expected = mSockFd.load();
     if(expected >= 0 && mSockFd.compare_exchange_strong(expected, -1)) {
+        releaseZeroCopyInFlight(expected);
         if(::close(expected) < 0) {
             spdlog::error("close({}): {}", expected, errnoToString());
         }
     }
 }
-uint TcpClientConnection::sendScatter(InTransitEncodedPacket* packets, size_t encodedPacketCount) {
-    assert(encodedPacketCount > 0);
-    encodedPacketCount = (std::min)(encodedPacketCount, (size_t)UIO_MAXIOV / 4);
+uint TcpClientConnection::sendScatter(InTransitEncodedPacket& packet) {
+    return sendScatter({&packet, 1}, {});
+}
+uint TcpClientConnection::sendScatter(SendQueue& packets) {
+    return sendScatter(packets.firstSpan(), packets.secondSpan());
+}
+uint TcpClientConnection::sendScatter(std::span<InTransitEncodedPacket> packets, std::span<InTransitEncodedPacket> wrappedPackets) {
+    assert(!packets.empty());
     auto fd = mSockFd.load();
     if(fd == -1)
         throwErrno("recv()");
-    msghdr scatterMessage = { 0 };
-    size_t vecsOffset = 0;
-    iovec vecs[encodedPacketCount * 4];
-    memset(&vecs, 0, sizeof(vecs));
 
-    for(size_t i = 0; i < encodedPacketCount; ++i) {
-        vecsOffset += packets[i].packet.constructIOVecs(packets[i].offset, vecs + vecsOffset);
+    static thread_local IOVecBuilder tIOVecBuilder;
+    tIOVecBuilder.clear();
+    bool outOfIOVecs = false;
+    size_t packetsInMessage = 0;
+    for(auto span: { packets, wrappedPackets }) {
+        for(auto& packet: span) {
+            packetsInMessage += 1;
+            if(!packet.packet.constructIOVecs(packet.offset, tIOVecBuilder)) {
+                // out of iovecs; the rest will be sent with the next call
+                outOfIOVecs = true;
+                break;
+            }
+        }
+        if(outOfIOVecs)
+            break;
+    }
+    msghdr scatterMessage = { 0 };
+    scatterMessage.msg_iov = tIOVecBuilder.data();
+    scatterMessage.msg_iovlen = tIOVecBuilder.size();
+    bool zeroCopy = shouldUseZeroCopy(tIOVecBuilder.totalLength());
+    // the kernel may still reference the small segments after a zero copy send, so they can't stay in the reused inline buffer
+    std::unique_ptr<uint8_t[]> inlineSegments;
+    if(zeroCopy) {
+        inlineSegments = tIOVecBuilder.detachInlineSegments();
     }
-    if(vecsOffset >= UIO_MAXIOV) {
-        spdlog::error("Over max: {}", vecsOffset);
+    auto sendStart = StageTimings::now();
+    ssize_t result = ::sendmsg(fd, &scatterMessage, MSG_NOSIGNAL | MSG_DONTWAIT | (zeroCopy ? MSG_ZEROCOPY : 0));
+    if(result < 0 && zeroCopy && errno == ENOBUFS) {
+        // we hit the limit of pinned pages, so just copy the data this time
+        zeroCopy = false;
+        result = ::sendmsg(fd, &scatterMessage, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    StageTimings::recordSince(PublishStage::SEND, sendStart);
+    if(result >= 0 && zeroCopy) {
+        // the kernel may still reference the packets' buffers and our inline buffer until it reports the completion
+        std::vector<EncodedPacket> referencedPackets;
+        referencedPackets.reserve(packetsInMessage);
+        for(auto span: { packets, wrappedPackets }) {
+            for(auto& packet: span) {
+                if(referencedPackets.size() == packetsInMessage)
+                    break;
+                referencedPackets.push_back(packet.packet);
+            }
+        }
+        addZeroCopyInFlight(std::move(referencedPackets), std::move(inlineSegments));
     }
-    scatterMessage.msg_iov = vecs;
-    scatterMessage.msg_iovlen = vecsOffset;
-    ssize_t result = ::sendmsg(fd, &scatterMessage, MSG_NOSIGNAL | MSG_DONTWAIT);
     if(result == 0) {
         throw CleanDisconnectException{};
     }
@@ -97,19 +154,98 @@ uint TcpClientConnection::sendScatter(InTransitEncodedPacket* packets, size_t en
         }
         throwErrno("send()");
     }
-    for(size_t i = 0; i < encodedPacketCount; ++i) {
-        auto remainingPacketSize = packets[i].packet.fullSize() - packets[i].offset;
-        if(remainingPacketSize <= result) {
-            packets[i].offset = packets[i].packet.fullSize();
-            result -= remainingPacketSize;
-        } else {
-            packets[i].offset += result;
-            result = 0;
-            break;
+    Metrics::add(Counter::BYTES_OUT, result);
+    uint bytesSent = result;
+    for(auto span: { packets, wrappedPackets }) {
+        for(auto& packet: span) {
+            if(result == 0)
+                break;
+            auto remainingPacketSize = packet.packet.fullSize() - packet.offset;
+            if(remainingPacketSize <= (size_t)result) {
+                packet.offset = packet.packet.fullSize();
+                result -= remainingPacketSize;
+            } else {
+                packet.offset += result;
+                result = 0;
+            }
         }
     }
     assert(result == 0);
-    return result;
+    return bytesSent;
+}
+
+bool TcpClientConnection::shouldUseZeroCopy(size_t length) const {
+    auto threshold = getGlobalConfig().zeroCopyThreshold;
+    return mZeroCopyEnabled.load(std::memory_order_relaxed) && threshold > 0 && length >= threshold;
+}
+void TcpClientConnection::addZeroCopyInFlight(std::vector<EncodedPacket>&& packets, std::unique_ptr<uint8_t[]>&& inlineBuffer) {
+    std::unique_lock<std::mutex> lock{mZeroCopyMutex};
+    // every successful sendmsg with MSG_ZEROCOPY gets the next id of a per-socket counter
+    mZeroCopyInFlight.emplace_back(ZeroCopyInFlight{ mNextZeroCopySendId++, std::move(packets), std::move(inlineBuffer) });
+}
+void TcpClientConnection::releaseZeroCopyInFlight(int fd) {
+    // no new zero copy sends for a socket that is being torn down
+    mZeroCopyEnabled = false;
+    {
+        std::unique_lock<std::mutex> lock{mZeroCopyMutex};
+        if(mZeroCopyInFlight.empty())
+            return;
+    }
+    bool notificationsProcessed = false;
+    readZeroCopyNotifications(fd, notificationsProcessed);
+    std::unique_lock<std::mutex> lock{mZeroCopyMutex};
+    if(mZeroCopyInFlight.empty())
+        return;
+    // The kernel would keep sending from the buffers after close(), but waiting for the peer to acknowledge them could block for
+    // a long time. Aborting the connection makes the kernel drop the unsent data instead, so the buffers can be freed.
+    spdlog::debug("[{}:{}] Aborting connection with {} unfinished zero copy sends", mRemoteIp, mRemotePort, mZeroCopyInFlight.size());
+    linger abort = { 1, 0 };
+    if(setsockopt(fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort)) < 0) {
+        spdlog::warn("Failed to set SO_LINGER: {}", errnoToString());
+    }
+}
+bool TcpClientConnection::processErrorQueue() {
+    auto fd = mSockFd.load();
+    if(fd == -1 || !mZeroCopyEnabled)
+        return false;
+    bool notificationsProcessed = false;
+    if(!readZeroCopyNotifications(fd, notificationsProcessed))
+        return false;
+    // if there were no notifications, the EPOLLERR must have been caused by a real error
+    return notificationsProcessed;
+}
+bool TcpClientConnection::readZeroCopyNotifications(int fd, bool& notificationsProcessed) {
+    // SO_ERROR isn't queried, as that would clear the pending error that recv/send are supposed to report
+    while(true) {
+        uint8_t control[CMSG_SPACE(sizeof(sock_extended_err)) + 64];
+        msghdr msg = { 0 };
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto result = ::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if(result < 0) {
+            if(errno == EWOULDBLOCK || errno == EAGAIN)
+                break;
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+            auto err = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cmsg));
+            if(err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                return false;
+            notificationsProcessed = true;
+            // the notification covers the inclusive range [ee_info, ee_data] of send ids
+            uint32_t first = err->ee_info;
+            uint32_t count = err->ee_data - first + 1;
+            std::unique_lock<std::mutex> lock{mZeroCopyMutex};
+            std::erase_if(mZeroCopyInFlight, [&](const ZeroCopyInFlight& inFlight) {
+                return inFlight.sendId - first < count;
+            });
+        }
+    }
+    return true;
 }
 
 }
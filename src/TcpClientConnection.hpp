@@ -1,8 +1,14 @@
 #pragma once
 
 #include "MQTTPublishPacketBuilder.hpp"
+#include "SendQueue.hpp"
 #include "nioev/lib/Util.hpp"
+#include <atomic>
 #include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
 #include <vector>
 
@@ -43,15 +49,40 @@ public:
         return mSockFd;
     }
     uint send(const uint8_t* data, uint len);
-    uint sendScatter(InTransitEncodedPacket* packets, size_t encoedPacketCount);
+    uint sendScatter(InTransitEncodedPacket& packet);
+    uint sendScatter(SendQueue& packets);
     uint recv(std::vector<uint8_t>& buffer);
+    // Reads MSG_ZEROCOPY completion notifications from the error queue and releases the buffers of the completed sends.
+    // Returns true if the EPOLLERR was caused by the notifications and not by a real error of the socket.
+    bool processErrorQueue();
 
     void close();
 
 private:
+    uint sendScatter(std::span<InTransitEncodedPacket> packets, std::span<InTransitEncodedPacket> wrappedPackets);
+
+    bool shouldUseZeroCopy(size_t length) const;
+    void addZeroCopyInFlight(std::vector<EncodedPacket>&& packets, std::unique_ptr<uint8_t[]>&& inlineBuffer);
+    // Returns false if the error queue contains a real error of the socket. notificationsProcessed is set if there was at least
+    // one completion notification.
+    bool readZeroCopyNotifications(int fd, bool& notificationsProcessed);
+    // Called before the socket is closed, makes sure the kernel doesn't read from in-flight buffers after they were freed
+    void releaseZeroCopyInFlight(int fd);
+
     std::atomic<int> mSockFd = -1;
     std::string mRemoteIp;
     uint16_t mRemotePort = 0;
+
+    // Buffers referenced by MSG_ZEROCOPY sends that the kernel hasn't completed yet
+    struct ZeroCopyInFlight {
+        uint32_t sendId;
+        std::vector<EncodedPacket> packets;
+        std::unique_ptr<uint8_t[]> inlineBuffer;
+    };
+    std::atomic<bool> mZeroCopyEnabled{false};
+    std::mutex mZeroCopyMutex;
+    uint32_t mNextZeroCopySendId{0};
+    std::deque<ZeroCopyInFlight> mZeroCopyInFlight;
 };
 
 }
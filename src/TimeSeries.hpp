@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace nioev::mqtt {
+
+/* The last Size consecutive time intervals, each with its own bucket of type T, stored in a ring buffer that is indexed by the
+ * time. Moving on to a newer interval overwrites the oldest buckets, so updating the current bucket is O(1) and the memory usage
+ * is fixed. T needs a timestamp member, which is set to the start of the interval of its bucket. Iterating yields the buckets
+ * from the oldest to the newest one.
+ */
+template<typename T, typename Interval, size_t Size>
+class TimeSeries final {
+public:
+    using TimePoint = std::chrono::system_clock::time_point;
+
+    // Returns the bucket of the interval containing timestamp, moving on to it if it's newer than the newest bucket. Returns
+    // nullptr if the interval is already overwritten.
+    T* get(TimePoint timestamp) {
+        auto interval = intervalOf(timestamp);
+        advanceTo(interval);
+        if(interval <= mNewest - static_cast<int64_t>(mSize))
+            return nullptr;
+        return &mBuckets[indexOf(interval)];
+    }
+    // Makes sure that the buckets up to the interval containing timestamp exist, even if nothing was recorded in them
+    void advanceTo(TimePoint timestamp) {
+        advanceTo(intervalOf(timestamp));
+    }
+
+    class Iterator {
+    public:
+        Iterator(const TimeSeries* series, int64_t interval)
+        : mSeries(series), mInterval(interval) {
+
+        }
+        const T& operator*() const {
+            return mSeries->mBuckets[mSeries->indexOf(mInterval)];
+        }
+        const T* operator->() const {
+            return &**this;
+        }
+        Iterator& operator++() {
+            mInterval += 1;
+            return *this;
+        }
+        bool operator!=(const Iterator& other) const {
+            return mInterval != other.mInterval;
+        }
+    private:
+        const TimeSeries* mSeries;
+        int64_t mInterval;
+    };
+    Iterator begin() const {
+        return Iterator{ this, mNewest - static_cast<int64_t>(mSize) + 1 };
+    }
+    Iterator end() const {
+        return Iterator{ this, mNewest + 1 };
+    }
+    [[nodiscard]] const T& back() const {
+        return mBuckets[indexOf(mNewest)];
+    }
+    [[nodiscard]] size_t size() const {
+        return mSize;
+    }
+    [[nodiscard]] bool empty() const {
+        return mSize == 0;
+    }
+
+private:
+    static int64_t intervalOf(TimePoint timestamp) {
+        return std::chrono::floor<Interval>(timestamp).time_since_epoch().count();
+    }
+    static size_t indexOf(int64_t interval) {
+        return static_cast<uint64_t>(interval) % Size;
+    }
+    void advanceTo(int64_t interval) {
+        if(mSize > 0 && interval <= mNewest)
+            return;
+        // only the last Size intervals need to be reset, even if a lot of time passed
+        auto first = mSize == 0 ? interval : std::max(mNewest + 1, interval - static_cast<int64_t>(Size) + 1);
+        for(auto i = first; i <= interval; ++i) {
+            auto& bucket = mBuckets[indexOf(i)];
+            bucket = T{};
+            bucket.timestamp = TimePoint{Interval{i}};
+        }
+        mSize = mSize == 0 ? 1 : static_cast<size_t>(std::min<int64_t>(Size, mSize + (interval - mNewest)));
+        mNewest = interval;
+    }
+
+    std::array<T, Size> mBuckets{};
+    // interval number of the newest bucket (intervals since the epoch)
+    int64_t mNewest{0};
+    size_t mSize{0};
+};
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace nioev::mqtt {
+
+// Simple token bucket used for rate limiting. A rate of zero disables the limit.
+class TokenBucket final {
+public:
+    TokenBucket(uint32_t tokensPerSecond, uint32_t burst)
+    : mTokensPerSecond(tokensPerSecond), mBurst(std::max<uint32_t>(burst, 1)), mTokens(mBurst), mLastRefill(std::chrono::steady_clock::now()) {
+
+    }
+    bool tryAcquire() {
+        if(mTokensPerSecond == 0)
+            return true;
+        std::lock_guard<std::mutex> lock{mMutex};
+        refill();
+        if(mTokens < 1.0)
+            return false;
+        mTokens -= 1.0;
+        return true;
+    }
+    bool isUnlimited() const {
+        return mTokensPerSecond == 0;
+    }
+private:
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - mLastRefill;
+        mLastRefill = now;
+        mTokens = std::min<double>(mBurst, mTokens + elapsed.count() * mTokensPerSecond);
+    }
+
+    const uint32_t mTokensPerSecond;
+    const uint32_t mBurst;
+    std::mutex mMutex;
+    double mTokens;
+    std::chrono::steady_clock::time_point mLastRefill;
+};
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace nioev::mqtt {
+
+/* Outbound topic aliases of a single connection. The most recently used topics keep their alias; once all aliases are taken,
+ * the alias of the least recently used topic is reassigned. Not thread safe.
+ */
+class TopicAliasCache final {
+public:
+    struct Lookup {
+        uint16_t alias{0};
+        // true if the alias was (re)assigned, meaning the topic needs to be sent along with it
+        bool isNew{true};
+    };
+
+    explicit TopicAliasCache(uint16_t maximum)
+    : mMaximum(maximum) {
+
+    }
+    // the index points into the list nodes, which stay in place when moving but not when copying
+    TopicAliasCache(const TopicAliasCache&) = delete;
+    void operator=(const TopicAliasCache&) = delete;
+    TopicAliasCache(TopicAliasCache&&) = default;
+    TopicAliasCache& operator=(TopicAliasCache&&) = default;
+    [[nodiscard]] uint16_t getMaximum() const {
+        return mMaximum;
+    }
+    // Returns the lookup that lookupOrAssign would return, without changing anything
+    [[nodiscard]] Lookup peek(const std::string& topic) const {
+        if(mMaximum == 0)
+            return {};
+        auto it = mIndex.find(topic);
+        if(it != mIndex.end())
+            return { it->second->alias, false };
+        return { static_cast<uint16_t>(mEntries.size() < mMaximum ? mEntries.size() + 1 : mEntries.back().alias), true };
+    }
+    Lookup lookupOrAssign(const std::string& topic) {
+        if(mMaximum == 0)
+            return {};
+        auto it = mIndex.find(topic);
+        if(it != mIndex.end()) {
+            mEntries.splice(mEntries.begin(), mEntries, it->second);
+            return { it->second->alias, false };
+        }
+        uint16_t alias;
+        if(mEntries.size() < mMaximum) {
+            alias = mEntries.size() + 1;
+        } else {
+            auto& leastRecentlyUsed = mEntries.back();
+            alias = leastRecentlyUsed.alias;
+            mIndex.erase(leastRecentlyUsed.topic);
+            mEntries.pop_back();
+        }
+        mEntries.push_front(Entry{ topic, alias });
+        // the key points into the list node, which never moves
+        mIndex.emplace(mEntries.front().topic, mEntries.begin());
+        return { alias, true };
+    }
+
+private:
+    struct Entry {
+        std::string topic;
+        uint16_t alias;
+    };
+    uint16_t mMaximum;
+    // most recently used first
+    std::list<Entry> mEntries;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> mIndex;
+};
+
+}
@@ -0,0 +1,256 @@
+#include "WriteAheadLog.hpp"
+#include "ApplicationState.hpp"
+#include "MQTTClientConnection.hpp"
+#include "RecordFraming.hpp"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace nioev::mqtt {
+
+namespace {
+// Segments are named <prefix>.<number> and contain nothing but records as described in RecordFraming.hpp
+std::string segmentPath(const std::string& prefix, uint64_t number) {
+    return prefix + "." + std::to_string(number);
+}
+}
+
+WriteAheadLog::WriteAheadLog(std::string pathPrefix, std::chrono::microseconds groupCommitInterval)
+: mPathPrefix(std::move(pathPrefix)), mGroupCommitInterval(groupCommitInterval) {
+    // find segments of the last run
+    std::filesystem::path prefix{mPathPrefix};
+    auto directory = prefix.has_parent_path() ? prefix.parent_path() : std::filesystem::path{"."};
+    auto namePrefix = prefix.filename().string() + ".";
+    uint64_t nextNumber = 0;
+    std::vector<SegmentRef> leftOver;
+    for(auto& entry : std::filesystem::directory_iterator{directory}) {
+        auto name = entry.path().filename().string();
+        if(!entry.is_regular_file() || !name.starts_with(namePrefix))
+            continue;
+        auto suffix = name.substr(namePrefix.size());
+        if(suffix.empty() || !std::all_of(suffix.begin(), suffix.end(), [](char c) { return c >= '0' && c <= '9'; }))
+            continue;
+        auto number = std::stoull(suffix);
+        leftOver.emplace_back(std::make_shared<const Segment>(Segment{segmentPath(mPathPrefix, number), number}));
+        nextNumber = std::max<uint64_t>(nextNumber, number + 1);
+    }
+    std::sort(leftOver.begin(), leftOver.end(), [](auto& a, auto& b) {
+        return a->number < b->number;
+    });
+    mSealedSegments = std::move(leftOver);
+    openSegment(nextNumber);
+    mCommitThread = std::thread{[this] {
+        pthread_setname_np(pthread_self(), "WAL-commit");
+        commitThreadFunc();
+    }};
+}
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::unique_lock<std::mutex> lock{mMutex};
+        mShouldRun = false;
+    }
+    mCV.notify_all();
+    mCommitThread.join();
+    if(mFd >= 0) {
+        ::close(mFd);
+    }
+}
+void WriteAheadLog::openSegment(uint64_t number) {
+    auto segment = std::make_shared<const Segment>(Segment{segmentPath(mPathPrefix, number), number});
+    int fd = ::open(segment->path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        throwErrno("open(" + segment->path + ")");
+    }
+    if(mFd >= 0) {
+        ::close(mFd);
+    }
+    mFd = fd;
+    if(mCurrentSegment) {
+        mSealedSegments.emplace_back(std::move(mCurrentSegment));
+    }
+    mCurrentSegment = std::move(segment);
+}
+
+std::vector<WriteAheadLog::RecoveredPublish> WriteAheadLog::recover() {
+    std::unique_lock<std::mutex> lock{mMutex};
+    std::vector<RecoveredPublish> ret;
+    for(auto& segment : mSealedSegments) {
+        int fd = ::open(segment->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            spdlog::error("Failed to open write-ahead log segment {}: {}", segment->path, errnoToString());
+            continue;
+        }
+        auto data = records::readAll(fd);
+        ::close(fd);
+        auto end = records::forEach(data, 0, [&](const uint8_t* body, size_t length) {
+            try {
+                records::Decoder decoder{body, length};
+                RecoveredPublish publish;
+                publish.qos = static_cast<QoS>(decoder.get<uint8_t>());
+                publish.retain = decoder.get<uint8_t>() ? Retain::Yes : Retain::No;
+                publish.topic = decoder.getString();
+                auto [properties, propertiesLength] = decoder.getBytes();
+                std::vector<uint8_t> propertiesData{properties, properties + propertiesLength};
+                BinaryDecoder propertiesDecoder{propertiesData, static_cast<uint32_t>(propertiesData.size())};
+                publish.properties = propertiesDecoder.decodeProperties();
+                auto [payload, payloadLength] = decoder.getBytes();
+                publish.payload.assign(payload, payload + payloadLength);
+                ret.emplace_back(std::move(publish));
+            } catch(std::exception& e) {
+                spdlog::warn("Skipping invalid write-ahead log record: {}", e.what());
+            }
+        });
+        if(end != data.size()) {
+            // the publisher never got an acknowledgement for these
+            spdlog::warn("Ignoring {} bytes of incomplete records at the end of {}", data.size() - end, segment->path);
+        }
+    }
+    if(!ret.empty()) {
+        spdlog::info("Recovered {} publishes from the write-ahead log", ret.size());
+    }
+    return ret;
+}
+
+WriteAheadLog::SegmentRef WriteAheadLog::append(const std::string& topic, PayloadType payload, QoS qos, Retain retain, const PropertyList& properties, MQTTClientConnection& client, uint16_t packetId, EncodedPacket&& ack) {
+    BinaryEncoder propertiesEncoder;
+    propertiesEncoder.encodePropertyList(properties);
+    auto encodedProperties = propertiesEncoder.moveData();
+
+    // the reference keeps the client alive until the acknowledgement was sent
+    client.incTaskQueueRefCount();
+    PersistentClientState* qos2State = nullptr;
+    if(qos == QoS::QoS2) {
+        // the session may be deleted in the meantime, so it needs a reference as well
+        qos2State = client.getPersistentClientState();
+        qos2State->incTaskQueueRefCount();
+    }
+    std::unique_lock<std::mutex> lock{mMutex};
+    bool wasEmpty = mPendingAcks.empty();
+    auto start = records::begin(mBuffer);
+    records::put<uint8_t>(mBuffer, static_cast<uint8_t>(qos));
+    records::put<uint8_t>(mBuffer, retain == Retain::Yes);
+    records::putString(mBuffer, topic);
+    records::putBytes(mBuffer, encodedProperties.data(), encodedProperties.size());
+    records::putBytes(mBuffer, payload.data(), payload.size());
+    records::end(mBuffer, start);
+    mPendingAcks.emplace_back(PendingAck{&client, std::move(ack), qos2State, packetId});
+    mCurrentSegmentHasRecords = true;
+    auto segment = mCurrentSegment;
+    lock.unlock();
+    if(wasEmpty) {
+        mCV.notify_one();
+    }
+    return segment;
+}
+void WriteAheadLog::acknowledgeAfterCommit(MQTTClientConnection& client, EncodedPacket&& ack) {
+    client.incTaskQueueRefCount();
+    std::unique_lock<std::mutex> lock{mMutex};
+    bool wasEmpty = mPendingAcks.empty();
+    mPendingAcks.emplace_back(PendingAck{&client, std::move(ack)});
+    lock.unlock();
+    if(wasEmpty) {
+        mCV.notify_one();
+    }
+}
+
+void WriteAheadLog::commitThreadFunc() {
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock{mMutex};
+            mCV.wait(lock, [this] { return !mPendingAcks.empty() || !mShouldRun; });
+            if(!mShouldRun && mPendingAcks.empty())
+                return;
+        }
+        // give other threads the chance to add their records to this batch
+        std::this_thread::sleep_for(mGroupCommitInterval);
+        std::unique_lock<std::mutex> commitLock{mCommitMutex};
+        commit();
+    }
+}
+void WriteAheadLog::commit() {
+    std::vector<uint8_t> buffer;
+    std::vector<PendingAck> acks;
+    int fd;
+    {
+        std::unique_lock<std::mutex> lock{mMutex};
+        std::swap(buffer, mBuffer);
+        std::swap(acks, mPendingAcks);
+        fd = mFd;
+    }
+    bool durable = true;
+    if(!buffer.empty()) {
+        off_t batchStart = lseek(fd, 0, SEEK_END);
+        try {
+            if(batchStart < 0) {
+                throwErrno("lseek()");
+            }
+            records::writeAll(fd, buffer.data(), buffer.size());
+            if(fdatasync(fd) < 0) {
+                throwErrno("fdatasync()");
+            }
+        } catch(std::exception& e) {
+            // the publishers are disconnected below, so that they send the messages again after reconnecting
+            spdlog::critical("Failed to write the write-ahead log, not acknowledging {} messages: {}", acks.size(), e.what());
+            durable = false;
+            discardFailedBatch(fd, batchStart);
+        }
+    }
+    for(auto& ack : acks) {
+        if(durable) {
+            ack.client->sendData(std::move(ack.packet));
+        } else {
+            if(ack.qos2State) {
+                // otherwise the resend would be treated as a duplicate and acknowledged without being on disk
+                ack.qos2State->unmarkQoS2Receiving(ack.packetId);
+            }
+            ack.client->disconnectAfterError();
+        }
+        if(ack.qos2State) {
+            ack.qos2State->decTaskQueueRefCount();
+        }
+        ack.client->decTaskQueueRefCount();
+    }
+}
+
+void WriteAheadLog::discardFailedBatch(int fd, off_t batchStart) {
+    // Recovery stops reading a segment at the first torn record, so records of later batches must not end up behind a partially
+    // written one. Cut the batch off again; if that's not possible, continue in a new segment.
+    if(batchStart >= 0 && ftruncate(fd, batchStart) == 0)
+        return;
+    spdlog::error("Failed to truncate write-ahead log segment {}, starting a new one: {}", mCurrentSegment->path, errnoToString());
+    std::unique_lock<std::mutex> lock{mMutex};
+    try {
+        openSegment(mCurrentSegment->number + 1);
+        mCurrentSegmentHasRecords = !mBuffer.empty();
+    } catch(std::exception& e) {
+        spdlog::critical("Failed to start a new write-ahead log segment: {}", e.what());
+    }
+}
+
+std::vector<WriteAheadLog::SegmentRef> WriteAheadLog::rotate() {
+    std::unique_lock<std::mutex> commitLock{mCommitMutex};
+    // everything appended so far belongs to the current segment
+    commit();
+    std::unique_lock<std::mutex> lock{mMutex};
+    if(mCurrentSegmentHasRecords) {
+        openSegment(mCurrentSegment->number + 1);
+        mCurrentSegmentHasRecords = false;
+    }
+    std::vector<SegmentRef> unreferenced, referenced;
+    for(auto& segment : mSealedSegments) {
+        (segment.use_count() > 1 ? referenced : unreferenced).emplace_back(std::move(segment));
+    }
+    mSealedSegments = std::move(referenced);
+    return unreferenced;
+}
+void WriteAheadLog::remove(const std::vector<SegmentRef>& segments) {
+    for(auto& segment : segments) {
+        if(unlink(segment->path.c_str()) < 0) {
+            spdlog::warn("Failed to remove write-ahead log segment {}: {}", segment->path, errnoToString());
+        }
+    }
+}
+
+}
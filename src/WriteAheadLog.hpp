@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Forward.hpp"
+#include "MQTTPublishPacketBuilder.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+namespace nioev::mqtt {
+
+/* Optional durable mode for QoS 1/2 publishes: every publish is appended to this log before the PUBACK/PUBREC is sent, so a message
+ * that was acknowledged to the publisher survives a crash. Instead of an fsync per message, a commit thread writes and syncs all
+ * records that were appended within a group commit interval at once and only then sends the acknowledgements of that batch.
+ *
+ * The log is split into segments. Publishers keep a reference to the segment their message was written to until the message was fanned
+ * out and retained, and rotate() only hands out segments that aren't referenced anymore. After the state they produced (retained
+ * messages, session journal) was made durable, these segments can be removed. Whatever is left on startup is published again, so
+ * messages are delivered at least once.
+ */
+class WriteAheadLog final {
+public:
+    struct Segment {
+        std::string path;
+        uint64_t number{0};
+    };
+    using SegmentRef = std::shared_ptr<const Segment>;
+
+    struct RecoveredPublish {
+        std::string topic;
+        std::vector<uint8_t> payload;
+        QoS qos{QoS::QoS1};
+        Retain retain{Retain::No};
+        PropertyList properties;
+    };
+
+    WriteAheadLog(std::string pathPrefix, std::chrono::microseconds groupCommitInterval);
+    ~WriteAheadLog();
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Reads all segments left over from the last run, call once on startup before appending anything. The segments are removed by
+    // the next checkpoint, i.e. once the recovered messages were processed.
+    std::vector<RecoveredPublish> recover();
+
+    // Appends a publish and sends ack to the client once the record is on disk. If that fails, the client is disconnected so that it
+    // sends the publish again, and for QoS 2 the packet id is no longer marked as received, so that the resend isn't a duplicate.
+    [[nodiscard]] SegmentRef append(const std::string& topic, PayloadType payload, QoS qos, Retain retain, const PropertyList& properties, MQTTClientConnection& client, uint16_t packetId, EncodedPacket&& ack);
+    // Sends ack to the client after the current batch was committed, which keeps acknowledgements in order
+    void acknowledgeAfterCommit(MQTTClientConnection& client, EncodedPacket&& ack);
+
+    // Starts a new segment. Returns older segments that aren't referenced anymore, which can be removed once the state derived from
+    // them is durable.
+    std::vector<SegmentRef> rotate();
+    void remove(const std::vector<SegmentRef>& segments);
+
+private:
+    struct PendingAck {
+        MQTTClientConnection* client;
+        EncodedPacket packet;
+        // only set for QoS 2 publishes, referenced via its task queue ref count
+        PersistentClientState* qos2State{nullptr};
+        uint16_t packetId{0};
+    };
+    void commitThreadFunc();
+    // writes and syncs the records appended so far, then sends their acknowledgements; requires mCommitMutex
+    void commit();
+    // removes what was written of a batch that failed to commit; requires mCommitMutex
+    void discardFailedBatch(int fd, off_t batchStart);
+    void openSegment(uint64_t number);
+
+    std::string mPathPrefix;
+    std::chrono::microseconds mGroupCommitInterval;
+
+    // held by whoever is currently writing a batch, so that rotate() doesn't switch files in the middle of it
+    std::mutex mCommitMutex;
+    std::mutex mMutex;
+    std::condition_variable mCV;
+    std::vector<uint8_t> mBuffer;
+    std::vector<PendingAck> mPendingAcks;
+    int mFd{-1};
+    SegmentRef mCurrentSegment;
+    bool mCurrentSegmentHasRecords{false};
+    std::vector<SegmentRef> mSealedSegments;
+    bool mShouldRun{true};
+    std::thread mCommitThread;
+};
+
+}
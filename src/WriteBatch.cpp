@@ -0,0 +1,35 @@
+#include "WriteBatch.hpp"
+#include "GlobalConfig.hpp"
+#include "MQTTClientConnection.hpp"
+#include <vector>
+
+namespace nioev::mqtt {
+
+static thread_local uint tWriteBatchDepth = 0;
+static thread_local std::vector<MQTTClientConnection*> tClientsToFlush;
+
+WriteBatchScope::WriteBatchScope()
+: mEnabled(getGlobalConfig().writeBatching) {
+    if(mEnabled)
+        tWriteBatchDepth += 1;
+}
+WriteBatchScope::~WriteBatchScope() {
+    if(!mEnabled)
+        return;
+    tWriteBatchDepth -= 1;
+    if(tWriteBatchDepth > 0)
+        return;
+    // flushing can't cause new clients to be scheduled as the depth is zero now, so iterating is safe
+    for(auto client: tClientsToFlush) {
+        client->flushSendTasks();
+    }
+    tClientsToFlush.clear();
+}
+bool WriteBatchScope::isActive() {
+    return tWriteBatchDepth > 0;
+}
+void WriteBatchScope::scheduleFlush(MQTTClientConnection& client) {
+    tClientsToFlush.emplace_back(&client);
+}
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Forward.hpp"
+
+namespace nioev::mqtt {
+
+/* While a WriteBatchScope is alive on the current thread (and write batching is enabled), data that is sent to clients is only
+ * queued. Once the outermost scope ends, every affected client is flushed with a single sendmsg call. This is basically TCP_CORK
+ * in user space: many small packets (e.g. a burst of QoS 0 publishes or PUBACKs) end up in a few large segments.
+ */
+class WriteBatchScope final {
+public:
+    WriteBatchScope();
+    ~WriteBatchScope();
+    WriteBatchScope(const WriteBatchScope&) = delete;
+    void operator=(const WriteBatchScope&) = delete;
+
+    static bool isActive();
+    static void scheduleFlush(MQTTClientConnection& client);
+private:
+    bool mEnabled{false};
+};
+
+}
@@ -4,6 +4,7 @@
 #include "ApplicationState.hpp"
 #include "BigString.hpp"
 #include "BigVector.hpp"
+#include "GlobalConfig.hpp"
 #include "scripting/ScriptContainerJS.hpp"
 #include "scripting/ScriptContainerManager.hpp"
 #include "TcpServer.hpp"
@@ -31,6 +32,7 @@ int main() {
 
     spdlog::set_level(spdlog::level::info);
     spdlog::set_pattern(nioev::lib::LOG_PATTERN);
+    getGlobalConfig().loadFromFile("config/config.json");
     ApplicationState app;
 
     RESTAPI rest;